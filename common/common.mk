@@ -23,6 +23,7 @@ SOCK_C = ${SOCK_TARGETS:=.c}
 SM_C = ${SOCKMAP_TARGETS:=.c}
 STREAM_C = ${SOCKSTREAM_TARGETS:=.c}
 SOCKDIR_C = ${SOCKDIR_TARGETS:=.c}
+CTSWEEP_C = ${CTSWEEP_TARGETS:=.c}
 XDP_OBJ = ${XDP_C:.c=.o}
 TC_OBJ = ${TC_C:.c=.o}
 TC_EOBJ = ${TC_EC:.c=.o}
@@ -31,6 +32,7 @@ SOCK_OBJ = ${SOCK_C:.c=.o}
 SM_OBJ = ${SM_C:.c=.o}
 STREAM_OBJ = ${STREAM_C:.c=.o}
 SOCKDIR_OBJ = ${SOCKDIR_C:.c=.o}
+CTSWEEP_OBJ = ${CTSWEEP_C:.c=.o}
 
 USER_C := ${USER_TARGETS:=.c}
 USER_OBJ := ${USER_C:.c=.o}
@@ -99,7 +101,7 @@ BPF_CFLAGS ?= -I$(LIBBPF_DIR)/build/usr/include/ -I../headers/ -I/usr/include/$(
 
 LIBS = $(OBJECT_LIBBPF) -lelf $(USER_LIBS) -lz -lpthread -lssl -lcrypto
 
-all: llvm-check $(USER_TARGETS) $(XDP_OBJ) $(TC_OBJ) $(TC_EOBJ) $(MON_OBJ) $(SOCK_OBJ) $(SM_OBJ) $(STREAM_OBJ) $(SOCKDIR_OBJ) $(USER_TARGETS_LIB)
+all: llvm-check $(USER_TARGETS) $(XDP_OBJ) $(TC_OBJ) $(TC_EOBJ) $(MON_OBJ) $(SOCK_OBJ) $(SM_OBJ) $(STREAM_OBJ) $(SOCKDIR_OBJ) $(CTSWEEP_OBJ) $(USER_TARGETS_LIB)
 
 .PHONY: clean $(CLANG) $(LLC)
 
@@ -107,8 +109,9 @@ clean:
 	rm -rf $(LIBBPF_DIR)/build
 	$(MAKE) -C $(LIBBPF_DIR) clean
 	$(MAKE) -C $(COMMON_DIR) clean
-	rm -f $(USER_TARGETS) $(XDP_OBJ) $(USER_OBJ) $(TC_OBJ) $(TC_EOBJ) $(MON_OBJ) $(MON_OBJ) $(SOCK_OBJ) $(SM_OBJ) $(STREAM_OBJ) $(SOCKDIR_OBJ) $(USER_TARGETS_LIB)
+	rm -f $(USER_TARGETS) $(XDP_OBJ) $(USER_OBJ) $(TC_OBJ) $(TC_EOBJ) $(MON_OBJ) $(MON_OBJ) $(SOCK_OBJ) $(SM_OBJ) $(STREAM_OBJ) $(SOCKDIR_OBJ) $(CTSWEEP_OBJ) $(USER_TARGETS_LIB)
 	rm -f loxilb_dp_debug 
+	rm -f llb_fw_bench llb_nat_bench
 	rm -f vmlinux vmlinux.h
 	rm -f *skel*.h
 	rm -f $@
@@ -148,6 +151,8 @@ $(COMMON_OBJS): %.o: %.h
 
 $(USER_TARGETS): %: %.c  $(OBJECT_LIBBPF) Makefile $(COMMON_MK) $(COMMON_OBJS) $(KERN_USER_H) $(EXTRA_DEPS) %.skel.h
 	$(CC) -Wall $(CFLAGS) $(LDFLAGS) -o loxilb_dp_debug loxilb_dp_debug.c $(COMMON_OBJS) $< $(LIBS)
+	$(CC) -Wall $(CFLAGS) $(LDFLAGS) -o llb_fw_bench ../utils/llb_fw_bench.c $(COMMON_OBJS) $< $(LIBS)
+	$(CC) -Wall $(CFLAGS) $(LDFLAGS) -o llb_nat_bench ../utils/llb_nat_bench.c $(COMMON_OBJS) $< $(LIBS)
 	@touch $@
 
 $(USER_TARGETS_LIB): %: $(USER_OBJ) $(COMMON_OBJS)
@@ -270,6 +275,22 @@ $(SOCKDIR_OBJ): %.o: %.c  Makefile $(COMMON_MK) $(KERN_USER_H) $(EXTRA_DEPS)
 		-O2 -g -c -o ${@:.o=.o} $<
 	@sudo cp $@ /opt/loxilb/
 
+# The sweeper needs BPF_MAP_TYPE_RINGBUF, so libbpf's uapi bpf.h goes
+# ahead of ../headers
+$(CTSWEEP_OBJ): %.o: %.c  Makefile $(COMMON_MK) $(KERN_USER_H) $(EXTRA_DEPS)
+	$(CLANG) \
+		-target bpf \
+		-D __BPF_TRACING__ \
+		-I$(LIBBPF_DIR)/../include/uapi/ \
+		$(BPF_CFLAGS) \
+		-Wall \
+		-Wno-unused-value \
+		-Wno-pointer-sign \
+		-Wno-compare-distinct-pointer-types \
+		-O2 -g -c -o ${@:.o=.o} $<
+	@sudo mkdir -p /opt/loxilb/
+	@sudo cp $@ /opt/loxilb/
+
 # Generate BPF skeletons
 %.skel.h: $(MON_OBJ)
 	$(call msg,GEN-SKEL,$@)
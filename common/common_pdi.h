@@ -164,7 +164,7 @@ struct pdi_key {
   PDI_TYPEDEF(16)    zone;
   PDI_TYPEDEF(16)    bd;
   PDI_TYPEDEF(8)     protocol;
-  PDI_TYPEDEF(8)     nr;
+  PDI_TYPEDEF(16)    nr;      /* Number of rules, set in entry 0 */
 };
 
 struct pdi6_key {
@@ -176,7 +176,7 @@ struct pdi6_key {
   PDI_TYPEDEF(16)    zone;
   PDI_TYPEDEF(16)    bd;
   PDI_TYPEDEF(8)     protocol;
-  PDI_TYPEDEF(8)     nr;
+  PDI_TYPEDEF(16)    nr;      /* Number of rules, set in entry 0 */
 };
 
 #endif
@@ -52,7 +52,8 @@ do {                                  \
   (x)->pm.pipe_act & (LLB_PIPE_RDR_MASK) &&   \
   !((x)->pm.phit & LLB_DP_SESS_HIT) &&        \
   ((x)->tm.tun_type == 0) &&                  \
-  (x)->l2m.dl_type == bpf_htons(ETH_P_IP) &&  \
+  ((x)->l2m.dl_type == bpf_htons(ETH_P_IP) || \
+   (x)->l2m.dl_type == bpf_htons(ETH_P_IPV6)) && \
   (x)->qm.ipolid == 0 &&                      \
   (x)->nm.npmhh == 0 &&                       \
   (x)->nm.xlate_proto == 0 &&                 \
@@ -224,6 +225,8 @@ struct dp_pi_mdi {
     __u16            fw_mid;
     __u16            fw_lid;
     __u16            fw_rid;
+    __u8             fw_bank;
+    __u16            fw_xlim;
 }__attribute__((packed));
 
 struct dp_fr_mdi {
@@ -300,16 +303,19 @@ struct dp_nat_mdi {
     __u32            pmhh[4];      /* Proxy for multi-homed hosts */
     __u64            npmhh;        /* No. of proxy multi-homed hosts */
     __u16            nxport;       /* NAT xport */
+    __u16            sel_aid;      /* Selected arm */
 #define LLB_PIPE_CT_NONE  0
 #define LLB_PIPE_CT_INP   1
 #define LLB_PIPE_CT_EST   2
     __u8            ct_sts;        /* Conntrack state */
-    __u8            sel_aid;
     __u8            nv6;
     __u8            xlate_proto;
     __u8            dsr:4;
     __u8            ppv2:4;
     __u8            cdis;
+    __u8            lcp;           /* Session counted in nat_lcp_map */
+    __u16           pad;
+    __u32           sel_sidx;      /* Stats id of selected arm */
     __u64           ito;
 };
 
@@ -13,6 +13,7 @@
 #define LLB_FP_IMG_BPF        "/opt/loxilb/llb_ebpf_main.o"
 #define LLB_FP_IMG_BPF_EGR    "/opt/loxilb/llb_ebpf_emain.o"
 #define LLB_SOCK_ADDR_IMG_BPF "/opt/loxilb/llb_kern_sock.o"
+#define LLB_CT_SWEEP_IMG_BPF  "/opt/loxilb/llb_kern_ctsweep.o"
 #define LLB_SOCK_MAP_IMG_BPF  "/opt/loxilb/llb_kern_sockmap.o"
 #define LLB_SOCK_DIR_IMG_BPF  "/opt/loxilb/llb_kern_sockdirect.o"
 #define LLB_SOCK_SP_IMG_BPF   "/opt/loxilb/llb_kern_sockstream.o"
@@ -29,23 +30,34 @@
 #define LLB_TMAC_MAP_ENTRIES  (2*1024)
 #define LLB_DMAC_MAP_ENTRIES  (8*1024)
 #define LLB_NATV4_MAP_ENTRIES (4*1024)
-#define LLB_NATV4_STAT_MAP_ENTRIES (4*16*1024) /* 16 end-points */
+#define LLB_NATV4_STAT_MAP_ENTRIES (4*16*1024) /* Arm stats ids */
 #define LLB_NAT_EP_MAP_ENTRIES (4*1024)
+#define LLB_NAT_XFRM_MAP_ENTRIES (128*1024)    /* Arms of all NAT rules */
+#define LLB_NAT_LC_EPS        (32)
+#define LLB_MAGLEV_MAP_ENTRIES (LLB_NATV4_MAP_ENTRIES)
+#define LLB_MAGLEV_TBL_SZ     (65537)  /* Prime and >> LLB_MAX_NXFRMS */
+#define LLB_WSEL_MAP_ENTRIES  (LLB_NATV4_MAP_ENTRIES)
+#define LLB_WSEL_TBL_SZ       (16*1024)
 #define LLB_SMAC_MAP_ENTRIES  (LLB_DMAC_MAP_ENTRIES)
 #define LLB_FW4_MAP_ENTRIES   (8*1024)
 #define LLB_FW6_MAP_ENTRIES   (1024)
+#define LLB_FW_MAP_BANKS      (2)
+#define LLB_FW4_TSS_MASKS     (32)
+#define LLB_MSTAT_STRIPES     (MAX_REAL_CPUS)
 #define LLB_INTERFACES        (512)
 #define LLB_PORT_NO           (LLB_INTERFACES-1)
 #define LLB_PORT_PIDX_START   (LLB_PORT_NO - 128)
 #define LLB_INTF_MAP_ENTRIES  (6*1024)
 #define LLB_FCV4_MAP_ENTRIES  (LLB_CT_MAP_ENTRIES)
+#define LLB_FCV6_MAP_ENTRIES  (LLB_CT_MAP_ENTRIES)
 #define LLB_PGM_MAP_ENTRIES   (8)
 #define LLB_FCV4_MAP_ACTS     (DP_SET_TOCP+1)
 #define LLB_POL_MAP_ENTRIES   (8*1024)
 #define LLB_SESS_MAP_ENTRIES  (20*1024)
 #define LLB_PPLAT_MAP_ENTRIES (2048)
 #define LLB_PSECS             (8)
-#define LLB_MAX_NXFRMS        (32)
+#define LLB_MAX_NXFRMS        (512)    /* Arms of a NAT rule */
+#define LLB_MAX_PROXY_EPS     (32)     /* Arms of a fullproxy NAT rule */
 #define LLB_CRC32C_ENTRIES    (256)
 #define LLB_MAX_MHOSTS        (3)
 #define LLB_MAX_SCTP_CHUNKS_INIT (8)
@@ -53,6 +65,7 @@
 #define LLB_SOCK_MAP_SZ       (17*1024)
 #define LLB_SOCKID_MAP_SZ     (17*1024)
 #define LLB_MAX_HOSTURL_LEN   (256)
+#define LLB_MAP_BATCH_SZ      (1024)
 
 #define LLB_DP_MASQ_PGM_ID     (7)
 #define LLB_DP_SUNP_PGM_ID2    (6)
@@ -63,7 +76,12 @@
 #define LLB_DP_PKT_SLOW_PGM_ID (1)
 #define LLB_DP_PKT_PGM_ID      (0)
 
-#define LLB_NAT_STAT_CID(rid, aid) ((((rid) & 0xfff) << 4) | (aid & 0xf))
+/* NAT stats are looked up by (rid, aid) id, which libdp maps to the
+ * stats id the datapath counts the arm under
+ */
+#define LLB_NAT_STAT_CID(rid, aid) ((((rid) & 0xfff) << 10) | ((aid) & 0x3ff))
+#define LLB_NAT_STAT_RID(cid)      (((cid) >> 10) & 0xfff)
+#define LLB_NAT_STAT_AID(cid)      ((cid) & 0x3ff)
 
 /* Hard-timeout of 120s for fc dp entry */
 #define FC_V4_DPTO            (120000000000)
@@ -151,6 +169,20 @@ enum llb_dp_tid {
   LL_DP_NAT_EP_MAP,
   LL_DP_SOCK_RWR_MAP,
   LL_DP_SOCK_PROXY_MAP,
+  LL_DP_FW_GEN_MAP,
+  LL_DP_FW4_TSS_MASK_MAP,
+  LL_DP_FW4_TSS_MAP,
+  LL_DP_FW4_XM_MAP,
+  LL_DP_RTV4_MSTATS_MAP,
+  LL_DP_NAT_MSTATS_MAP,
+  LL_DP_FW_MSTATS_MAP,
+  LL_DP_FC_GEN_MAP,
+  LL_DP_FCV6_MAP,
+  LL_DP_NAT_MAGLEV_MAP,
+  LL_DP_NAT_WSEL_MAP,
+  LL_DP_NAT_LCP_MAP,
+  LL_DP_NAT_LCP_DEC_MAP,
+  LL_DP_NAT_XFRM_MAP,
   LL_DP_MAX_MAP
 };
 
@@ -251,6 +283,9 @@ struct dp_nat_act {
   __u8 cdis;
   __u8 nmh;
   __u8 ppv2;
+  __u8 lcp;
+  __u8 pad[2];
+  __u32 sidx;
 };
 
 #define MIN_DP_POLICER_RATE  (8*1000*1000)  /* 1 MBps = 8 Mbps */
@@ -350,6 +385,17 @@ struct dp_fcv4_key {
 #endif
 };
 
+/* Fast-cache is not used for tunnelled IPv6, so no inner fields */
+struct dp_fcv6_key {
+  __u32 daddr[4];
+  __u32 saddr[4];
+  __u16 sport;
+  __u16 dport;
+  __u8  l4proto;
+  __u8  pad;
+  __u16 in_port;
+};
+
 struct dp_fc_tact {
   struct dp_cmn_act ca; /* Possible actions : See below */
   union {
@@ -373,7 +419,7 @@ struct dp_fc_tacts {
   struct dp_cmn_act ca;
   __u64 its;
   __u32 zone;
-  __u16 pad;
+  __u16 gen;                            /* fc_gen_map value at insert */
   __u16 pten;
   struct dp_fc_tact fcta[LLB_FCV4_MAP_ACTS];
 };
@@ -499,6 +545,14 @@ typedef struct dp_pb_stats dp_pb_stats_t;
 
 #define DP_ST_LTO  (10000000000ULL)
 
+/* Mmapable stats layout (HAVE_DP_MMAP_STATS) - Counters of index idx
+ * updated on CPU c live in slot (c % LLB_MSTAT_STRIPES) * entries + idx.
+ * Every stripe spans whole pages so that updates from different CPUs never
+ * share a cache line.
+ */
+#define LLB_MSTAT_SLOT(c, ents, idx) \
+  (((c) % LLB_MSTAT_STRIPES) * (ents) + (idx))
+
 struct dp_pbc_stats {
   dp_pb_stats_t st;
   uint64_t lts_used;
@@ -745,6 +799,49 @@ struct dp_ct_key {
   __u32 type;
 };
 
+/* In-kernel CT sweeper (llb_kern_ctsweep.c) */
+#define LLB_CT_SWEEP_RB_SZ    (1 << 22)
+#define LLB_CT_SWEEP_MAX_CPUS (256)
+
+#define LLB_CT_SWEEP_EV_X     0x1   /* Reverse entry was removed too */
+#define LLB_CT_SWEEP_EV_RST   0x2   /* Reset endpoint of key */
+#define LLB_CT_SWEEP_EV_XRST  0x4   /* Reset endpoint of xkey */
+#define LLB_CT_SWEEP_EV_NAT   0x8   /* Release NAT endpoint session */
+#define LLB_CT_SWEEP_EV_LCP   0x10  /* Release NAT_LB_SEL_LC_P2C session */
+
+struct dp_ct_sweep_arg {
+  __u64 now;
+  __u32 nr_cpus;
+  __s32 dir;
+  __u32 visited;
+  __u32 aged;
+  __u32 ev_full;
+  __u32 pad;
+};
+
+/* ct_sweep_act_map value : Packet count of a CT stats index and whether
+ * it was used as sampled by the sweep at ts
+ */
+struct dp_ct_sweep_act {
+  __u64 pkts;
+  __u64 ts;
+  __u32 used;
+  __u32 pad;
+};
+
+struct dp_ct_sweep_ev {
+  struct dp_ct_key key;
+  struct dp_ct_key xkey;
+  __u32 cidx;
+  __u32 xcidx;
+  __be32 seq;
+  __be32 xseq;
+  __u16 rid;
+  __u16 aid;
+  __u32 flags;
+  __u32 sidx;
+};
+
 struct dp_proxy_ct_ent {
   __u32 rid;
   __u32 aid;
@@ -778,6 +875,62 @@ struct dp_fwv6_ent {
   struct dp_fw_tact fwa;
 };
 
+/* fw_gen_map value : Active bank and lookup engine */
+#define LLB_FW_GEN_BANK       0x1
+#define LLB_FW_GEN_TSS        0x2
+#define LLB_FW_GEN_XM         0x4
+
+enum llb_fw_engine {
+  LLB_FW_ENGINE_LINEAR = 0,
+  LLB_FW_ENGINE_TSS    = 1,
+};
+
+/* Tuple space search (TSS) - Rules are grouped by their wildcard mask
+ * pattern. Each group is a hash table (keyed by mask id) holding
+ * masked rule keys along with their order in the linear table.
+ */
+struct dp_fw4_tss_key {
+  __u32 mid;
+  __u32 dest;
+  __u32 source;
+  __u16 dport;
+  __u16 sport;
+  __u16 inport;
+  __u16 zone;
+  __u16 bd;
+  __u8  protocol;
+  __u8  pad;
+};
+
+struct dp_fw4_tss_mask {
+  struct dp_fw4_tss_key m;
+  __u32 order;          /* Best rule order in this mask group */
+  __u32 valid;
+};
+
+struct dp_fw4_tss_ent {
+  __u32 order;
+  __u32 pad;
+  struct dp_fw_tact fwa;
+};
+
+/* Exact match table for fully specified rules (5-tuple and zone) */
+struct dp_fw4_xm_key {
+  __u32 dest;
+  __u32 source;
+  __u16 dport;
+  __u16 sport;
+  __u16 zone;
+  __u8  protocol;
+  __u8  bank;
+};
+
+struct dp_fw4_xm_ent {
+  __u32 nwc;            /* Wildcard rules ahead of this one */
+  __u32 pad;
+  struct dp_fw_tact fwa;
+};
+
 struct dp_nat_key {
   __u32 daddr[4];
   __u16 dport;
@@ -794,6 +947,10 @@ struct dp_nat_key {
 #define NAT_LB_SEL_LC 4
 #define NAT_LB_SEL_N2 5
 #define NAT_LB_SEL_N3 6
+#define NAT_LB_SEL_MAGLEV 7
+#define NAT_LB_SEL_WRR 8
+#define NAT_LB_SEL_WHASH 9
+#define NAT_LB_SEL_LC_P2C 10
 
 #define NAT_LB_PERSIST_TIMEOUT (10800000000000ULL)
 
@@ -803,20 +960,26 @@ struct dp_nat_key {
 
 #define NAT_LB_OP_CHKSRC 0x1
 
+/* NAT rule as handed to libdp. With LLB_MAX_NXFRMS arms inline it is about
+ * 24KB, so it is not meant for the stack. Only the arms in use go to the
+ * datapath (nat_xfrm_map, 56B each). sockproxy serves at most the first
+ * LLB_MAX_PROXY_EPS active arms of a DP_SET_FULLPROXY rule.
+ */
 struct dp_proxy_tacts {
   struct dp_cmn_act ca;
   uint64_t ito;
   uint64_t pto;
   struct bpf_spin_lock lock;
-  uint8_t nxfrm;
+  uint16_t nxfrm;
   uint8_t opflags;
   uint8_t cdis;
   uint8_t npmhh;
+  uint8_t pad0;
   uint16_t sel_hint;
   uint8_t sel_type;
   uint8_t sec_mode;
   uint8_t ppv2;
-  uint8_t pad1[7];
+  uint8_t pad1[5];
   uint64_t lts;
   uint64_t base_to;
   uint32_t pmhh[LLB_MAX_MHOSTS];
@@ -825,10 +988,73 @@ struct dp_proxy_tacts {
   uint8_t host_url[LLB_MAX_HOSTURL_LEN];
 };
 
+/* nat_map value : dp_proxy_tacts as installed by libdp. The arms are kept
+ * in nat_xfrm_map at [xbase, xbase + nxfrm) and counted under stats ids
+ * [sbase, sbase + nxfrm)
+ */
+struct dp_nat_tacts {
+  struct dp_cmn_act ca;
+  uint64_t ito;
+  uint64_t pto;
+  struct bpf_spin_lock lock;
+  uint16_t nxfrm;
+  uint16_t nactive;
+  uint32_t xbase;
+  uint32_t sbase;
+  uint16_t sel_hint;
+  uint8_t sel_type;
+  uint8_t opflags;
+  uint8_t cdis;
+  uint8_t npmhh;
+  uint8_t ppv2;
+  uint8_t pad1;
+  uint64_t lts;
+  uint64_t base_to;
+  uint32_t pmhh[LLB_MAX_MHOSTS];
+  uint16_t lc_amask;
+  uint8_t pad2[2];
+};
+
+/* nat_xfrm_map value : Arm #i of a NAT rule at xbase + i. act_aid is the
+ * arm id of the rule's i-th active arm (i < nactive), which lets every
+ * selection mode pick an active arm in O(1)
+ */
+struct dp_nat_xfrm {
+  struct mf_xfrm_inf xi;
+  __u16 act_aid;
+  __u8 pad[6];
+};
+
+/* nat_maglev_map value : Maglev lookup table of a NAT rule */
+struct dp_maglev_tbl {
+  __u16 ep[LLB_MAGLEV_TBL_SZ];
+};
+
+/* nat_wsel_map value : Weighted slot table of a NAT rule. Each active
+ * end-point owns wprio (normalized) slots, spread as per smooth WRR
+ */
+struct dp_wsel_tbl {
+  __u16 nslots;
+  __u8 pad[2];
+  __u16 ep[LLB_WSEL_TBL_SZ];
+};
+
+/* NAT_LB_SEL_LC works on the first LLB_NAT_LC_EPS/2 arms only */
 struct dp_nat_epacts {
   struct dp_cmn_act ca;
   struct bpf_spin_lock lock;
-  uint16_t active_sess[LLB_MAX_NXFRMS];
+  uint16_t active_sess[LLB_NAT_LC_EPS];
+};
+
+/* Session counters of NAT_LB_SEL_LC_P2C arms, indexed by arm stats id.
+ * nat_lcp_map is per-cpu and written only by the datapath (sessions
+ * opened - closed on that cpu) and nat_lcp_dec_map only by libdp
+ * (sessions it aged out), so the load of an arm is the sum over all cpus
+ * less the aged out count and no lock or atomic is needed
+ */
+struct dp_nat_lcp {
+  __u32 cnt;
+  __u32 pad;
 };
 
 /* This is currently based on ULCL classification scheme */
@@ -903,11 +1129,13 @@ struct dp_map_ita {
   void *next_key;
   size_t key_sz;
   void *val;
+  size_t val_sz;
   void *uarg;
 };
 typedef struct dp_map_ita dp_map_ita_t;
 
 void goMapNotiHandler(struct ll_dp_map_notif *mn);
+void goMapUpdDoneHandler(uint64_t cookie, int status);
 
 #define __force __attribute__((force))
 
@@ -920,6 +1148,73 @@ void goMapNotiHandler(struct ll_dp_map_notif *mn);
 #define DP_TC_PTR(x) ((void *)((long)x))
 #define DP_DIFF_PTR(x, y) (((uint8_t *)DP_TC_PTR(x)) - ((uint8_t *)DP_TC_PTR(y)))
 
+struct dp_ct_age_stats {
+  uint64_t cycles;        /* Completed CT sweep cycles */
+  uint64_t slices;        /* Aging invocations */
+  uint64_t last_cycle_ns; /* Wall time of last complete cycle */
+  uint64_t cur_cycle_ns;  /* Wall time of current cycle so far */
+  uint32_t visited;       /* Entries visited in current cycle */
+  uint32_t aged;          /* Entries aged in current cycle */
+  uint32_t last_aged;     /* Entries aged in last complete cycle */
+  uint32_t dir;           /* Direction being swept */
+};
+
+struct dp_ct_ager_stats {
+  uint64_t runs;          /* Chunks processed */
+  uint64_t visited;       /* Entries visited */
+  uint64_t aged;          /* Entries aged */
+  uint64_t busy_ns;       /* Time spent aging */
+};
+
+struct dp_ct_ridx_stats {
+  uint64_t idx_rm;        /* Endpoint removals served by (rid, aid) index */
+  uint64_t scan_rm;       /* Endpoint removals which needed a ct_map walk */
+  uint64_t visited;       /* CT entries visited through the index */
+  uint64_t removed;       /* CT entries removed */
+  uint32_t entries;       /* CT entries in index */
+  uint32_t sets;          /* (rid, aid) sets in index */
+  uint32_t active;        /* Index is currently in use */
+};
+
+struct dp_stats_cache_info {
+  uint64_t entries;       /* Stats indices cached */
+  uint64_t slots;         /* Allocated cache slots */
+  uint64_t mem_bytes;     /* Resident memory of the cache */
+};
+
+struct dp_map_lock_stats {
+  uint64_t acquired;      /* Table lock acquisitions */
+  uint64_t contended;     /* Acquisitions which had to wait */
+  uint64_t wait_ns;       /* Time spent waiting */
+};
+
+struct dp_map_upd_stats {
+  uint64_t submitted;     /* Async ops queued */
+  uint64_t completed;     /* Async ops completed */
+  uint64_t failed;        /* Async ops completed with error */
+  uint64_t coalesced;     /* Ops replaced by a later op to the same key */
+  uint64_t batches;       /* Bulk calls made */
+};
+
+struct dp_map_txn;
+
+struct dp_maglev_stats {
+  uint32_t tbl_sz;        /* Lookup table slots */
+  uint32_t n_eps;         /* Active endpoints in table */
+  uint64_t rebuilds;      /* Table rebuilds */
+  uint32_t changed;       /* Slots remapped by last rebuild */
+  uint64_t build_ns;      /* Time taken by last rebuild */
+};
+
+struct dp_map_txn_stats {
+  uint64_t commits;       /* Transactions committed */
+  uint64_t ops;           /* Ops committed */
+  uint64_t failed;        /* Commits with at least one failed op */
+  uint64_t last_ns;       /* Latency of last commit */
+  uint64_t max_ns;        /* Max commit latency */
+  uint64_t total_ns;      /* Sum of commit latencies */
+};
+
 /* Policer map stats update callback */
 typedef void (*dp_pts_cb_t)(uint32_t idx, struct dp_pol_stats *ps);
 /* Map stats update callback */
@@ -939,10 +1234,38 @@ void llb_clear_map_stats(int tbl, __u32 idx);
 int llb_add_map_elem(int tbl, void *k, void *v);
 int llb_del_map_elem_wval(int tbl, void *k, void *v);
 int llb_del_map_elem(int tbl, void *k);
+int llb_add_map_elems(int tbl, void *keys, uint32_t key_sz, void *vals,
+                      uint32_t val_sz, int n, int *status);
+int llb_del_map_elems(int tbl, void *keys, uint32_t key_sz, void *vals,
+                      uint32_t val_sz, int n, int *status);
 void llb_map_loop_and_delete(int tbl, dp_map_walker_t cb, dp_map_ita_t *it);
+void llb_map_loop_and_delete_batch(int tbl, dp_map_walker_t cb, dp_map_ita_t *it);
 int llb_dp_link_attach(const char *ifname, const char *psec, int mp_type, int unload);
 void llb_unload_kern_all(void);
 void llb_xh_lock(void);
 void llb_xh_unlock(void);
+int llb_get_ct_age_stats(struct dp_ct_age_stats *st);
+void llb_set_ct_age_slice(uint32_t max_ents, uint32_t max_us);
+int llb_get_ct_ager_stats(struct dp_ct_ager_stats *st, int max);
+int llb_get_ct_ridx_stats(struct dp_ct_ridx_stats *st);
+int llb_set_fw_engine(int engine);
+int llb_get_mmap_stats(int tbl, void **base, uint32_t *ents, uint32_t *stripes);
+int llb_get_stats_cache_info(int tbl, struct dp_stats_cache_info *info);
+int llb_get_map_lock_stats(int tbl, struct dp_map_lock_stats *st);
+int llb_add_map_elem_async(int tbl, void *k, uint32_t key_sz, void *v,
+                           uint32_t val_sz, uint64_t cookie);
+int llb_del_map_elem_async(int tbl, void *k, uint32_t key_sz, void *v,
+                           uint32_t val_sz, uint64_t cookie);
+int llb_map_upd_async_efd(void);
+int llb_get_map_upd_stats(struct dp_map_upd_stats *st);
+struct dp_map_txn *llb_map_txn_begin(void);
+int llb_map_txn_add(struct dp_map_txn *txn, int tbl, void *k, uint32_t key_sz,
+                    void *v, uint32_t val_sz);
+int llb_map_txn_del(struct dp_map_txn *txn, int tbl, void *k, uint32_t key_sz,
+                    void *v, uint32_t val_sz);
+int llb_map_txn_commit(struct dp_map_txn *txn, int *status);
+void llb_map_txn_abort(struct dp_map_txn *txn);
+int llb_get_map_txn_stats(struct dp_map_txn_stats *st);
+int llb_get_maglev_stats(uint32_t rid, struct dp_maglev_stats *st);
 
 #endif /* __LLB_DPAPI_H__ */
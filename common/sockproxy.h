@@ -36,7 +36,7 @@ struct proxy_fd_ent {
   pthread_rwlock_t lock;
   int used;
   int fd;
-#define MAX_PROXY_EP LLB_MAX_NXFRMS
+#define MAX_PROXY_EP (LLB_MAX_PROXY_EPS)
   int rfd[MAX_PROXY_EP];
   struct proxy_fd_ent *rfd_ent[MAX_PROXY_EP];
   int n_rfd;
@@ -42,6 +42,13 @@
    ((void)__sync_fetch_and_add(ptr, val))
 #endif
 
+/* Hides what clang knows of var so that range checks the verifier
+ * needs are not optimized out
+ */
+#ifndef barrier_var
+#define barrier_var(var) asm volatile("" : "+r"(var))
+#endif
+
 struct ll_xmdpi
 {
   __u16 iport;
@@ -192,10 +199,17 @@ struct bpf_map_def SEC("maps") ct_stats_map = {
 struct bpf_map_def SEC("maps") nat_map = {
   .type = BPF_MAP_TYPE_HASH,
   .key_size = sizeof(struct dp_nat_key),
-  .value_size = sizeof(struct dp_proxy_tacts),
+  .value_size = sizeof(struct dp_nat_tacts),
   .max_entries = LLB_NATV4_MAP_ENTRIES
 };
 
+struct bpf_map_def SEC("maps") nat_xfrm_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_nat_xfrm),
+  .max_entries = LLB_NAT_XFRM_MAP_ENTRIES
+};
+
 struct bpf_map_def SEC("maps") nat_stats_map = {
   .type = BPF_MAP_TYPE_PERCPU_ARRAY,
   .key_size = sizeof(__u32),  /* Counter Index */
@@ -210,6 +224,43 @@ struct bpf_map_def SEC("maps") nat_ep_map = {
   .max_entries = LLB_NAT_EP_MAP_ENTRIES
 };
 
+struct bpf_map_def SEC("maps") nat_maglev_map = {
+  .type = BPF_MAP_TYPE_HASH,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_maglev_tbl),
+  .map_flags = BPF_F_NO_PREALLOC,
+  .max_entries = LLB_MAGLEV_MAP_ENTRIES
+};
+
+struct bpf_map_def SEC("maps") nat_wsel_map = {
+  .type = BPF_MAP_TYPE_HASH,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_wsel_tbl),
+  .map_flags = BPF_F_NO_PREALLOC,
+  .max_entries = LLB_WSEL_MAP_ENTRIES
+};
+
+struct bpf_map_def SEC("maps") nat_rr_map = {
+  .type = BPF_MAP_TYPE_PERCPU_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(__u32),
+  .max_entries = LLB_NAT_EP_MAP_ENTRIES
+};
+
+struct bpf_map_def SEC("maps") nat_lcp_map = {
+  .type = BPF_MAP_TYPE_PERCPU_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_nat_lcp),
+  .max_entries = LLB_NATV4_STAT_MAP_ENTRIES
+};
+
+struct bpf_map_def SEC("maps") nat_lcp_dec_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_nat_lcp),
+  .max_entries = LLB_NATV4_STAT_MAP_ENTRIES
+};
+
 struct bpf_map_def SEC("maps") rt_v4_map = {
   .type = BPF_MAP_TYPE_LPM_TRIE,
   .key_size = sizeof(struct dp_rtv4_key),
@@ -270,6 +321,14 @@ struct bpf_map_def SEC("maps") fc_v4_map = {
   .max_entries = LLB_FCV4_MAP_ENTRIES
 };
 
+struct bpf_map_def SEC("maps") fc_v6_map = {
+  .type = BPF_MAP_TYPE_HASH,
+  .key_size = sizeof(struct dp_fcv6_key),
+  .value_size = sizeof(struct dp_fc_tacts),
+  .map_flags = BPF_F_NO_PREALLOC,
+  .max_entries = LLB_FCV6_MAP_ENTRIES
+};
+
 struct bpf_map_def SEC("maps") fc_v4_stats_map = {
   .type = BPF_MAP_TYPE_PERCPU_ARRAY,
   .key_size = sizeof(__u32),  /* Counter Index */
@@ -281,7 +340,7 @@ struct bpf_map_def SEC("maps") fw_v4_map = {
   .type = BPF_MAP_TYPE_ARRAY,
   .key_size = sizeof(__u32),
   .value_size = sizeof(struct dp_fwv4_ent),
-  .max_entries = LLB_FW4_MAP_ENTRIES
+  .max_entries = LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS
 };
 
 struct bpf_map_def SEC("maps") fw_stats_map = {
@@ -295,9 +354,74 @@ struct bpf_map_def SEC("maps") fw_v6_map = {
   .type = BPF_MAP_TYPE_ARRAY,
   .key_size = sizeof(__u32),
   .value_size = sizeof(struct dp_fwv6_ent),
-  .max_entries = LLB_FW6_MAP_ENTRIES
+  .max_entries = LLB_FW6_MAP_ENTRIES * LLB_FW_MAP_BANKS
+};
+
+struct bpf_map_def SEC("maps") fw_gen_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(__u32),
+  .max_entries = 2
+};
+
+struct bpf_map_def SEC("maps") fc_gen_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(__u32),
+  .max_entries = 1
+};
+
+struct bpf_map_def SEC("maps") fw4_tss_mask_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_fw4_tss_mask),
+  .max_entries = LLB_FW4_TSS_MASKS * LLB_FW_MAP_BANKS
+};
+
+struct bpf_map_def SEC("maps") fw4_tss_map = {
+  .type = BPF_MAP_TYPE_HASH,
+  .key_size = sizeof(struct dp_fw4_tss_key),
+  .value_size = sizeof(struct dp_fw4_tss_ent),
+  .max_entries = LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS
 };
 
+struct bpf_map_def SEC("maps") fw4_xm_map = {
+  .type = BPF_MAP_TYPE_HASH,
+  .key_size = sizeof(struct dp_fw4_xm_key),
+  .value_size = sizeof(struct dp_fw4_xm_ent),
+  .max_entries = LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS
+};
+
+#ifdef HAVE_DP_MMAP_STATS
+#ifndef BPF_F_MMAPABLE
+#define BPF_F_MMAPABLE (1U << 10)
+#endif
+
+struct bpf_map_def SEC("maps") rt_v4_mstats_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_pb_stats),
+  .map_flags = BPF_F_MMAPABLE,
+  .max_entries = LLB_RTV4_MAP_ENTRIES * LLB_MSTAT_STRIPES
+};
+
+struct bpf_map_def SEC("maps") nat_mstats_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_pb_stats),
+  .map_flags = BPF_F_MMAPABLE,
+  .max_entries = LLB_NATV4_STAT_MAP_ENTRIES * LLB_MSTAT_STRIPES
+};
+
+struct bpf_map_def SEC("maps") fw_mstats_map = {
+  .type = BPF_MAP_TYPE_ARRAY,
+  .key_size = sizeof(__u32),
+  .value_size = sizeof(struct dp_pb_stats),
+  .map_flags = BPF_F_MMAPABLE,
+  .max_entries = (LLB_FW4_MAP_ENTRIES + LLB_FW6_MAP_ENTRIES) * LLB_MSTAT_STRIPES
+};
+#endif
+
 struct bpf_map_def SEC("maps") pgm_tbl = {
   .type = BPF_MAP_TYPE_PROG_ARRAY,
   .key_size = sizeof(__u32),
@@ -319,6 +443,13 @@ struct bpf_map_def SEC("maps") xfck = {
   .max_entries = 1,
 };
 
+struct bpf_map_def SEC("maps") xfck6 = {
+  .type = BPF_MAP_TYPE_PERCPU_ARRAY,
+  .key_size = sizeof(int),  /* Index CPU idx */
+  .value_size = sizeof(struct dp_fcv6_key),
+  .max_entries = 1,
+};
+
 #else /* New BTF definitions */
 
 struct intf_map_d {
@@ -450,10 +581,18 @@ struct ct_stats_map_d {
 struct nat_map_d {
         __uint(type,        BPF_MAP_TYPE_HASH);
         __type(key,         struct dp_nat_key);
-        __type(value,       struct dp_proxy_tacts);
+        __type(value,       struct dp_nat_tacts);
         __uint(max_entries, LLB_NATV4_MAP_ENTRIES);
 } nat_map SEC(".maps");
 
+/* Arms of NAT rules, in ranges handed out by libdp */
+struct nat_xfrm_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_nat_xfrm);
+        __uint(max_entries, LLB_NAT_XFRM_MAP_ENTRIES);
+} nat_xfrm_map SEC(".maps");
+
 struct nat_stats_map_d {
         __uint(type,        BPF_MAP_TYPE_PERCPU_ARRAY);
         __type(key,         __u32);
@@ -468,6 +607,46 @@ struct nat_ep_map_d {
         __uint(max_entries, LLB_NAT_EP_MAP_ENTRIES);
 } nat_ep_map SEC(".maps");
 
+/* Maglev lookup tables, present only for NAT_LB_SEL_MAGLEV rules */
+struct nat_maglev_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         __u32);
+        __type(value,       struct dp_maglev_tbl);
+        __uint(map_flags,   BPF_F_NO_PREALLOC);
+        __uint(max_entries, LLB_MAGLEV_MAP_ENTRIES);
+} nat_maglev_map SEC(".maps");
+
+/* Weighted slot tables, present only for NAT_LB_SEL_WRR/WHASH rules */
+struct nat_wsel_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         __u32);
+        __type(value,       struct dp_wsel_tbl);
+        __uint(map_flags,   BPF_F_NO_PREALLOC);
+        __uint(max_entries, LLB_WSEL_MAP_ENTRIES);
+} nat_wsel_map SEC(".maps");
+
+/* Per-cpu RR/WRR cursor of each NAT rule */
+struct nat_rr_map_d {
+        __uint(type,        BPF_MAP_TYPE_PERCPU_ARRAY);
+        __type(key,         __u32);
+        __type(value,       __u32);
+        __uint(max_entries, LLB_NAT_EP_MAP_ENTRIES);
+} nat_rr_map SEC(".maps");
+
+struct nat_lcp_map_d {
+        __uint(type,        BPF_MAP_TYPE_PERCPU_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_nat_lcp);
+        __uint(max_entries, LLB_NATV4_STAT_MAP_ENTRIES);
+} nat_lcp_map SEC(".maps");
+
+struct nat_lcp_dec_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_nat_lcp);
+        __uint(max_entries, LLB_NATV4_STAT_MAP_ENTRIES);
+} nat_lcp_dec_map SEC(".maps");
+
 struct rt_v4_map_d {
         __uint(type,        BPF_MAP_TYPE_LPM_TRIE);
         __type(key,         struct dp_rtv4_key);
@@ -526,6 +705,13 @@ struct fc_v4_map_d {
         __uint(max_entries, LLB_FCV4_MAP_ENTRIES);
 } fc_v4_map SEC(".maps");
 
+struct fc_v6_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         struct dp_fcv6_key);
+        __type(value,       struct dp_fc_tacts);
+        __uint(max_entries, LLB_FCV6_MAP_ENTRIES);
+} fc_v6_map SEC(".maps");
+
 struct fc_v4_stats_map_d {
         __uint(type,        BPF_MAP_TYPE_PERCPU_ARRAY);
         __type(key,         __u32);
@@ -537,7 +723,7 @@ struct fw_v4_map_d {
         __uint(type,        BPF_MAP_TYPE_ARRAY);
         __type(key,         __u32);
         __type(value,       struct dp_fwv4_ent);
-        __uint(max_entries, LLB_FW4_MAP_ENTRIES);
+        __uint(max_entries, LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS);
 } fw_v4_map SEC(".maps");
 
 struct fw_stats_map_d {
@@ -551,9 +737,76 @@ struct fw_v6_map_d {
         __uint(type,        BPF_MAP_TYPE_ARRAY);
         __type(key,         __u32);
         __type(value,       struct dp_fwv6_ent);
-        __uint(max_entries, LLB_FW4_MAP_ENTRIES);
+        __uint(max_entries, LLB_FW6_MAP_ENTRIES * LLB_FW_MAP_BANKS);
 } fw_v6_map SEC(".maps");
 
+/* Active bank of fw_v4_map (0) and fw_v6_map (1) */
+struct fw_gen_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       __u32);
+        __uint(max_entries, 2);
+} fw_gen_map SEC(".maps");
+
+/* Current generation of fc_v4_map entries */
+struct fc_gen_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       __u32);
+        __uint(max_entries, 1);
+} fc_gen_map SEC(".maps");
+
+struct fw4_tss_mask_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_fw4_tss_mask);
+        __uint(max_entries, LLB_FW4_TSS_MASKS * LLB_FW_MAP_BANKS);
+} fw4_tss_mask_map SEC(".maps");
+
+struct fw4_tss_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         struct dp_fw4_tss_key);
+        __type(value,       struct dp_fw4_tss_ent);
+        __uint(max_entries, LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS);
+} fw4_tss_map SEC(".maps");
+
+struct fw4_xm_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         struct dp_fw4_xm_key);
+        __type(value,       struct dp_fw4_xm_ent);
+        __uint(max_entries, LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS);
+} fw4_xm_map SEC(".maps");
+
+#ifdef HAVE_DP_MMAP_STATS
+#ifndef BPF_F_MMAPABLE
+#define BPF_F_MMAPABLE (1U << 10)
+#endif
+
+struct rt_v4_mstats_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_pb_stats);
+        __uint(map_flags,   BPF_F_MMAPABLE);
+        __uint(max_entries, LLB_RTV4_MAP_ENTRIES * LLB_MSTAT_STRIPES);
+} rt_v4_mstats_map SEC(".maps");
+
+struct nat_mstats_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_pb_stats);
+        __uint(map_flags,   BPF_F_MMAPABLE);
+        __uint(max_entries, LLB_NATV4_STAT_MAP_ENTRIES * LLB_MSTAT_STRIPES);
+} nat_mstats_map SEC(".maps");
+
+struct fw_mstats_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_pb_stats);
+        __uint(map_flags,   BPF_F_MMAPABLE);
+        __uint(max_entries, (LLB_FW4_MAP_ENTRIES + LLB_FW6_MAP_ENTRIES) * LLB_MSTAT_STRIPES);
+} fw_mstats_map SEC(".maps");
+#endif
+
 struct pgm_tbl_d {
         __uint(type,        BPF_MAP_TYPE_PROG_ARRAY);
         __type(key,         __u32);
@@ -575,6 +828,13 @@ struct xfck_d {
         __uint(max_entries, 1);
 } xfck SEC(".maps");
 
+struct xfck6_d {
+        __uint(type,        BPF_MAP_TYPE_PERCPU_ARRAY);
+        __type(key,         int);
+        __type(value,       struct dp_fcv6_key);
+        __uint(max_entries, 1);
+} xfck6 SEC(".maps");
+
 struct crc32c_map_d {
         __uint(type,        BPF_MAP_TYPE_ARRAY);
         __type(key,         __u32);
@@ -624,6 +884,40 @@ dp_do_map_stats(void *ctx,
   void *map = NULL;
   int key = cidx;
 
+#ifdef HAVE_DP_MMAP_STATS
+  __u32 ents = 0;
+
+  switch (xtbl) {
+  case LL_DP_RTV4_STATS_MAP:
+    map = &rt_v4_mstats_map;
+    ents = LLB_RTV4_MAP_ENTRIES;
+    break;
+  case LL_DP_NAT_STATS_MAP:
+    map = &nat_mstats_map;
+    ents = LLB_NATV4_STAT_MAP_ENTRIES;
+    break;
+  case LL_DP_FW_STATS_MAP:
+    map = &fw_mstats_map;
+    ents = LLB_FW4_MAP_ENTRIES + LLB_FW6_MAP_ENTRIES;
+    break;
+  default:
+    break;
+  }
+
+  if (map) {
+    if (cidx < 0 || cidx >= ents) return;
+
+    /* CPUs beyond the stripe count share a stripe, hence atomics */
+    key = LLB_MSTAT_SLOT(bpf_get_smp_processor_id(), ents, cidx);
+    pb = bpf_map_lookup_elem(map, &key);
+    if (pb) {
+      __sync_fetch_and_add(&pb->bytes, xf->pm.l3_plen);
+      __sync_fetch_and_add(&pb->packets, 1);
+    }
+    return;
+  }
+#endif
+
   switch (xtbl) {
   case LL_DP_RTV4_STATS_MAP:
     map = &rt_v4_stats_map;
@@ -2462,13 +2756,123 @@ dp_swap_vlan_tag(void *ctx, struct xfi *xf, __be16 vlan)
   return 0;
 }
 
+static __u16 __always_inline
+dp_xdp_csum_fold(__u32 csum)
+{
+  csum = (csum & 0xffff) + (csum >> 16);
+  csum = (csum & 0xffff) + (csum >> 16);
+  return (__u16)~csum;
+}
+
+/* Incremental checksum update as per RFC 1624 */
+static void __always_inline
+dp_xdp_csum_upd(__u16 *sum, __u32 from, __u32 to)
+{
+  __u32 csum = (__u16)~*sum;
+
+  csum += (__u16)~(from >> 16) + (__u16)~(from & 0xffff);
+  csum += (to >> 16) + (to & 0xffff);
+  *sum = dp_xdp_csum_fold(csum);
+}
+
+/*
+ * dp_xdp_set_l34 - Rewrite IPv4 addresses and ports of a TCP, UDP or ICMP
+ * packet in place. Nothing is written unless all of it can be done. SCTP
+ * needs the CRC tail call of TC and fragments have no L4 header here, so
+ * those fail.
+ */
 static int __always_inline
-dp_do_snat(void *ctx, struct xfi *xf, __be32 xip, __be16 xport)
+dp_xdp_set_l34(void *ctx, struct xfi *xf,
+               __be32 sip, __be32 dip, __be16 sport, __be16 dport)
 {
-  /* FIXME - TBD */
+  void *dend = DP_TC_PTR(DP_PDATA_END(ctx));
+  struct iphdr *iph = DP_ADD_PTR(DP_PDATA(ctx), xf->pm.l3_off);
+  __u16 *l4sum = NULL;
+  __be16 *ports = NULL;
+  struct tcphdr *tcp;
+  struct udphdr *udp;
+
+  if (iph + 1 > dend || xf->l34m.frg) {
+    LLBS_PPLN_DROPC(xf, LLB_PIPE_RC_PLERR);
+    return -1;
+  }
+
+  if (xf->l34m.nw_proto == IPPROTO_TCP) {
+    tcp = DP_ADD_PTR(DP_PDATA(ctx), xf->pm.l4_off);
+    if (tcp + 1 > dend) {
+      LLBS_PPLN_DROPC(xf, LLB_PIPE_RC_PLERR);
+      return -1;
+    }
+    l4sum = (__u16 *)&tcp->check;
+    ports = &tcp->source;
+  } else if (xf->l34m.nw_proto == IPPROTO_UDP) {
+    udp = DP_ADD_PTR(DP_PDATA(ctx), xf->pm.l4_off);
+    if (udp + 1 > dend) {
+      LLBS_PPLN_DROPC(xf, LLB_PIPE_RC_PLERR);
+      return -1;
+    }
+    /* Zero UDP checksum means none */
+    if (udp->check) {
+      l4sum = (__u16 *)&udp->check;
+    }
+    ports = &udp->source;
+  } else if (xf->l34m.nw_proto != IPPROTO_ICMP) {
+    LLBS_PPLN_DROPC(xf, LLB_PIPE_RC_PLERR);
+    return -1;
+  }
+
+  /* ICMP checksum has no pseudo header, only the IP one changes */
+  if (iph->saddr != sip) {
+    dp_xdp_csum_upd((__u16 *)&iph->check, iph->saddr, sip);
+    if (l4sum) dp_xdp_csum_upd(l4sum, iph->saddr, sip);
+    iph->saddr = sip;
+  }
+
+  if (iph->daddr != dip) {
+    dp_xdp_csum_upd((__u16 *)&iph->check, iph->daddr, dip);
+    if (l4sum) dp_xdp_csum_upd(l4sum, iph->daddr, dip);
+    iph->daddr = dip;
+  }
+
+  if (!ports) {
+    return 0;
+  }
+
+  if (ports[0] != sport) {
+    if (l4sum) dp_xdp_csum_upd(l4sum, ports[0], sport);
+    ports[0] = sport;
+  }
+
+  if (ports[1] != dport) {
+    if (l4sum) dp_xdp_csum_upd(l4sum, ports[1], dport);
+    ports[1] = dport;
+  }
+
+  if (l4sum && xf->l34m.nw_proto == IPPROTO_UDP && *l4sum == 0) {
+    *l4sum = 0xffff;
+  }
+
   return 0;
 }
 
+static int __always_inline
+dp_do_snat(void *ctx, struct xfi *xf, __be32 xip, __be16 xport)
+{
+  __be32 sip = xip;
+  __be32 dip = xf->l34m.daddr4;
+
+  if (xip == 0) {
+    /* Hairpin nat to host */
+    sip = xf->l34m.daddr4;
+    dip = xf->l34m.saddr4;
+  } else if (xf->nm.nrip4) {
+    dip = xf->nm.nrip4;
+  }
+
+  return dp_xdp_set_l34(ctx, xf, sip, dip,
+                        xport ? xport : xf->l34m.source, xf->l34m.dest);
+}
+
 static int __always_inline
 dp_do_snat6(void *ctx, struct xfi *xf, __be32 *xip, __be16 xport)
 {
@@ -2479,8 +2883,18 @@ dp_do_snat6(void *ctx, struct xfi *xf, __be32 *xip, __be16 xport)
 static int __always_inline
 dp_do_dnat(void *ctx, struct xfi *xf, __be32 xip, __be16 xport)
 {
-  /* FIXME - TBD */
-  return 0;
+  __be32 sip = xf->l34m.saddr4;
+  __be32 dip = xip;
+
+  if (xip == 0) {
+    /* Hairpin nat to host */
+    sip = xf->l34m.daddr4;
+    dip = xf->l34m.saddr4;
+  } else if (xf->nm.nrip4) {
+    sip = xf->nm.nrip4;
+  }
+
+  return dp_xdp_set_l34(ctx, xf, sip, dip, xf->l34m.source, xport);
 }
 
 static int __always_inline
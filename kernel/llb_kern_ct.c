@@ -83,8 +83,22 @@ static void __always_inline
 dp_ct_related_fc_rm(struct dp_ct_key *ctk)
 {
   struct dp_fcv4_key key;
+  struct dp_fcv6_key key6;
 
-  if (ctk->v6 || ctk->ident || ctk->type) {
+  if (ctk->ident || ctk->type) {
+    return;
+  }
+
+  if (ctk->v6) {
+    DP_XADDR_CP(key6.daddr, ctk->daddr);
+    DP_XADDR_CP(key6.saddr, ctk->saddr);
+    key6.sport     = ctk->sport;
+    key6.dport     = ctk->dport;
+    key6.l4proto   = ctk->l4proto;
+    key6.pad       = 0;
+    key6.in_port   = 0;
+
+    bpf_map_delete_elem(&fc_v6_map, &key6);
     return;
   }
 
@@ -1715,6 +1729,8 @@ dp_ct_in(void *ctx, struct xfi *xf)
       adat->nat_act.doct = 1;
       adat->nat_act.rid = xf->pm.rule_id;
       adat->nat_act.aid = xf->nm.sel_aid;
+      adat->nat_act.sidx = xf->nm.sel_sidx;
+      adat->nat_act.lcp = xf->nm.lcp;
       adat->nat_act.nv6 = xf->nm.nv6 ? 1:0;
       adat->nat_act.dsr = xf->nm.dsr;
       adat->nat_act.cdis = xf->nm.cdis;
@@ -1753,6 +1769,8 @@ dp_ct_in(void *ctx, struct xfi *xf)
       axdat->nat_act.doct = 1;
       axdat->nat_act.rid = xf->pm.rule_id;
       axdat->nat_act.aid = xf->nm.sel_aid;
+      axdat->nat_act.sidx = xf->nm.sel_sidx;
+      axdat->nat_act.lcp = xf->nm.lcp;
       axdat->nat_act.nv6 = key.v6 ? 1:0;
       axdat->nat_act.dsr = xf->nm.dsr;
       axdat->nat_act.cdis = xf->nm.cdis;
@@ -1786,6 +1804,9 @@ dp_ct_in(void *ctx, struct xfi *xf)
 
     atdat = bpf_map_lookup_elem(&ct_map, &key);
     axtdat = bpf_map_lookup_elem(&ct_map, &xkey);
+    if (atdat != NULL && axtdat != NULL && xf->nm.lcp) {
+      dp_do_inc_nat_sess(xf);
+    }
   } else {
     axtdat = bpf_map_lookup_elem(&ct_map, &xkey);
     if (axtdat == NULL) {
@@ -1839,7 +1860,8 @@ dp_ct_in(void *ctx, struct xfi *xf)
       }
 
       if (xi->nat_flags) {
-        dp_do_dec_nat_sess(ctx, xf, atdat->ctd.rid, atdat->ctd.aid);
+        dp_do_dec_nat_sess(ctx, xf, atdat->ctd.rid, atdat->ctd.aid,
+                           &atdat->nat_act);
       }
     }
   }
@@ -0,0 +1,413 @@
+/*
+ *  llb_kern_ctsweep.c: LoxiLB Kernel eBPF conntrack sweeper
+ *  Copyright (c) 2022-2025 LoxiLB Authors
+ *
+ * SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+ */
+#include <string.h>
+
+#include <linux/stddef.h>
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <stdint.h>
+
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/common_pdi.h"
+#include "../common/llb_dpapi.h"
+#include "../common/llb_dp_mdi.h"
+
+struct bpf_map;
+
+char _license[] SEC("license") = "Dual BSD/GPL";
+
+/*
+ * ct_map, ct_stats_map and the fc maps are the datapath's own maps. libdp
+ * makes this object reuse their fds before load.
+ */
+struct ct_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         struct dp_ct_key);
+        __type(value,       struct dp_ct_tact);
+        __uint(max_entries, LLB_CT_MAP_ENTRIES);
+} ct_map SEC(".maps");
+
+struct ct_stats_map_d {
+        __uint(type,        BPF_MAP_TYPE_PERCPU_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_pb_stats);
+        __uint(max_entries, LLB_CT_MAP_ENTRIES);
+} ct_stats_map SEC(".maps");
+
+struct fc_v4_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         struct dp_fcv4_key);
+        __type(value,       struct dp_fc_tacts);
+        __uint(max_entries, LLB_FCV4_MAP_ENTRIES);
+} fc_v4_map SEC(".maps");
+
+struct fc_v6_map_d {
+        __uint(type,        BPF_MAP_TYPE_HASH);
+        __type(key,         struct dp_fcv6_key);
+        __type(value,       struct dp_fc_tacts);
+        __uint(max_entries, LLB_FCV6_MAP_ENTRIES);
+} fc_v6_map SEC(".maps");
+
+/* Packet count of each CT stats index as seen by the last sweep */
+struct ct_sweep_act_map_d {
+        __uint(type,        BPF_MAP_TYPE_ARRAY);
+        __type(key,         __u32);
+        __type(value,       struct dp_ct_sweep_act);
+        __uint(max_entries, LLB_CT_MAP_ENTRIES);
+} ct_sweep_act_map SEC(".maps");
+
+struct ct_sweep_ev_map_d {
+        __uint(type,        BPF_MAP_TYPE_RINGBUF);
+        __uint(max_entries, LLB_CT_SWEEP_RB_SZ);
+} ct_sweep_ev_map SEC(".maps");
+
+static __always_inline void
+ct_sweep_xkey(struct dp_ct_key *key, struct dp_ct_tact *adat,
+              struct dp_ct_key *xkey)
+{
+  nxfrm_inf_t *xi = &adat->ctd.xi;
+
+  __builtin_memset(xkey, 0, sizeof(*xkey));
+  DP_XADDR_CP(xkey->daddr, key->saddr);
+  DP_XADDR_CP(xkey->saddr, key->daddr);
+  xkey->sport = key->dport;
+  xkey->dport = key->sport;
+  xkey->l4proto = key->l4proto;
+  xkey->zone = key->zone;
+  xkey->v6 = key->v6;
+  xkey->ident = key->ident;
+  xkey->type = key->type;
+
+  if (xi->dsr || adat->ctd.pi.frag) {
+    return;
+  }
+
+  if (xi->nat_flags & LLB_NAT_DST) {
+    xkey->v6 = xi->nv6;
+    DP_XADDR_CP(xkey->saddr, xi->nat_xip);
+    if (!DP_XADDR_ISZR(xi->nat_rip)) {
+      DP_XADDR_CP(xkey->daddr, xi->nat_rip);
+    }
+    if (key->l4proto != IPPROTO_ICMP && xi->nat_xport) {
+      xkey->sport = xi->nat_xport;
+    }
+  }
+  if (xi->nat_flags & LLB_NAT_SRC) {
+    xkey->v6 = xi->nv6;
+    DP_XADDR_CP(xkey->daddr, xi->nat_xip);
+    if (!DP_XADDR_ISZR(xi->nat_rip)) {
+      DP_XADDR_CP(xkey->saddr, xi->nat_rip);
+    }
+    if (key->l4proto != IPPROTO_ICMP && xi->nat_xport) {
+      xkey->dport = xi->nat_xport;
+    }
+  }
+  if (xi->nat_flags & LLB_NAT_HDST) {
+    DP_XADDR_CP(xkey->saddr, key->saddr);
+    DP_XADDR_CP(xkey->daddr, key->daddr);
+    if (key->l4proto != IPPROTO_ICMP && xi->nat_xport) {
+      xkey->sport = xi->nat_xport;
+    }
+  }
+  if (xi->nat_flags & LLB_NAT_HSRC) {
+    DP_XADDR_CP(xkey->saddr, key->saddr);
+    DP_XADDR_CP(xkey->daddr, key->daddr);
+    if (key->l4proto != IPPROTO_ICMP && xi->nat_xport) {
+      xkey->dport = xi->nat_xport;
+    }
+  }
+}
+
+/* Same timeout rules as ll_ct_get_state() in libdp */
+static __always_inline void
+ct_sweep_state(struct dp_ct_key *key, struct dp_ct_tact *adat,
+               int *est, __u64 *to, int *bidir)
+{
+  struct dp_ct_dat *dat = &adat->ctd;
+
+  *bidir = 1;
+
+  if (key->l4proto == IPPROTO_TCP) {
+    ct_tcp_pinf_t *ts = &dat->pi.t;
+
+    if (ts->state & CT_TCP_FIN_MASK ||
+        ts->state & CT_TCP_ERR ||
+        ts->state & CT_TCP_SYNC_MASK ||
+        ts->state == CT_TCP_CLOSED) {
+      *to = CT_TCP_FN_CPTO;
+    } else if (ts->state == CT_TCP_EST ||
+               ts->state == CT_TCP_PEST) {
+      *est = 1;
+    }
+  } else if (key->l4proto == IPPROTO_UDP) {
+    ct_udp_pinf_t *us = &dat->pi.u;
+
+    *bidir = 0;
+
+    if (dat->pi.frag) {
+      *to = CT_UDP_FN_CPTO;
+    } else if (us->state & (CT_UDP_UEST|CT_UDP_EST)) {
+      *to = CT_UDP_EST_CPTO;
+      *est = 1;
+    } else {
+      *to = CT_UDP_FN_CPTO;
+    }
+  } else if (key->l4proto == IPPROTO_ICMP ||
+             key->l4proto == IPPROTO_ICMPV6) {
+    ct_icmp_pinf_t *is = &dat->pi.i;
+
+    if (is->state == CT_ICMP_REPS) {
+      *est = 1;
+      *to = CT_ICMP_EST_CPTO;
+    } else {
+      *to = CT_ICMP_FN_CPTO;
+    }
+  } else if (key->l4proto == IPPROTO_SCTP) {
+    ct_sctp_pinf_t *ss = &dat->pi.s;
+
+    if (ss->state & CT_SCTP_FIN_MASK ||
+        ss->state & CT_SCTP_ERR ||
+        (ss->state & CT_SCTP_INIT_MASK && ss->state != CT_SCTP_EST) ||
+        ss->state == CT_SCTP_CLOSED) {
+      *to = CT_SCTP_FN_CPTO;
+    } else if (ss->state == CT_SCTP_EST) {
+      *est = 1;
+    }
+  }
+}
+
+/*
+ * ct_sweep_used - Whether stats index cidx saw packets since the last
+ * sweep, which is what the cached "used" flag tells libdp. The answer is
+ * kept for the sweep (a->now), so that a run again after a full ring
+ * buffer doesn't take a flow busy until just now for an idle one.
+ */
+static __always_inline int
+ct_sweep_used(struct dp_ct_sweep_arg *a, __u32 cidx)
+{
+  struct dp_ct_sweep_act *last;
+  struct dp_pb_stats *ps;
+  __u64 pkts = 0;
+  __u32 c;
+
+  last = bpf_map_lookup_elem(&ct_sweep_act_map, &cidx);
+  if (!last) {
+    return 1;
+  }
+
+  if (last->ts == a->now) {
+    return last->used;
+  }
+
+  for (c = 0; c < LLB_CT_SWEEP_MAX_CPUS; c++) {
+    if (c >= a->nr_cpus) break;
+    ps = bpf_map_lookup_percpu_elem(&ct_stats_map, &cidx, c);
+    if (ps) {
+      pkts += ps->packets;
+    }
+  }
+
+  last->ts = a->now;
+  last->used = pkts != last->pkts;
+  last->pkts = pkts;
+
+  return last->used;
+}
+
+static __always_inline void
+ct_sweep_fc_rm(struct dp_ct_key *ctk)
+{
+  struct dp_fcv4_key key;
+  struct dp_fcv6_key key6;
+
+  if (ctk->ident || ctk->type) {
+    return;
+  }
+
+  if (ctk->v6) {
+    __builtin_memset(&key6, 0, sizeof(key6));
+    DP_XADDR_CP(key6.daddr, ctk->daddr);
+    DP_XADDR_CP(key6.saddr, ctk->saddr);
+    key6.sport     = ctk->sport;
+    key6.dport     = ctk->dport;
+    key6.l4proto   = ctk->l4proto;
+
+    bpf_map_delete_elem(&fc_v6_map, &key6);
+    return;
+  }
+
+  __builtin_memset(&key, 0, sizeof(key));
+  key.daddr      = ctk->daddr[0];
+  key.saddr      = ctk->saddr[0];
+  key.sport      = ctk->sport;
+  key.dport      = ctk->dport;
+  key.l4proto    = ctk->l4proto;
+
+  bpf_map_delete_elem(&fc_v4_map, &key);
+}
+
+static __always_inline void
+ct_sweep_act_rst(__u32 cidx)
+{
+  struct dp_ct_sweep_act *last;
+
+  last = bpf_map_lookup_elem(&ct_sweep_act_map, &cidx);
+  if (last) {
+    __builtin_memset(last, 0, sizeof(*last));
+  }
+}
+
+/*
+ * ct_sweep_rm - Remove an aged CT entry (and its reverse entry if any)
+ * and queue the work left for libdp. Returns 1 to stop the walk if the
+ * event can't be queued, in which case nothing is removed and the walk is
+ * run again once events are drained.
+ */
+static __always_inline long
+ct_sweep_rm(struct dp_ct_sweep_arg *a, struct dp_ct_key *key,
+            struct dp_ct_tact *adat, struct dp_ct_key *xkey,
+            struct dp_ct_tact *axdat, int aged)
+{
+  struct dp_ct_sweep_ev *ev;
+
+  ev = bpf_ringbuf_reserve(&ct_sweep_ev_map, sizeof(*ev), 0);
+  if (!ev) {
+    a->ev_full++;
+    return 1;
+  }
+
+  __builtin_memcpy(&ev->key, key, sizeof(ev->key));
+  ev->cidx = adat->ca.cidx;
+  ev->rid = adat->ctd.rid;
+  ev->aid = adat->ctd.aid;
+  ev->seq = adat->ctd.pi.t.tcp_cts[CT_DIR_IN].pack;
+  ev->flags = 0;
+  ev->sidx = 0;
+  ev->xcidx = 0;
+  ev->xseq = 0;
+  __builtin_memset(&ev->xkey, 0, sizeof(ev->xkey));
+
+  if (aged) {
+    if (key->l4proto == IPPROTO_TCP && adat->ctd.pi.t.state == CT_TCP_EST) {
+      ev->flags |= LLB_CT_SWEEP_EV_RST;
+    }
+    if (adat->ctd.xi.nat_flags) {
+      ev->flags |= LLB_CT_SWEEP_EV_NAT;
+    }
+    if ((adat->ca.act_type == DP_SET_SNAT ||
+         adat->ca.act_type == DP_SET_DNAT) && adat->nat_act.lcp) {
+      ev->flags |= LLB_CT_SWEEP_EV_LCP;
+      ev->sidx = adat->nat_act.sidx;
+    }
+  }
+
+  if (xkey && axdat) {
+    __builtin_memcpy(&ev->xkey, xkey, sizeof(ev->xkey));
+    ev->xcidx = axdat->ca.cidx;
+    ev->xseq = axdat->ctd.pi.t.tcp_cts[CT_DIR_IN].pack;
+    ev->flags |= LLB_CT_SWEEP_EV_X;
+    if (xkey->l4proto == IPPROTO_TCP && axdat->ctd.pi.t.state == CT_TCP_EST) {
+      ev->flags |= LLB_CT_SWEEP_EV_XRST;
+    }
+    ct_sweep_act_rst(axdat->ca.cidx);
+    bpf_map_delete_elem(&ct_map, xkey);
+    ct_sweep_fc_rm(xkey);
+  }
+
+  ct_sweep_act_rst(adat->ca.cidx);
+  ct_sweep_fc_rm(key);
+  bpf_map_delete_elem(&ct_map, key);
+
+  bpf_ringbuf_submit(ev, 0);
+  a->aged++;
+
+  return 0;
+}
+
+/* Same aging rules as ll_ct_map_ent_has_aged() in libdp */
+static long
+ct_sweep_ent(struct bpf_map *map, struct dp_ct_key *key,
+             struct dp_ct_tact *adat, struct dp_ct_sweep_arg *a)
+{
+  struct dp_ct_tact *axdat = NULL;
+  struct dp_ct_key xkey;
+  __u64 to = CT_V4_CPTO;
+  __u64 latest;
+  int est = 0;
+  int bidir = 1;
+  int used1, used2;
+  int any_used;
+
+  a->visited++;
+
+  if (a->dir >= 0 && a->dir != adat->ctd.dir) {
+    return 0;
+  }
+
+  ct_sweep_xkey(key, adat, &xkey);
+
+  if (!adat->ctd.pi.frag) {
+    axdat = bpf_map_lookup_elem(&ct_map, &xkey);
+    if (!axdat) {
+      ct_sweep_state(key, adat, &est, &to, &bidir);
+      if (est && a->now - adat->lts < CT_MISMATCH_FN_CPTO) {
+        return 0;
+      }
+      return ct_sweep_rm(a, key, adat, NULL, NULL, 0);
+    }
+  }
+
+  latest = adat->lts;
+  if (axdat && axdat->lts > latest) {
+    latest = axdat->lts;
+  }
+
+  used1 = ct_sweep_used(a, adat->ca.cidx);
+  used2 = axdat ? ct_sweep_used(a, axdat->ca.cidx) : 0;
+
+  ct_sweep_state(key, adat, &est, &to, &bidir);
+
+  if (a->now < latest) return 0;
+
+  if (est && adat->ito != 0) {
+    to = adat->ito;
+  }
+
+  if (bidir) {
+    any_used = used1 && used2;
+  } else {
+    any_used = used1 || used2;
+  }
+
+  if (a->now - latest > to && (!est || !any_used)) {
+    return ct_sweep_rm(a, key, adat, axdat ? &xkey : NULL, axdat, 1);
+  }
+
+  return 0;
+}
+
+SEC("syscall")
+int llb_ct_sweep(struct dp_ct_sweep_arg *ctx)
+{
+  struct dp_ct_sweep_arg a;
+
+  __builtin_memset(&a, 0, sizeof(a));
+  a.now = ctx->now;
+  a.nr_cpus = ctx->nr_cpus;
+  a.dir = ctx->dir;
+
+  bpf_for_each_map_elem(&ct_map, ct_sweep_ent, &a, 0);
+
+  ctx->visited = a.visited;
+  ctx->aged = a.aged;
+  ctx->ev_full = a.ev_full;
+
+  return 0;
+}
@@ -371,6 +371,48 @@ static int __always_inline
 dp_insert_fcv4(void *ctx, struct xfi *xf, struct dp_fc_tacts *acts)
 {
   struct dp_fcv4_key *key;
+  struct dp_fc_tacts *ex;
+  int z = 0;
+
+  key = bpf_map_lookup_elem(&xfck, &z);
+  if (key == NULL) {
+    return -1;
+  }
+
+  ex = bpf_map_lookup_elem(&fc_v4_map, key);
+  if (ex != NULL && ex->gen == acts->gen) {
+    return 1;
+  }
+  
+  bpf_map_update_elem(&fc_v4_map, key, acts, BPF_ANY);
+  return 0;
+}
+
+static int __always_inline
+dp_insert_fcv6(void *ctx, struct xfi *xf, struct dp_fc_tacts *acts)
+{
+  struct dp_fcv6_key *key;
+  struct dp_fc_tacts *ex;
+  int z = 0;
+
+  key = bpf_map_lookup_elem(&xfck6, &z);
+  if (key == NULL) {
+    return -1;
+  }
+
+  ex = bpf_map_lookup_elem(&fc_v6_map, key);
+  if (ex != NULL && ex->gen == acts->gen) {
+    return 1;
+  }
+
+  bpf_map_update_elem(&fc_v6_map, key, acts, BPF_ANY);
+  return 0;
+}
+
+static int __always_inline
+dp_insert_fc(void *ctx, struct xfi *xf, struct dp_fc_tacts *acts)
+{
+  __u32 *gen;
   int z = 0;
   int *oif;
   int pkey = xf->pm.oport;
@@ -382,18 +424,14 @@ dp_insert_fcv4(void *ctx, struct xfi *xf, struct dp_fc_tacts *acts)
 
   BPF_TRACE_PRINTK("[FCH] tbl insert");
 
-  key = bpf_map_lookup_elem(&xfck, &z);
-  if (key == NULL) {
-    return -1;
-  }
+  gen = bpf_map_lookup_elem(&fc_gen_map, &z);
+  acts->gen = gen ? *gen : 0;
+  acts->pten = xf->pm.pten;
 
-  if (bpf_map_lookup_elem(&fc_v4_map, key) != NULL) {
-    return 1;
+  if (xf->l2m.dl_type == bpf_htons(ETH_P_IP)) {
+    return dp_insert_fcv4(ctx, xf, acts);
   }
-  
-  acts->pten = xf->pm.pten;
-  bpf_map_update_elem(&fc_v4_map, key, acts, BPF_ANY);
-  return 0;
+  return dp_insert_fcv6(ctx, xf, acts);
 }
 
 /*
@@ -465,7 +503,7 @@ dp_ingress_slow_main(struct __sk_buff *ctx,  struct xfi *xf)
   /* fast-cache is used only when certain conditions are met */
   if (LLB_PIPE_FC_CAP(xf)) {
     fa->zone = xf->pm.zone;
-    dp_insert_fcv4(ctx, xf, fa);
+    dp_insert_fc(ctx, xf, fa);
   }
 #endif
 
@@ -93,7 +93,11 @@ int  xdp_packet_func(struct xdp_md *ctx)
   }
 #endif
 
+#if defined(HAVE_DP_FC) && !defined(HAVE_DP_LAT)
+  return dp_xdp_ingress_fast_main(ctx, xf);
+#else
   return DP_PASS;
+#endif
 }
 
 SEC("xdp_pass")
@@ -35,13 +35,46 @@ dp_mk_fcv4_key(struct xfi *xf, struct dp_fcv4_key *key)
   return 0;
 }
 
+static int  __always_inline
+dp_mk_fcv6_key(struct xfi *xf, struct dp_fcv6_key *key)
+{
+  DP_XADDR_CP(key->daddr, xf->l34m.daddr);
+  DP_XADDR_CP(key->saddr, xf->l34m.saddr);
+  key->sport      = xf->l34m.source;
+  key->dport      = xf->l34m.dest;
+  key->l4proto    = xf->l34m.nw_proto;
+  key->pad        = 0;
+  key->in_port    = 0;
+
+  return 0;
+}
+
+/* Entries from before the last invalidation are a miss */
 static int __always_inline
-dp_do_fcv4_lkup(void *ctx, struct xfi *xf, int *oif)
+dp_fc_ent_stale(struct dp_fc_tacts *acts)
+{
+  __u32 *gen;
+  int z = 0;
+
+  gen = bpf_map_lookup_elem(&fc_gen_map, &z);
+  if (gen && acts->gen != (__u16)*gen) {
+    return 1;
+  }
+
+#ifdef HAVE_DP_FC_TMO
+  if (bpf_ktime_get_ns() - acts->its > FC_V4_DPTO) {
+    return 1;
+  }
+#endif
+
+  return 0;
+}
+
+static __always_inline struct dp_fc_tacts *
+dp_fcv4_lkup(struct xfi *xf)
 {
   struct dp_fcv4_key key;
   struct dp_fc_tacts *acts;
-  struct dp_fc_tact *ta;
-  int ret = 1;
   int z = 0;
 
   dp_mk_fcv4_key(xf, &key);
@@ -54,19 +87,68 @@ dp_do_fcv4_lkup(void *ctx, struct xfi *xf, int *oif)
      */
     BPF_FC_PRINTK("[FCH4] lkup miss");
     bpf_map_update_elem(&xfck, &z, &key, BPF_ANY);
-    return 0; 
+    return NULL;
   }
 
-#ifdef HAVE_DP_FC_TMO
-  /* Check timeout */ 
-  if (bpf_ktime_get_ns() - acts->its > FC_V4_DPTO) {
-    BPF_FC_PRINTK("[FCH4] hto");
+  if (dp_fc_ent_stale(acts)) {
+    BPF_FC_PRINTK("[FCH4] stale");
     bpf_map_update_elem(&xfck, &z, &key, BPF_ANY);
     bpf_map_delete_elem(&fc_v4_map, &key);
     xf->pm.rcode |= LLB_PIPE_RC_FCTO;
-    return 0; 
+    return NULL;
+  }
+
+  return acts;
+}
+
+static __always_inline struct dp_fc_tacts *
+dp_fcv6_lkup(struct xfi *xf)
+{
+  struct dp_fcv6_key key;
+  struct dp_fc_tacts *acts;
+  int z = 0;
+
+  dp_mk_fcv6_key(xf, &key);
+
+  xf->pm.table_id = LL_DP_FCV6_MAP;
+  acts = bpf_map_lookup_elem(&fc_v6_map, &key);
+  if (!acts) {
+    BPF_FC_PRINTK("[FCH6] lkup miss");
+    bpf_map_update_elem(&xfck6, &z, &key, BPF_ANY);
+    return NULL;
+  }
+
+  if (dp_fc_ent_stale(acts)) {
+    BPF_FC_PRINTK("[FCH6] stale");
+    bpf_map_update_elem(&xfck6, &z, &key, BPF_ANY);
+    bpf_map_delete_elem(&fc_v6_map, &key);
+    xf->pm.rcode |= LLB_PIPE_RC_FCTO;
+    return NULL;
+  }
+
+  return acts;
+}
+
+/*
+ * dp_do_fc_lkup - Look up the fast-cache of the packet's family and apply
+ * the cached actions. Both families share the same action set.
+ */
+static int __always_inline
+dp_do_fc_lkup(void *ctx, struct xfi *xf, int *oif)
+{
+  struct dp_fc_tacts *acts;
+  struct dp_fc_tact *ta;
+  int ret = 1;
+
+  if (xf->l2m.dl_type == bpf_htons(ETH_P_IP)) {
+    acts = dp_fcv4_lkup(xf);
+  } else {
+    acts = dp_fcv6_lkup(xf);
+  }
+
+  if (!acts) {
+    return 0;
   }
-#endif
 
   if (acts->ca.ftrap) {
     xf->pm.rcode |= LLB_PIPE_RC_FCBP;
@@ -95,7 +177,7 @@ dp_do_fcv4_lkup(void *ctx, struct xfi *xf, int *oif)
     }
 
     dp_pipe_set_nat(ctx, xf, &ta->nat_act, 1);
-    dp_do_map_stats(ctx, xf, LL_DP_NAT_STATS_MAP, LLB_NAT_STAT_CID(ta->nat_act.rid, ta->nat_act.aid));
+    dp_do_map_stats(ctx, xf, LL_DP_NAT_STATS_MAP, ta->nat_act.sidx);
   } else if (acts->fcta[DP_SET_DNAT].ca.act_type == DP_SET_DNAT) {
     BPF_FC_PRINTK("[FCH4] dnat-act");
     ta = &acts->fcta[DP_SET_DNAT];
@@ -106,7 +188,7 @@ dp_do_fcv4_lkup(void *ctx, struct xfi *xf, int *oif)
     }
 
     dp_pipe_set_nat(ctx, xf, &ta->nat_act, 0);
-    dp_do_map_stats(ctx, xf, LL_DP_NAT_STATS_MAP, LLB_NAT_STAT_CID(ta->nat_act.rid, ta->nat_act.aid));
+    dp_do_map_stats(ctx, xf, LL_DP_NAT_STATS_MAP, ta->nat_act.sidx);
   }
 
 #ifdef HAVE_DP_EXTFC
@@ -202,8 +284,9 @@ static int __always_inline
   __u32 idx = LLB_DP_PKT_SLOW_PGM_ID;
   BPF_FC_PRINTK("[FCHM] Main--");
   if (xf->pm.pipe_act == 0 &&
-      xf->l2m.dl_type == bpf_ntohs(ETH_P_IP)) {
-    if (dp_do_fcv4_lkup(ctx, xf, &oif) == 1) {
+      (xf->l2m.dl_type == bpf_ntohs(ETH_P_IP) ||
+       xf->l2m.dl_type == bpf_ntohs(ETH_P_IPV6))) {
+    if (dp_do_fc_lkup(ctx, xf, &oif) == 1) {
       if (xf->pm.pipe_act == LLB_PIPE_RDR) {
         dp_unparse_packet_always(ctx, xf);
         dp_unparse_packet(ctx, xf, 0);
@@ -221,3 +304,122 @@ static int __always_inline
   TRACER_CALL(ctx, xf);
   return DP_DROP;
 }
+
+#ifndef LL_TC_EBPF
+/*
+ * XDP fast-path - Forward fast-cache hits before an skb gets allocated.
+ * Only untunnelled IPv4 TCP/UDP/ICMP flows with NAT, L2 neighbor and VLAN
+ * actions are handled here. Everything else, including fast-cache
+ * learning, is left to the TC pipeline by returning DP_PASS untouched.
+ *
+ * The devmap redirect skips the TC egress hook. It has nothing to do for
+ * packets the TC fast path redirects either, as those are stamped at
+ * ingress. DP_EG_ACCOUNTING() is a no-op in XDP, so flows with trace on
+ * are left to TC. With HAVE_DP_LAT the fast path is not used at all so
+ * that latency samples still cover every packet.
+ */
+static int __always_inline
+dp_xdp_fc_nat_ok(struct dp_fc_tact *ta)
+{
+  struct dp_nat_act *na = &ta->nat_act;
+
+  return !(na->fr || na->doct || na->nv6 || na->nmh || na->ppv2);
+}
+
+static int __always_inline
+dp_xdp_ingress_fast_main(struct xdp_md *ctx, struct xfi *xf)
+{
+  struct dp_fc_tacts *acts;
+  struct dp_fc_tact *ta;
+  struct dp_nat_act *na = NULL;
+  int ret;
+
+  if (xf->pm.pipe_act != 0 ||
+      xf->l2m.dl_type != bpf_htons(ETH_P_IP) ||
+      (xf->l34m.nw_proto != IPPROTO_TCP &&
+       xf->l34m.nw_proto != IPPROTO_UDP &&
+       xf->l34m.nw_proto != IPPROTO_ICMP) ||
+      xf->l34m.frg || xf->tm.tun_type || xf->pm.l4fin) {
+    return DP_PASS;
+  }
+
+  acts = dp_fcv4_lkup(xf);
+  if (!acts) {
+    return DP_PASS;
+  }
+
+  /* A zero oaux means tx_intf_map had no port at insert time */
+  if (acts->ca.ftrap || acts->pten || acts->ca.oaux == 0) {
+    return DP_PASS;
+  }
+
+#ifdef HAVE_DP_EXTFC
+  if (acts->fcta[DP_SET_RM_VXLAN].ca.act_type == DP_SET_RM_VXLAN ||
+      acts->fcta[DP_SET_RT_TUN_NH].ca.act_type == DP_SET_RT_TUN_NH ||
+      acts->fcta[DP_SET_L3RT_TUN_NH].ca.act_type == DP_SET_L3RT_TUN_NH ||
+      acts->fcta[DP_SET_NEIGH_VXLAN].ca.act_type == DP_SET_NEIGH_VXLAN) {
+    return DP_PASS;
+  }
+#endif
+
+  /* Nothing is written to the packet until all actions are known good */
+  if (acts->fcta[DP_SET_SNAT].ca.act_type == DP_SET_SNAT) {
+    ta = &acts->fcta[DP_SET_SNAT];
+    if (!dp_xdp_fc_nat_ok(ta)) return DP_PASS;
+    na = &ta->nat_act;
+    dp_pipe_set_nat(ctx, xf, na, 1);
+  } else if (acts->fcta[DP_SET_DNAT].ca.act_type == DP_SET_DNAT) {
+    ta = &acts->fcta[DP_SET_DNAT];
+    if (!dp_xdp_fc_nat_ok(ta)) return DP_PASS;
+    na = &ta->nat_act;
+    dp_pipe_set_nat(ctx, xf, na, 0);
+  }
+
+  if (acts->fcta[DP_SET_NEIGH_L2].ca.act_type != DP_SET_NEIGH_L2) {
+    return DP_PASS;
+  }
+  dp_do_rt_l2_nh(ctx, xf, &acts->fcta[DP_SET_NEIGH_L2].nl2);
+
+  if (acts->fcta[DP_SET_ADD_L2VLAN].ca.act_type == DP_SET_ADD_L2VLAN) {
+    ta = &acts->fcta[DP_SET_ADD_L2VLAN];
+    dp_set_egr_vlan(ctx, xf, ta->l2ov.vlan, ta->l2ov.oport);
+  } else if (acts->fcta[DP_SET_RM_L2VLAN].ca.act_type == DP_SET_RM_L2VLAN) {
+    ta = &acts->fcta[DP_SET_RM_L2VLAN];
+    dp_set_egr_vlan(ctx, xf, 0, ta->l2ov.oport);
+  } else {
+    return DP_PASS;
+  }
+
+  if (na && !xf->nm.dsr) {
+    if (xf->pm.nf & LLB_NAT_DST) {
+      ret = dp_do_dnat(ctx, xf, xf->nm.nxip4, xf->nm.nxport);
+    } else {
+      ret = dp_do_snat(ctx, xf, xf->nm.nxip4, xf->nm.nxport);
+    }
+    if (ret != 0) {
+      return DP_PASS;
+    }
+  }
+
+  /* From here the packet is modified and can't be passed up any more */
+  if (dp_do_out_vlan(ctx, xf) != 0) {
+    return DP_DROP;
+  }
+
+  xf->pm.phit |= LLB_DP_FC_HIT;
+  DP_RUN_CT_HELPER(xf);
+
+  if (na) {
+    dp_do_map_stats(ctx, xf, LL_DP_NAT_STATS_MAP, na->sidx);
+  }
+  if (acts->ca.fwrid != 0) {
+    dp_do_map_stats(ctx, xf, LL_DP_FW_STATS_MAP, acts->ca.fwrid);
+  }
+  dp_do_map_stats(ctx, xf, LL_DP_CT_STATS_MAP, acts->ca.cidx);
+
+  DP_EG_ACCOUNTING(ctx, xf);
+
+  BPF_FC_PRINTK("[FCHX] oport %d", xf->pm.oport);
+  return bpf_redirect_map(&tx_intf_map, xf->pm.oport, 0);
+}
+#endif
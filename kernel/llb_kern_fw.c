@@ -30,12 +30,93 @@
   ((PDI_MATCH(&(v1)->protocol, &(v2)->protocol)))     &&    \
   ((PDI_MATCH(&(v1)->bd, &(v2)->bd))))
 
+/*
+ * dp_do_fw4_xm_lkup - Lookup of fully specified rules of the active bank
+ */
+static __always_inline struct dp_fw4_xm_ent *
+dp_do_fw4_xm_lkup(struct xfi *xf, struct pdi_key *pk)
+{
+  struct dp_fw4_xm_key xk;
+
+  memset(&xk, 0, sizeof(xk));
+  xk.dest = pk->dest.val;
+  xk.source = pk->source.val;
+  xk.dport = pk->dport.u.v.val;
+  xk.sport = pk->sport.u.v.val;
+  xk.zone = pk->zone.val;
+  xk.protocol = pk->protocol.val;
+  xk.bank = xf->pm.fw_bank;
+
+  return bpf_map_lookup_elem(&fw4_xm_map, &xk);
+}
+
+/*
+ * dp_do_fw4_tss_lkup - Tuple space search over the mask groups of the
+ * active bank. Groups are kept sorted by their best rule order so the
+ * search stops as soon as no later group can hold a better match.
+ */
+static __always_inline struct dp_fw_tact *
+dp_do_fw4_tss_lkup(struct xfi *xf, struct pdi_key *pk,
+                   struct dp_fw4_xm_ent *xe)
+{
+  struct dp_fw4_tss_key key;
+  struct dp_fw4_tss_mask *m;
+  struct dp_fw4_tss_ent *ent;
+  struct dp_fw_tact *act = NULL;
+  __u32 best = (__u32)-1;
+  __u32 base;
+  __u32 mid;
+  int i;
+
+  /* Exact match only loses to wildcard rules ahead of it */
+  if (xe) {
+    best = xe->nwc;
+    act = &xe->fwa;
+  }
+
+  base = xf->pm.fw_bank ? LLB_FW4_TSS_MASKS : 0;
+
+  for (i = 0; i < LLB_FW4_TSS_MASKS; i++) {
+    mid = base + i;
+    m = bpf_map_lookup_elem(&fw4_tss_mask_map, &mid);
+    if (!m || !m->valid || m->order >= best) {
+      break;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.mid = mid;
+    key.dest = pk->dest.val & m->m.dest;
+    key.source = pk->source.val & m->m.source;
+    key.dport = pk->dport.u.v.val & m->m.dport;
+    key.sport = pk->sport.u.v.val & m->m.sport;
+    key.inport = pk->inport.val & m->m.inport;
+    key.zone = pk->zone.val & m->m.zone;
+    key.bd = pk->bd.val & m->m.bd;
+    key.protocol = pk->protocol.val & m->m.protocol;
+
+    ent = bpf_map_lookup_elem(&fw4_tss_map, &key);
+    if (ent && ent->order < best) {
+      best = ent->order;
+      act = &ent->fwa;
+    }
+  }
+
+  BPF_TRACE_PRINTK("[FW4] tss lkup %d", best);
+  return act;
+}
+
 static int __always_inline
 dp_do_fw4_main(void *ctx, struct xfi *xf)
 {
   __u32 idx = 0;
+  __u32 bidx;
+  __u32 base;
+  __u32 lim;
+  __u32 gk = 0;
+  __u32 *gen;
   int i = 0;
   struct dp_fwv4_ent *fwe;
+  struct dp_fw4_xm_ent *xe = NULL;
   struct pdi_key key;
   struct dp_fw_tact *act = NULL;
 
@@ -51,13 +132,60 @@ dp_do_fw4_main(void *ctx, struct xfi *xf)
 
   xf->pm.table_id = LL_DP_FW4_MAP;
 
+  /* Active bank is latched once per packet so that a table swap
+   * by userspace never shows up half way through a lookup
+   */
+  if (xf->pm.fw_lid == 0) {
+    gen = bpf_map_lookup_elem(&fw_gen_map, &gk);
+    xf->pm.fw_bank = gen ? (*gen & LLB_FW_GEN_BANK) : 0;
+
+    /* Fully specified rules are looked up first. The wildcard lookup
+     * then only needs to cover the rules ahead of the exact match.
+     */
+    xf->pm.fw_xlim = 0;
+    if (gen && (*gen & LLB_FW_GEN_XM)) {
+      xe = dp_do_fw4_xm_lkup(xf, &key);
+      if (xe) {
+        xf->pm.fw_xlim = xe->nwc + 1;
+      }
+    }
+
+    /* Tuple space search is done in one go without tail-call loops */
+    if (gen && (*gen & LLB_FW_GEN_TSS)) {
+      xf->pm.fw_lid = LLB_FW4_MAP_ENTRIES;
+      act = dp_do_fw4_tss_lkup(xf, &key, xe);
+      if (!act) {
+        RETURN_TO_MP();
+        return DP_DROP;
+      }
+      goto act_found;
+    }
+  }
+  base = xf->pm.fw_bank ? LLB_FW4_MAP_ENTRIES : 0;
+
+  /* No wildcard rule ahead of the exact match hit is left past lim.
+   * One bound check per rule keeps the verifier's branch count down.
+   */
+  lim = LLB_FW4_MAP_ENTRIES;
+  if (xf->pm.fw_xlim && xf->pm.fw_xlim - 1 < lim) {
+    lim = xf->pm.fw_xlim - 1;
+  }
+
   idx = xf->pm.fw_lid;
 
   for (i = 0; i < DP_MAX_LOOPS_PER_FWLKUP; i++) {
 
-    fwe = bpf_map_lookup_elem(&fw_v4_map, &idx);
+    if (idx >= lim) {
+      if (xf->pm.fw_xlim) goto xm_found;
+      i = DP_MAX_LOOPS_PER_FWLKUP;
+      break;
+    }
+
+    bidx = base + idx;
+    fwe = bpf_map_lookup_elem(&fw_v4_map, &bidx);
     if (!fwe) {
       BPF_DBG_PRINTK("[FW4] lkup miss");
+      if (xf->pm.fw_xlim) goto xm_found;
       /* End of lookup */
       xf->pm.fw_lid = LLB_FW4_MAP_ENTRIES;
       RETURN_TO_MP();
@@ -89,18 +217,30 @@ dp_do_fw4_main(void *ctx, struct xfi *xf)
         xf->pm.fw_lid > xf->pm.fw_mid) {
       /* End of lookup */
       xf->pm.fw_lid = LLB_FW4_MAP_ENTRIES;
+      if (xf->pm.fw_xlim) goto xm_found;
     }
     BPF_TRACE_PRINTK("[FW4] lkup done");
     RETURN_TO_MP();
     return DP_DROP;
   }
 
-  xf->pm.phit |= LLB_DP_FW_HIT;
-
   /* This condition should never hit */
   if (!fwe) return 0;
 
   act = &fwe->fwa;
+  goto act_found;
+
+xm_found:
+  xf->pm.fw_lid = LLB_FW4_MAP_ENTRIES;
+  xe = dp_do_fw4_xm_lkup(xf, &key);
+  if (!xe) {
+    RETURN_TO_MP();
+    return DP_DROP;
+  }
+  act = &xe->fwa;
+
+act_found:
+  xf->pm.phit |= LLB_DP_FW_HIT;
 
   xf->pm.dp_mark = act->ca.mark;
   xf->pm.dp_rec = act->ca.record;
@@ -133,6 +273,10 @@ static int __always_inline
 dp_do_fw6_main(void *ctx, struct xfi *xf)
 {
   __u32 idx = 0;
+  __u32 bidx;
+  __u32 base;
+  __u32 gk = 1;
+  __u32 *gen;
   int i = 0;
   struct dp_fwv6_ent *fwe;
   struct pdi6_key key;
@@ -150,11 +294,26 @@ dp_do_fw6_main(void *ctx, struct xfi *xf)
 
   xf->pm.table_id = LL_DP_FW6_MAP;
 
+  /* Active bank is latched once per packet so that a table swap
+   * by userspace never shows up half way through a lookup
+   */
+  if (xf->pm.fw_lid == 0) {
+    gen = bpf_map_lookup_elem(&fw_gen_map, &gk);
+    xf->pm.fw_bank = gen ? (*gen & LLB_FW_GEN_BANK) : 0;
+  }
+  base = xf->pm.fw_bank ? LLB_FW6_MAP_ENTRIES : 0;
+
   idx = xf->pm.fw_lid;
 
   for (i = 0; i < DP_MAX_LOOPS_PER_FW6LKUP; i++) {
 
-    fwe = bpf_map_lookup_elem(&fw_v6_map, &idx);
+    if (idx >= LLB_FW6_MAP_ENTRIES) {
+      i = DP_MAX_LOOPS_PER_FW6LKUP;
+      break;
+    }
+
+    bidx = base + idx;
+    fwe = bpf_map_lookup_elem(&fw_v6_map, &bidx);
     if (!fwe) {
       BPF_DBG_PRINTK("[FW6] lkup miss");
       /* End of lookup */
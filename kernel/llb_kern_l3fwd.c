@@ -330,7 +330,7 @@ dp_do_ctops(void *ctx, struct xfi *xf, void *fa_,
     }
 
     dp_pipe_set_nat(ctx, xf, na, act->ca.act_type == DP_SET_SNAT ? 1: 0);
-    dp_do_map_stats(ctx, xf, LL_DP_NAT_STATS_MAP, LLB_NAT_STAT_CID(na->rid, na->aid));
+    dp_do_map_stats(ctx, xf, LL_DP_NAT_STATS_MAP, na->sidx);
 
     if (na->fr == 1 || na->doct || xf->pm.goct) {
       goto ct_trk;
@@ -25,6 +25,8 @@ log_map_update(struct pt_regs *ctx, struct bpf_map* updated_map,
   uint32_t key_size = MEM_READ(updated_map->key_size);
   uint32_t value_size = MEM_READ(updated_map->value_size);
   char filter[] = { 'c', 't', '_', 'm', 'a', 'p', '\0'};
+  char fc_filter[] = { 'f', 'c', '_', 'v', '4', '_', 'm', 'a', 'p', '\0'};
+  int match = 1;
   int i;
  
   // Read the key and value into byte arrays
@@ -38,8 +40,27 @@ log_map_update(struct pt_regs *ctx, struct bpf_map* updated_map,
 #pragma unroll
   for (i = 0 ; i < sizeof(filter); i++) {
     if (out_data.name[i] != filter[i]) {
+      match = 0;
+      break;
+    }
+  }
+
+  /* fc_v4_map/fc_v6_map inserts feed the cidx to fast-cache index in
+   * userspace
+   */
+  if (!match) {
+    if (update_type != UPDATER_KERNEL) {
       return;
     }
+#pragma unroll
+    for (i = 0 ; i < sizeof(fc_filter); i++) {
+      if (i == 4 && out_data.name[i] == '6') {
+        continue;
+      }
+      if (out_data.name[i] != fc_filter[i]) {
+        return;
+      }
+    }
   }
 
   // Set basic data
@@ -5,73 +5,197 @@
  * SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
  */
 static void __always_inline
-dp_do_dec_nat_sess(void *ctx, struct xfi *xf, __u32 rule, __u16 aid)
+dp_do_dec_nat_sess(void *ctx, struct xfi *xf, __u32 rule, __u16 aid,
+                   struct dp_nat_act *na)
 {
   struct dp_nat_epacts *epa;
+  struct dp_nat_lcp *lc;
+  __u32 sidx = na->sidx;
+
+  if (na->lcp) {
+    lc = bpf_map_lookup_elem(&nat_lcp_map, &sidx);
+    if (lc != NULL) {
+      lc->cnt--;
+    }
+    return;
+  }
+
   epa = bpf_map_lookup_elem(&nat_ep_map, &rule);
   if (epa != NULL && epa->ca.act_type == DP_SET_NACT_SESS) {
     bpf_spin_lock(&epa->lock);
-    if (aid < LLB_MAX_NXFRMS) {
+    if (aid < LLB_NAT_LC_EPS) {
       epa->active_sess[aid]--;
     }
     bpf_spin_unlock(&epa->lock);
   }
 }
 
+/*
+ * dp_do_inc_nat_sess - Count a NAT_LB_SEL_LC_P2C session once its CT
+ * entries are in place
+ */
+static void __always_inline
+dp_do_inc_nat_sess(struct xfi *xf)
+{
+  struct dp_nat_lcp *lc;
+  __u32 sidx = xf->nm.sel_sidx;
+
+  lc = bpf_map_lookup_elem(&nat_lcp_map, &sidx);
+  if (lc != NULL) {
+    lc->cnt++;
+  }
+}
+
+/*
+ * dp_nat_lcp_load - Open sessions of the arm with stats id sidx as seen
+ * by all cpus
+ */
+static __s32 __always_inline
+dp_nat_lcp_load(__u32 sidx)
+{
+  struct dp_nat_lcp *lc;
+  __u32 cnt = 0;
+  __u32 c;
+
+  for (c = 0; c < MAX_REAL_CPUS; c++) {
+    lc = bpf_map_lookup_percpu_elem(&nat_lcp_map, &sidx, c);
+    if (lc == NULL) {
+      break;
+    }
+    cnt += lc->cnt;
+  }
+
+  lc = bpf_map_lookup_elem(&nat_lcp_dec_map, &sidx);
+  if (lc != NULL) {
+    cnt -= lc->cnt;
+  }
+
+  return (__s32)cnt;
+}
+
+static __u32 __always_inline
+dp_mix32(__u32 h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/*
+ * dp_flow_hash - 5-tuple hash which, unlike the skb hash, is the same on
+ * every LB node so that Maglev picks the same endpoint after failover
+ */
+static __u32 __always_inline
+dp_flow_hash(struct xfi *xf)
+{
+  __u32 h = xf->l34m.nw_proto;
+  int i;
+
+#pragma clang loop unroll(full)
+  for (i = 0; i < 4; i++) {
+    h = dp_mix32(h ^ xf->l34m.saddr[i]);
+    h = dp_mix32(h ^ xf->l34m.daddr[i]);
+  }
+
+  return dp_mix32(h ^ (((__u32)xf->l34m.source << 16) | xf->l34m.dest));
+}
+
+static __always_inline struct dp_nat_xfrm *
+dp_nat_xfrm_get(struct dp_nat_tacts *act, __u32 aid)
+{
+  __u32 key;
+
+  if (aid >= act->nxfrm || aid >= LLB_MAX_NXFRMS) {
+    return NULL;
+  }
+
+  key = act->xbase + aid;
+  return bpf_map_lookup_elem(&nat_xfrm_map, &key);
+}
+
+/*
+ * dp_nat_act_aid - Arm id of the k-th active arm of act or -1
+ */
+static __always_inline __u16
+dp_nat_act_aid(struct dp_nat_tacts *act, __u32 k)
+{
+  struct dp_nat_xfrm *x;
+  __u32 key;
+
+  if (k >= act->nactive || k >= LLB_MAX_NXFRMS) {
+    return -1;
+  }
+
+  key = act->xbase + k;
+  x = bpf_map_lookup_elem(&nat_xfrm_map, &key);
+  if (x == NULL) {
+    return -1;
+  }
+
+  return x->act_aid;
+}
+
+/*
+ * dp_nat_ep_fallback - Keep arm sel if it is active or fall back to the
+ * first active arm
+ */
+static __always_inline __u16
+dp_nat_ep_fallback(struct dp_nat_tacts *act, __u16 sel)
+{
+  struct dp_nat_xfrm *x;
+
+  x = dp_nat_xfrm_get(act, sel);
+  if (x != NULL && x->xi.inactive == 0) {
+    return sel;
+  }
+
+  return dp_nat_act_aid(act, 0);
+}
+
 static int __always_inline
-dp_sel_nat_ep(void *ctx, struct xfi *xf, struct dp_proxy_tacts *act)
+dp_sel_nat_ep(void *ctx, struct xfi *xf, struct dp_nat_tacts *act)
 {
   uint16_t sel = -1;
-  uint16_t n = 0;
   uint16_t i = 0;
-  struct mf_xfrm_inf *nxfrm_act;
+  struct dp_nat_xfrm *x;
   __u16 rule_num = act->ca.cidx;
+  __u32 k;
 
-  if (act->sel_type == NAT_LB_SEL_RR) {
-    bpf_spin_lock(&act->lock);
-    i = act->sel_hint; 
-
-    while (n < LLB_MAX_NXFRMS) {
-      if (i >= 0 && i < LLB_MAX_NXFRMS) {
-        nxfrm_act = &act->nxfrms[i];
-        if (nxfrm_act->inactive == 0) {
-          act->sel_hint = (i + 1) % LLB_MAX_NXFRMS;
-          sel = i;
-          break;
-        }
-      }
-      i++;
-      if (i >= LLB_MAX_NXFRMS)  i = 0;
-      n++;
+  if (act->nxfrm == 0) {
+    return sel;
+  }
+
+  if (act->sel_type == NAT_LB_SEL_RR && rule_num < LLB_NAT_EP_MAP_ENTRIES) {
+    __u32 key = rule_num;
+    __u32 *cur;
+
+    /* Every cpu keeps its own cursor (next active arm + 1), starting at a
+     * cpu dependent arm, so that new connections never contend on act
+     */
+    cur = bpf_map_lookup_elem(&nat_rr_map, &key);
+    if (cur != NULL && act->nactive) {
+      k = *cur ? *cur - 1 : bpf_get_smp_processor_id();
+      k %= act->nactive;
+      *cur = k + 2;
+      sel = dp_nat_act_aid(act, k);
     }
-    bpf_spin_unlock(&act->lock);
-  } else if (act->sel_type == NAT_LB_SEL_HASH) {
-    sel = dp_get_pkt_hash(ctx) % act->nxfrm;
-    if (sel >= 0 && sel < LLB_MAX_NXFRMS) {
-      /* Fall back if hash selection gives us a deadend */
-      if (act->nxfrms[sel].inactive) {
-        for (i = 0; i < LLB_MAX_NXFRMS; i++) {
-          if (act->nxfrms[i].inactive == 0) {
-            sel = i;
-            break;
-          }
-        }
-      }
+  } else if (act->sel_type == NAT_LB_SEL_RR) {
+    if (act->nactive) {
+      bpf_spin_lock(&act->lock);
+      k = act->sel_hint % act->nactive;
+      act->sel_hint = k + 1;
+      bpf_spin_unlock(&act->lock);
+      sel = dp_nat_act_aid(act, k);
     }
+  } else if (act->sel_type == NAT_LB_SEL_HASH) {
+    /* Fall back if hash selection gives us a deadend */
+    sel = dp_nat_ep_fallback(act, dp_get_pkt_hash(ctx) % act->nxfrm);
   } else if (act->sel_type == NAT_LB_SEL_N3) {
     if (xf->tm.tun_type == LLB_TUN_GTP) {
-      sel = dp_get_tun_hash(xf) % act->nxfrm;
-      if (sel >= 0 && sel < LLB_MAX_NXFRMS) {
-        /* Fall back if hash selection gives us a deadend */
-        if (act->nxfrms[sel].inactive) {
-          for (i = 0; i < LLB_MAX_NXFRMS; i++) {
-            if (act->nxfrms[i].inactive == 0) {
-              sel = i;
-              break;
-            }
-          }
-        }
-      }
+      sel = dp_nat_ep_fallback(act, dp_get_tun_hash(xf) % act->nxfrm);
     }
   } else if (act->sel_type == NAT_LB_SEL_RR_PERSIST) {
     __u64 now = bpf_ktime_get_ns();
@@ -97,24 +221,77 @@ dp_sel_nat_ep(void *ctx, struct xfi *xf, struct dp_proxy_tacts *act)
     sel %= act->nxfrm;
     act->lts = now;
     bpf_spin_unlock(&act->lock);
-    if (sel >= 0 && sel < LLB_MAX_NXFRMS) {
-      if (act->nxfrms[sel].inactive) {
+    x = dp_nat_xfrm_get(act, sel);
+    if (x == NULL || x->xi.inactive) {
 #ifdef HAVE_DP_PERSIST_TFC
-        sel = ((xf->l34m.saddr4 >> 8) & 0xff) ^  ((xf->l34m.saddr4 >> 16) & 0xff) ^ (tfc & 0xff);
+      sel = ((xf->l34m.saddr4 >> 8) & 0xff) ^  ((xf->l34m.saddr4 >> 16) & 0xff) ^ (tfc & 0xff);
 #else
-        sel = ((xf->l34m.saddr4 >> 8) & 0xff) ^  ((xf->l34m.saddr4 >> 16) & 0xff);
+      sel = ((xf->l34m.saddr4 >> 8) & 0xff) ^  ((xf->l34m.saddr4 >> 16) & 0xff);
 #endif
-        sel %= act->nxfrm;
-        if (sel >= 0 && sel < LLB_MAX_NXFRMS) {
-          /* Fall back if two-level hash selection gives us a deadend */
-          if (act->nxfrms[sel].inactive) {
-            for (i = 0; i < LLB_MAX_NXFRMS; i++) {
-              if (act->nxfrms[i].inactive == 0) {
-                sel = i;
-                break;
-              }
-            }
+      sel %= act->nxfrm;
+      /* Fall back if two-level hash selection gives us a deadend */
+      sel = dp_nat_ep_fallback(act, sel);
+    }
+  } else if (act->sel_type == NAT_LB_SEL_MAGLEV) {
+    struct dp_maglev_tbl *mt;
+    __u32 key = rule_num;
+    __u32 slot = dp_flow_hash(xf) % LLB_MAGLEV_TBL_SZ;
+
+    mt = bpf_map_lookup_elem(&nat_maglev_map, &key);
+    barrier_var(slot);
+    if (mt != NULL && slot < LLB_MAGLEV_TBL_SZ) {
+      /* Table is rebuilt on endpoint change, this covers the window */
+      sel = dp_nat_ep_fallback(act, mt->ep[slot]);
+    }
+  } else if (act->sel_type == NAT_LB_SEL_WRR ||
+             act->sel_type == NAT_LB_SEL_WHASH) {
+    struct dp_wsel_tbl *wt;
+    __u32 key = rule_num;
+    __u32 slot = 0;
+    __u32 *cur;
+
+    wt = bpf_map_lookup_elem(&nat_wsel_map, &key);
+    if (wt != NULL && wt->nslots) {
+      if (act->sel_type == NAT_LB_SEL_WRR) {
+        /* Lockless as every cpu walks the slot table on its own with the
+         * same cursor scheme as NAT_LB_SEL_RR
+         */
+        cur = bpf_map_lookup_elem(&nat_rr_map, &key);
+        if (cur != NULL) {
+          slot = *cur ? *cur - 1 : bpf_get_smp_processor_id();
+          slot %= wt->nslots;
+          *cur = slot + 2;
+        }
+      } else {
+        slot = dp_get_pkt_hash(ctx) % wt->nslots;
+      }
+      barrier_var(slot);
+      if (slot < LLB_WSEL_TBL_SZ) {
+        sel = dp_nat_ep_fallback(act, wt->ep[slot]);
+      }
+    }
+  } else if (act->sel_type == NAT_LB_SEL_LC_P2C) {
+    __u32 r = bpf_get_prandom_u32();
+    __u16 a, b;
+
+    if (act->nactive) {
+      /* Power of two choices over the load seen by all cpus. The session
+       * is counted by the ct stage once it is committed
+       */
+      a = dp_nat_act_aid(act, (r & 0xffff) % act->nactive);
+      b = dp_nat_act_aid(act, (r >> 16) % act->nactive);
+      if (a < LLB_MAX_NXFRMS && b < LLB_MAX_NXFRMS) {
+        if (act->sbase + a < LLB_NATV4_STAT_MAP_ENTRIES &&
+            act->sbase + b < LLB_NATV4_STAT_MAP_ENTRIES) {
+          if (dp_nat_lcp_load(act->sbase + a) <=
+              dp_nat_lcp_load(act->sbase + b)) {
+            sel = a;
+          } else {
+            sel = b;
           }
+          xf->nm.lcp = 1;
+        } else {
+          sel = a;
         }
       }
     }
@@ -122,13 +299,17 @@ dp_sel_nat_ep(void *ctx, struct xfi *xf, struct dp_proxy_tacts *act)
     struct dp_nat_epacts *epa;
     __u32 key = rule_num;
     __u32 lc = 0;
+    /* Active arms come from userspace as arm lookups are helper calls,
+     * which are not allowed under the spin lock
+     */
+    __u32 amask = act->lc_amask;
+
     epa = bpf_map_lookup_elem(&nat_ep_map, &key);
     if (epa != NULL) {
       epa->ca.act_type = DP_SET_NACT_SESS;
       bpf_spin_lock(&epa->lock);
-      for (i = 0; i < LLB_MAX_NXFRMS/2; i++) {
-        nxfrm_act = &act->nxfrms[i];
-        if (nxfrm_act->inactive == 0) {
+      for (i = 0; i < LLB_NAT_LC_EPS/2; i++) {
+        if (amask & (1 << i)) {
           __u32 as = epa->active_sess[i];
           if (lc > as || sel == (uint16_t)(-1)) {
             sel = i;
@@ -136,7 +317,7 @@ dp_sel_nat_ep(void *ctx, struct xfi *xf, struct dp_proxy_tacts *act)
           }
         }
       }
-      if (sel >= 0 && sel < LLB_MAX_NXFRMS/2) {
+      if (sel >= 0 && sel < LLB_NAT_LC_EPS/2) {
         epa->active_sess[sel]++;
       }
       bpf_spin_unlock(&epa->lock);
@@ -153,7 +334,8 @@ dp_do_nat(void *ctx, struct xfi *xf)
 {
   struct dp_nat_key key;
   struct mf_xfrm_inf *nxfrm_act;
-  struct dp_proxy_tacts *act;
+  struct dp_nat_tacts *act;
+  struct dp_nat_xfrm *x;
   int sel;
 
   if (xf->pm.l4fin || xf->pm.il4fin) {
@@ -220,17 +402,16 @@ dp_do_nat(void *ctx, struct xfi *xf)
 
     xf->pm.dp_mark &= ~LLB_MARK_SNAT_EGR;
 
-    /* FIXME - Do not select inactive end-points 
-     * Need multi-passes for selection
-     */
-    if (sel >= 0 && sel < LLB_MAX_NXFRMS) {
-      nxfrm_act = &act->nxfrms[sel];
+    x = dp_nat_xfrm_get(act, sel);
+    if (x != NULL) {
+      nxfrm_act = &x->xi;
 
       DP_XADDR_CP(xf->nm.nxip, nxfrm_act->nat_xip);
       DP_XADDR_CP(xf->nm.nrip, nxfrm_act->nat_rip);
       xf->nm.nxport = nxfrm_act->nat_xport;
       xf->nm.nv6 = nxfrm_act->nv6 ? 1: 0;
       xf->nm.sel_aid = sel;
+      xf->nm.sel_sidx = act->sbase + sel;
       xf->nm.ito = act->ito;
       xf->pm.rule_id =  act->ca.cidx;
       BPF_TRACE_PRINTK("[NAT] action %x", xf->pm.nf);
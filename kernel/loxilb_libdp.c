@@ -17,10 +17,12 @@
 #include <assert.h>
 #include <signal.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <netdb.h>
 #include <ifaddrs.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/eventfd.h>
 
 #include "bpf.h"
 #include "libbpf.h"
@@ -45,6 +47,10 @@
 #define PATH_MAX  4096
 #endif
 
+#ifndef ENOTSUPP
+#define ENOTSUPP  524
+#endif
+
 typedef struct llb_dp_sect {
 #define SECNAMSIZ 64
   char name[SECNAMSIZ];
@@ -67,18 +73,143 @@ typedef struct llb_dp_link {
   int valid;
 } llb_dp_link_t;
   
+/* Sparse stats cache - Open addressing (linear probe) table of cached
+ * stats keyed by stats index, holding only indices seen in use
+ */
+#define LLB_PBC_EMPTY    (0xffffffff)
+#define LLB_PBC_MIN_CAP  (64)
+
+typedef struct llb_pbc_ent {
+  uint32_t idx;
+  struct dp_pbc_stats s;
+} llb_pbc_ent_t;
+
+typedef struct llb_pbc_tbl {
+  llb_pbc_ent_t *ents;
+  uint32_t cap;
+  uint32_t shift;
+  uint32_t n;
+} llb_pbc_tbl_t;
+
 typedef struct llb_dp_map {
   int map_fd;  
   char *map_name;
   uint32_t max_entries;
   int has_pb;
   int pb_xtid;
-  struct dp_pbc_stats *pbs;
+  llb_pbc_tbl_t pbs;
   int has_pol;
   struct dp_pol_stats *pls;
   pthread_rwlock_t stat_lock;
+  pthread_rwlock_t lock;
+  uint64_t lk_acq;
+  uint64_t lk_cont;
+  uint64_t lk_wait_ns;
+  int no_batch;
+  int st_hwm_on;
+  int st_hwm_ok;
+  uint32_t st_hwm;
+  struct dp_pb_stats *ms;
+  uint32_t ms_ents;
 } llb_dp_map_t;
 
+typedef struct llb_map_cursor {
+  int started;
+  int batched;
+  int done;
+  __u64 batch;
+  uint8_t key[1024];
+  uint32_t nvisit;
+  uint32_t ndel;
+} llb_map_cursor_t;
+
+typedef uint32_t (*llb_map_chunk_eval_t)(int tid, dp_map_walker_t cb,
+                                         dp_map_ita_t *it, uint8_t *keys,
+                                         uint8_t *vals, uint32_t cnt,
+                                         uint8_t *dkeys);
+
+struct llb_ct_agep;
+struct llb_mupd_q;
+
+#define LLB_FCIDX_KEYS 4
+
+typedef struct llb_fc_key {
+  int tid;
+  union {
+    struct dp_fcv4_key v4;
+    struct dp_fcv6_key v6;
+  } k;
+} llb_fc_key_t;
+
+typedef struct llb_fc_cidx_ent {
+  uint32_t cidx;
+  int nkeys;
+  int ovf;
+  llb_fc_key_t keys[LLB_FCIDX_KEYS];
+  UT_hash_handle hh;
+} llb_fc_cidx_ent_t;
+
+typedef struct llb_ct_ra_ent {
+  struct dp_ct_key key;
+  uint32_t ra;
+  uint32_t gen;
+  struct llb_ct_ra_ent *next;
+  struct llb_ct_ra_ent *prev;
+  UT_hash_handle hh;
+} llb_ct_ra_ent_t;
+
+typedef struct llb_ct_ra_set {
+  uint32_t ra;
+  uint32_t n;
+  llb_ct_ra_ent_t *head;
+  UT_hash_handle hh;
+} llb_ct_ra_set_t;
+
+typedef struct ll_cidx_set {
+  uint32_t *cidx;
+  uint32_t n;
+  uint32_t max;
+} ll_cidx_set_t;
+
+typedef struct llb_maglev_ent {
+  uint32_t rid;
+  struct dp_maglev_stats st;
+  UT_hash_handle hh;
+} llb_maglev_ent_t;
+
+/* nat_xfrm_map and stats id ranges held by a NAT rule */
+typedef struct llb_nat_xr {
+  uint32_t rid;
+  uint32_t xbase;
+  uint32_t sbase;
+  uint16_t xcap;
+  uint16_t scap;
+  uint16_t nxfrm;
+  uint8_t sel_type;
+  uint64_t act[LLB_MAX_NXFRMS/64];
+  UT_hash_handle hh;
+} llb_nat_xr_t;
+
+/* Range given back while the datapath may still be reading it. A drain
+ * range (stats ids) is held until no CT entry counts under it anymore
+ */
+#define LLB_NAT_XR_GC_MIN (64)
+
+typedef struct llb_nat_xr_gc {
+  uint64_t *bm;
+  uint32_t base;
+  uint32_t sz;
+  uint64_t ts;
+  int drain;
+} llb_nat_xr_gc_t;
+
+/* Keys of a firewall hash map (TSS or exact match) owned by one bank */
+typedef struct llb_fw_bank_hash {
+  uint8_t *keys;
+  uint32_t n;
+  int synced;
+} llb_fw_bank_hash_t;
+
 typedef struct llb_dp_struct
 {
   pthread_rwlock_t lock;
@@ -98,6 +229,10 @@ typedef struct llb_dp_struct
   int have_sockmap;
   int have_noebpf;
   struct llb_kern_mon *monp;
+  struct bpf_object *ctsw_obj;
+  int ctsw_fd;
+  struct ring_buffer *ctsw_rb;
+  int ct_ksweep;
   const char *cgroup_dfl_path;
   int cgfd;
   int smfd;
@@ -112,6 +247,54 @@ typedef struct llb_dp_struct
   struct throttler cpt;
   uint64_t lctts;
   uint64_t lfcts;
+  uint32_t batch_sz;
+  uint32_t ct_slice_ents;
+  uint32_t ct_slice_us;
+  int ct_age_dir;
+  uint64_t ct_cycle_sts;
+  llb_map_cursor_t ct_cur;
+  struct dp_ct_age_stats ct_age_st;
+  int ct_age_workers;
+  struct llb_ct_agep *ctap;
+  pthread_mutex_t nat_ep_lock;
+  struct llb_mupd_q *mupd;
+  pthread_mutex_t fcidx_lock;
+  llb_fc_cidx_ent_t *fcidx;
+  int fcidx_ok;
+  int fcidx_lost;
+  uint32_t fc_gen;
+  uint32_t fc_gen_bumps;
+  uint32_t fw_bank[2];
+  uint32_t fw_bank_n[2][LLB_FW_MAP_BANKS];
+  uint64_t fw_flip_ts[2];
+  int fw_engine;
+  llb_fw_bank_hash_t fw_tss[LLB_FW_MAP_BANKS];
+  llb_fw_bank_hash_t fw_xm[LLB_FW_MAP_BANKS];
+  pthread_mutex_t ctidx_lock;
+  llb_ct_ra_ent_t *ctidx;
+  llb_ct_ra_set_t *ctidx_sets;
+  uint32_t ctidx_gen;
+  int ctidx_ok;
+  int ctidx_lost;
+  struct dp_ct_ridx_stats ctidx_st;
+  pthread_mutex_t txn_lock;
+  struct dp_map_txn_stats txn_st;
+  llb_maglev_ent_t *maglev;
+  pthread_mutex_t lcp_lock;
+  llb_nat_xr_t *nat_xr;
+  uint64_t nat_xbm[LLB_NAT_XFRM_MAP_ENTRIES/64];
+  uint64_t nat_sbm[LLB_NATV4_STAT_MAP_ENTRIES/64];
+  llb_nat_xr_gc_t *nat_xgc;
+  int nat_xgc_n;
+  int nat_xgc_max;
+  int nat_xr_busy;
+  int nat_sdr_chk;
+  pthread_mutex_t nat_sr_lock;
+  struct {
+    uint32_t sbase;
+    uint16_t n;
+    uint16_t pad;
+  } nat_sr[LLB_NAT_EP_MAP_ENTRIES];
 } llb_dp_struct_t;
 
 #define XH_LOCK()    pthread_rwlock_wrlock(&xh->lock)
@@ -123,9 +306,60 @@ typedef struct llb_dp_struct
 
 #define XH_BPF_OBJ() xh->links[0].obj
 
+#define LLB_FW_FLIP_GRACE_NS (2000000)
+#define LLB_NAT_XR_GRACE_NS  (LLB_FW_FLIP_GRACE_NS)
+
 llb_dp_struct_t *xh;
 static uint64_t lost;
 
+/*
+ * Table locks - Updates of a table and of userspace state owned by it (e.g
+ * ufw4/ufw6 for firewall tables) are serialised by the table's own lock,
+ * taken with xh->lock held shared. xh->lock is taken exclusive only for
+ * global changes. CT and FC table locks may nest under other table locks
+ * (in that order) but never the other way round.
+ */
+static void
+llb_map_lock(int tid)
+{
+  llb_dp_map_t *t = &xh->maps[tid];
+  uint64_t sts;
+
+  if (pthread_rwlock_trywrlock(&t->lock) != 0) {
+    sts = get_os_nsecs();
+    pthread_rwlock_wrlock(&t->lock);
+    t->lk_cont++;
+    t->lk_wait_ns += get_os_nsecs() - sts;
+  }
+  t->lk_acq++;
+}
+
+static void
+llb_map_unlock(int tid)
+{
+  pthread_rwlock_unlock(&xh->maps[tid].lock);
+}
+
+int
+llb_get_map_lock_stats(int tbl, struct dp_map_lock_stats *st)
+{
+  llb_dp_map_t *t;
+  int i;
+
+  if (!st || tbl >= LL_DP_MAX_MAP) return -EINVAL;
+
+  memset(st, 0, sizeof(*st));
+  for (i = 0; i < LL_DP_MAX_MAP; i++) {
+    if (tbl >= 0 && i != tbl) continue;
+    t = &xh->maps[i];
+    st->acquired += t->lk_acq;
+    st->contended += t->lk_cont;
+    st->wait_ns += t->lk_wait_ns;
+  }
+
+  return 0;
+}
+
 static inline unsigned int
 bpf_num_possible_cpus(void)
 {
@@ -372,14 +606,58 @@ ll_fcmap_ent_set_flush(int tid, void *k, void *ita)
   return 1;
 }
 
+/*
+ * ll_fcmap_gen_bump - Invalidate all of fc_v4_map by moving to a new
+ * generation. The datapath treats entries of other generations as a miss
+ * and drops them on lookup, aging reclaims the ones not hit again.
+ *
+ * Entries keep only 16 bits of the generation, so a stale entry would be
+ * valid again after LLB_FC_GEN_MAX bumps. Aging removes every stale entry,
+ * so only bumps since the last aging pass count. When they run out this
+ * fails and the caller flushes the maps instead.
+ */
+#define LLB_FC_GEN_MAX (0xffff)
+
+static int
+ll_fcmap_gen_bump(void)
+{
+  uint32_t k = 0;
+  uint32_t gen = (xh->fc_gen + 1) & LLB_FC_GEN_MAX;
+
+  if (xh->fc_gen_bumps >= LLB_FC_GEN_MAX) {
+    return -1;
+  }
+
+  if (bpf_map_update_elem(llb_map2fd(LL_DP_FC_GEN_MAP), &k, &gen, BPF_ANY) != 0) {
+    return -1;
+  }
+  xh->fc_gen = gen;
+  xh->fc_gen_bumps++;
+  return 0;
+}
+
 static void
 ll_flush_fcmap(void)
 {
   dp_map_ita_t it;
   struct dp_fcv4_key next_key;
+  struct dp_fcv6_key next_key6;
   struct dp_fc_tacts *fc_val;
   uint64_t ns = get_os_nsecs();
 
+  XH_RD_LOCK();
+  llb_map_lock(LL_DP_FCV4_MAP);
+  if (ll_fcmap_gen_bump() == 0) {
+    llb_map_unlock(LL_DP_FCV4_MAP);
+    XH_UNLOCK();
+    return;
+  }
+  llb_map_unlock(LL_DP_FCV4_MAP);
+  XH_UNLOCK();
+
+  /* No fc_gen_map in the loaded datapath or generations ran out, flush
+   * the hard way
+   */
   fc_val = calloc(1, sizeof(*fc_val));
   if (!fc_val) return;
 
@@ -390,8 +668,19 @@ ll_flush_fcmap(void)
   it.val = fc_val;
   it.uarg = &ns;
 
-  XH_LOCK();
+  XH_RD_LOCK();
+  llb_map_lock(LL_DP_FCV4_MAP);
   llb_map_loop_and_delete(LL_DP_FCV4_MAP, ll_fcmap_ent_set_flush, &it);
+
+  memset(&next_key6, 0, sizeof(next_key6));
+  it.next_key = &next_key6;
+  it.key_sz = sizeof(next_key6);
+
+  llb_map_lock(LL_DP_FCV6_MAP);
+  llb_map_loop_and_delete(LL_DP_FCV6_MAP, ll_fcmap_ent_set_flush, &it);
+  xh->fc_gen_bumps = 0;
+  llb_map_unlock(LL_DP_FCV6_MAP);
+  llb_map_unlock(LL_DP_FCV4_MAP);
   XH_UNLOCK();
   if (fc_val) free(fc_val);
 }
@@ -521,6 +810,275 @@ cleanup:
   return -1;
 }
 
+/*
+ * FC cidx index - Maps a CT counter index (cidx) to the fast-cache keys
+ * which point to it, so that FC entries related to a CT entry can be
+ * removed without walking the fc maps. Entries are learnt from map-trace
+ * notifications of FC inserts and rebuilt on every FC sweep. Stale
+ * entries are harmless since cidx is re-validated before delete. The
+ * index is trusted for removal (fcidx_ok) only while map-trace is on and
+ * no event was lost since the last full FC sweep.
+ */
+static void
+llb_fcidx_add(uint32_t cidx, int tid, void *key)
+{
+  llb_fc_cidx_ent_t *e;
+  llb_fc_key_t fk;
+  int i;
+
+  if (cidx == 0) return;
+
+  memset(&fk, 0, sizeof(fk));
+  fk.tid = tid;
+  if (tid == LL_DP_FCV6_MAP) {
+    memcpy(&fk.k.v6, key, sizeof(fk.k.v6));
+  } else {
+    memcpy(&fk.k.v4, key, sizeof(fk.k.v4));
+  }
+
+  pthread_mutex_lock(&xh->fcidx_lock);
+  HASH_FIND(hh, xh->fcidx, &cidx, sizeof(cidx), e);
+  if (!e) {
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+      xh->fcidx_ok = 0;
+      pthread_mutex_unlock(&xh->fcidx_lock);
+      return;
+    }
+    e->cidx = cidx;
+    HASH_ADD(hh, xh->fcidx, cidx, sizeof(cidx), e);
+  }
+
+  for (i = 0; i < e->nkeys; i++) {
+    if (memcmp(&e->keys[i], &fk, sizeof(fk)) == 0) {
+      goto out;
+    }
+  }
+
+  if (e->nkeys >= LLB_FCIDX_KEYS) {
+    e->ovf = 1;
+  } else {
+    memcpy(&e->keys[e->nkeys++], &fk, sizeof(fk));
+  }
+out:
+  pthread_mutex_unlock(&xh->fcidx_lock);
+}
+
+static void
+llb_fcidx_flush(void)
+{
+  llb_fc_cidx_ent_t *e, *tmp;
+
+  pthread_mutex_lock(&xh->fcidx_lock);
+  HASH_ITER(hh, xh->fcidx, e, tmp) {
+    HASH_DEL(xh->fcidx, e);
+    free(e);
+  }
+  pthread_mutex_unlock(&xh->fcidx_lock);
+}
+
+/*
+ * llb_fcidx_del_cidx - Remove FC entries related to cidx using the index.
+ * Returns 0 if done, or -1 if the index can't be trusted for this cidx
+ * and the caller needs to fall back to a map walk.
+ */
+static int
+llb_fcidx_del_cidx(uint32_t cidx)
+{
+  llb_fc_cidx_ent_t *e;
+  struct dp_fc_tacts *fc_val;
+  int ret = 0;
+  int fd;
+  int i;
+
+  if (!xh->fcidx_ok) return -1;
+
+  fc_val = calloc(1, sizeof(*fc_val));
+  if (!fc_val) return -1;
+
+  pthread_mutex_lock(&xh->fcidx_lock);
+  HASH_FIND(hh, xh->fcidx, &cidx, sizeof(cidx), e);
+  if (e) {
+    for (i = 0; i < e->nkeys; i++) {
+      fd = llb_map2fd(e->keys[i].tid);
+      if (bpf_map_lookup_elem(fd, &e->keys[i].k, fc_val) == 0 &&
+          fc_val->ca.cidx == cidx) {
+        bpf_map_delete_elem(fd, &e->keys[i].k);
+      }
+    }
+    ret = e->ovf ? -1 : 0;
+    HASH_DEL(xh->fcidx, e);
+    free(e);
+  }
+  pthread_mutex_unlock(&xh->fcidx_lock);
+  free(fc_val);
+
+  return ret;
+}
+
+/*
+ * CT (rid, aid) index - Membership of CT entries per NAT rule id and
+ * endpoint id so that CT entries of a removed endpoint can be found without
+ * walking ct_map. Entries are learnt from map-trace CT notifications and
+ * refreshed by CT aging, which sees every entry once per cycle. Entries not
+ * seen for a whole cycle are purged. Like the FC index, it is trusted
+ * (ctidx_ok) only while map-trace is on and no event got lost in the last
+ * aging cycle.
+ */
+#define LLB_CTIDX_RA(rid, aid) (((uint32_t)(rid) << 16) | (aid))
+
+static void
+llb_ctidx_unlink(llb_ct_ra_ent_t *e)
+{
+  llb_ct_ra_set_t *rs;
+
+  HASH_FIND(hh, xh->ctidx_sets, &e->ra, sizeof(e->ra), rs);
+  if (rs) {
+    if (e->prev) e->prev->next = e->next;
+    else rs->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    if (--rs->n == 0) {
+      HASH_DEL(xh->ctidx_sets, rs);
+      free(rs);
+    }
+  }
+  e->next = e->prev = NULL;
+}
+
+static int
+llb_ctidx_link(llb_ct_ra_ent_t *e)
+{
+  llb_ct_ra_set_t *rs;
+
+  HASH_FIND(hh, xh->ctidx_sets, &e->ra, sizeof(e->ra), rs);
+  if (!rs) {
+    rs = calloc(1, sizeof(*rs));
+    if (!rs) return -ENOMEM;
+    rs->ra = e->ra;
+    HASH_ADD(hh, xh->ctidx_sets, ra, sizeof(rs->ra), rs);
+  }
+
+  e->prev = NULL;
+  e->next = rs->head;
+  if (rs->head) rs->head->prev = e;
+  rs->head = e;
+  rs->n++;
+
+  return 0;
+}
+
+static void
+llb_ctidx_add(struct dp_ct_key *key, uint16_t rid, uint16_t aid)
+{
+  llb_ct_ra_ent_t *e;
+  uint32_t ra = LLB_CTIDX_RA(rid, aid);
+
+  pthread_mutex_lock(&xh->ctidx_lock);
+  HASH_FIND(hh, xh->ctidx, key, sizeof(*key), e);
+  if (e) {
+    e->gen = xh->ctidx_gen;
+    if (e->ra != ra) {
+      llb_ctidx_unlink(e);
+      e->ra = ra;
+      if (llb_ctidx_link(e) != 0) {
+        HASH_DEL(xh->ctidx, e);
+        free(e);
+        xh->ctidx_ok = 0;
+      }
+    }
+    pthread_mutex_unlock(&xh->ctidx_lock);
+    return;
+  }
+
+  e = calloc(1, sizeof(*e));
+  if (!e) {
+    xh->ctidx_ok = 0;
+    pthread_mutex_unlock(&xh->ctidx_lock);
+    return;
+  }
+
+  memcpy(&e->key, key, sizeof(*key));
+  e->ra = ra;
+  e->gen = xh->ctidx_gen;
+  if (llb_ctidx_link(e) != 0) {
+    free(e);
+    xh->ctidx_ok = 0;
+    pthread_mutex_unlock(&xh->ctidx_lock);
+    return;
+  }
+  HASH_ADD(hh, xh->ctidx, key, sizeof(e->key), e);
+  pthread_mutex_unlock(&xh->ctidx_lock);
+}
+
+static void
+llb_ctidx_del(struct dp_ct_key *key)
+{
+  llb_ct_ra_ent_t *e;
+
+  pthread_mutex_lock(&xh->ctidx_lock);
+  HASH_FIND(hh, xh->ctidx, key, sizeof(*key), e);
+  if (e) {
+    llb_ctidx_unlink(e);
+    HASH_DEL(xh->ctidx, e);
+    free(e);
+  }
+  pthread_mutex_unlock(&xh->ctidx_lock);
+}
+
+/*
+ * llb_ctidx_purge - Drop all entries (all == 1) or the ones which were not
+ * seen during the last aging cycle and start a new cycle.
+ */
+static void
+llb_ctidx_purge(int all)
+{
+  llb_ct_ra_ent_t *e, *tmp;
+
+  pthread_mutex_lock(&xh->ctidx_lock);
+  HASH_ITER(hh, xh->ctidx, e, tmp) {
+    if (all || e->gen != xh->ctidx_gen) {
+      llb_ctidx_unlink(e);
+      HASH_DEL(xh->ctidx, e);
+      free(e);
+    }
+  }
+  xh->ctidx_gen++;
+  pthread_mutex_unlock(&xh->ctidx_lock);
+}
+
+/*
+ * llb_ctidx_get_keys - Copy out the CT keys indexed for (rid, aid).
+ * Returns the number of keys in *keys (to be freed by caller) or -1 if
+ * the index can't be used.
+ */
+static int
+llb_ctidx_get_keys(uint16_t rid, uint16_t aid, struct dp_ct_key **keys)
+{
+  llb_ct_ra_set_t *rs;
+  llb_ct_ra_ent_t *e;
+  uint32_t ra = LLB_CTIDX_RA(rid, aid);
+  int n = 0;
+
+  *keys = NULL;
+  if (!xh->ctidx_ok) return -1;
+
+  pthread_mutex_lock(&xh->ctidx_lock);
+  HASH_FIND(hh, xh->ctidx_sets, &ra, sizeof(ra), rs);
+  if (rs && rs->n) {
+    *keys = calloc(rs->n, sizeof(**keys));
+    if (!*keys) {
+      pthread_mutex_unlock(&xh->ctidx_lock);
+      return -1;
+    }
+    for (e = rs->head; e && n < rs->n; e = e->next) {
+      memcpy(&(*keys)[n++], &e->key, sizeof(e->key));
+    }
+  }
+  pthread_mutex_unlock(&xh->ctidx_lock);
+
+  return n;
+}
+
 #ifdef HAVE_DP_CT_SYNC
 
 void __attribute__((weak))
@@ -531,9 +1089,11 @@ goMapNotiHandler(struct ll_dp_map_notif *mn)
 static void
 llb_maptrace_lost(void *ctx, int cpu, __u64 cnt)
 {
-  XH_LOCK();
-  lost += cnt;
-  XH_UNLOCK();
+  __sync_fetch_and_add(&lost, cnt);
+  xh->fcidx_lost = 1;
+  xh->fcidx_ok = 0;
+  xh->ctidx_lost = 1;
+  xh->ctidx_ok = 0;
 }
 
 static void
@@ -542,6 +1102,34 @@ llb_maptrace_output(void *ctx, int cpu, void *data, __u32 size)
   struct map_update_data *map_data = (struct map_update_data*)data;
   struct ll_dp_map_notif noti;
 
+  if (strncmp(map_data->name, "fc_v4_map", BPF_NAME_LEN) == 0) {
+    if (map_data->updater == UPDATER_KERNEL &&
+        map_data->key_size == sizeof(struct dp_fcv4_key) &&
+        map_data->value_size >= sizeof(struct dp_cmn_act)) {
+      llb_fcidx_add(((struct dp_cmn_act *)map_data->value)->cidx,
+                    LL_DP_FCV4_MAP, map_data->key);
+    }
+    return;
+  }
+
+  if (strncmp(map_data->name, "fc_v6_map", BPF_NAME_LEN) == 0) {
+    if (map_data->updater == UPDATER_KERNEL &&
+        map_data->key_size == sizeof(struct dp_fcv6_key) &&
+        map_data->value_size >= sizeof(struct dp_cmn_act)) {
+      llb_fcidx_add(((struct dp_cmn_act *)map_data->value)->cidx,
+                    LL_DP_FCV6_MAP, map_data->key);
+    }
+    return;
+  }
+
+  if (map_data->updater == UPDATER_KERNEL &&
+      map_data->key_size == sizeof(struct dp_ct_key) &&
+      map_data->value_size >= offsetof(struct dp_ct_tact, ctd.nid)) {
+    struct dp_ct_tact *adat = (struct dp_ct_tact *)map_data->value;
+    llb_ctidx_add((struct dp_ct_key *)map_data->key,
+                  adat->ctd.rid, adat->ctd.aid);
+  }
+
   memset(&noti, 0, sizeof(noti));
   if (map_data->updater == UPDATER_KERNEL) {
     noti.addop = 1;
@@ -1147,6 +1735,131 @@ llb_setup_lcpu_map(int mapfd)
   }
 }
 
+/*
+ * Mmapable stats (HAVE_DP_MMAP_STATS) - The striped counter array of a
+ * stats table gets mapped once and is then read and cleared in place
+ * without any syscalls.
+ */
+static int
+llb_mstats_ptid(int tid)
+{
+  switch (tid) {
+  case LL_DP_RTV4_MSTATS_MAP:
+    return LL_DP_RTV4_STATS_MAP;
+  case LL_DP_NAT_MSTATS_MAP:
+    return LL_DP_NAT_STATS_MAP;
+  case LL_DP_FW_MSTATS_MAP:
+    return LL_DP_FW_STATS_MAP;
+  default:
+    break;
+  }
+
+  return -1;
+}
+
+static void
+llb_mstats_mmap(int tid, int mapfd)
+{
+  llb_dp_map_t *t = &xh->maps[llb_mstats_ptid(tid)];
+  size_t sz = (size_t)xh->maps[tid].max_entries * sizeof(struct dp_pb_stats);
+  void *base;
+
+  if (t->ms) return;
+
+  base = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_SHARED, mapfd, 0);
+  if (base == MAP_FAILED) {
+    log_error("BPF: %s mmap failed (%d)", xh->maps[tid].map_name, errno);
+    return;
+  }
+
+  t->ms_ents = t->max_entries;
+  t->ms = base;
+  log_info("BPF: %s stats mapped", t->map_name);
+}
+
+static inline void
+ll_mstats_sum(llb_dp_map_t *t, uint32_t idx, __u64 *pkts, __u64 *bytes)
+{
+  struct dp_pb_stats *v = t->ms + idx;
+  __u64 sb = 0;
+  __u64 sp = 0;
+  int c;
+
+  for (c = 0; c < LLB_MSTAT_STRIPES; c++) {
+    sb += __atomic_load_n(&v->bytes, __ATOMIC_RELAXED);
+    sp += __atomic_load_n(&v->packets, __ATOMIC_RELAXED);
+    v += t->ms_ents;
+  }
+
+  *bytes = sb;
+  *pkts = sp;
+}
+
+static inline void
+ll_mstats_clear(llb_dp_map_t *t, uint32_t idx)
+{
+  struct dp_pb_stats *v = t->ms + idx;
+  int c;
+
+  for (c = 0; c < LLB_MSTAT_STRIPES; c++) {
+    __atomic_store_n(&v->bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&v->packets, 0, __ATOMIC_RELAXED);
+    v += t->ms_ents;
+  }
+}
+
+int
+llb_get_mmap_stats(int tbl, void **base, uint32_t *ents, uint32_t *stripes)
+{
+  llb_dp_map_t *t;
+
+  if (tbl < 0 || tbl >= LL_DP_MAX_MAP || !base || !ents || !stripes)
+    return -EINVAL;
+
+  t = &xh->maps[tbl];
+  if (t->has_pb && t->pb_xtid > 0) {
+    if (t->pb_xtid >= LL_DP_MAX_MAP)
+      return -EINVAL;
+    t = &xh->maps[t->pb_xtid];
+  }
+
+  if (!t->ms)
+    return -ENOENT;
+
+  *base = t->ms;
+  *ents = t->ms_ents;
+  *stripes = LLB_MSTAT_STRIPES;
+
+  return 0;
+}
+
+static void
+llb_sync_fw_gen_map(int mapfd)
+{
+  uint32_t fam;
+  uint32_t bank;
+
+  /* Maps might be pinned from a previous run with other bank active */
+  for (fam = 0; fam < 2; fam++) {
+    if (bpf_map_lookup_elem(mapfd, &fam, &bank) == 0) {
+      xh->fw_bank[fam] = bank & LLB_FW_GEN_BANK;
+    }
+  }
+}
+
+static void
+llb_sync_fc_gen_map(int mapfd)
+{
+  uint32_t k = 0;
+  uint32_t gen;
+
+  if (bpf_map_lookup_elem(mapfd, &k, &gen) == 0) {
+    xh->fc_gen = gen & LLB_FC_GEN_MAX;
+    /* Bumps before a restart are not known, next flush is a full one */
+    xh->fc_gen_bumps = LLB_FC_GEN_MAX;
+  }
+}
+
 static int
 llb_dflt_sec_map2fd_all(struct bpf_object *bpf_obj)
 {
@@ -1162,11 +1875,26 @@ llb_dflt_sec_map2fd_all(struct bpf_object *bpf_obj)
     if (i == LL_DP_SOCK_RWR_MAP || i == LL_DP_SOCK_PROXY_MAP) continue;
     fd = llb_objmap2fd(bpf_obj, xh->maps[i].map_name);  
     if (fd < 0) {
-      log_error("BPF: map2fd failed %s", xh->maps[i].map_name);
+      /* Mmapable stats are present only with HAVE_DP_MMAP_STATS */
+      if (llb_mstats_ptid(i) < 0) {
+        log_error("BPF: map2fd failed %s", xh->maps[i].map_name);
+      }
       continue;
     }
     xh->maps[i].map_fd = fd;
 
+    if (llb_mstats_ptid(i) >= 0) {
+      llb_mstats_mmap(i, fd);
+    }
+
+    if (i == LL_DP_FW_GEN_MAP) {
+      llb_sync_fw_gen_map(fd);
+    }
+
+    if (i == LL_DP_FC_GEN_MAP) {
+      llb_sync_fc_gen_map(fd);
+    }
+
     if (!xh->have_loader) continue;
 
     if (i == LL_DP_PGM_MAP) {
@@ -1379,14 +2107,10 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_INTF_STATS_MAP].map_name = "intf_stats_map";
   xh->maps[LL_DP_INTF_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_INTF_STATS_MAP].max_entries = LLB_INTERFACES; 
-  xh->maps[LL_DP_INTF_STATS_MAP].pbs = calloc(LLB_INTERFACES, 
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_BD_STATS_MAP].map_name = "bd_stats_map";
   xh->maps[LL_DP_BD_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_BD_STATS_MAP].max_entries = LLB_INTF_MAP_ENTRIES;
-  xh->maps[LL_DP_BD_STATS_MAP].pbs = calloc(LLB_INTF_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_SMAC_MAP].map_name = "smac_map";
   xh->maps[LL_DP_SMAC_MAP].has_pb   = 0;
@@ -1400,8 +2124,6 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_TMAC_STATS_MAP].map_name = "tmac_stats_map";
   xh->maps[LL_DP_TMAC_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_TMAC_STATS_MAP].max_entries = LLB_TMAC_MAP_ENTRIES;
-  xh->maps[LL_DP_TMAC_STATS_MAP].pbs = calloc(LLB_TMAC_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_CT_MAP].map_name = "ct_map";
   xh->maps[LL_DP_CT_MAP].has_pb   = 0;
@@ -1410,9 +2132,6 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_CT_STATS_MAP].map_name = "ct_stats_map";
   xh->maps[LL_DP_CT_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_CT_STATS_MAP].max_entries = LLB_CT_MAP_ENTRIES;
-  xh->maps[LL_DP_CT_STATS_MAP].pbs = calloc(LLB_CT_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
-  assert(xh->maps[LL_DP_CT_STATS_MAP].pbs);
 
   xh->maps[LL_DP_RTV4_MAP].map_name = "rt_v4_map";
   xh->maps[LL_DP_RTV4_MAP].has_pb   = 1;
@@ -1422,8 +2141,6 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_RTV4_STATS_MAP].map_name = "rt_v4_stats_map";
   xh->maps[LL_DP_RTV4_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_RTV4_STATS_MAP].max_entries   = LLB_RTV4_MAP_ENTRIES;
-  xh->maps[LL_DP_RTV4_STATS_MAP].pbs = calloc(LLB_RTV4_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_RTV6_MAP].map_name = "rt_v6_map";
   xh->maps[LL_DP_RTV6_MAP].has_pb   = 1;
@@ -1433,8 +2150,6 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_RTV6_STATS_MAP].map_name = "rt_v6_stats_map";
   xh->maps[LL_DP_RTV6_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_RTV6_STATS_MAP].max_entries   = LLB_RTV6_MAP_ENTRIES;
-  xh->maps[LL_DP_RTV6_STATS_MAP].pbs = calloc(LLB_RTV6_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_NH_MAP].map_name = "nh_map";
   xh->maps[LL_DP_NH_MAP].has_pb   = 0;
@@ -1455,24 +2170,22 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_TX_INTF_STATS_MAP].map_name = "tx_intf_stats_map";
   xh->maps[LL_DP_TX_INTF_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_TX_INTF_STATS_MAP].max_entries = LLB_INTERFACES; 
-  xh->maps[LL_DP_TX_INTF_STATS_MAP].pbs = calloc(LLB_INTERFACES, 
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_TX_BD_STATS_MAP].map_name = "tx_bd_stats_map";
   xh->maps[LL_DP_TX_BD_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_TX_BD_STATS_MAP].max_entries = LLB_INTF_MAP_ENTRIES;
-  xh->maps[LL_DP_TX_BD_STATS_MAP].pbs = calloc(LLB_INTF_MAP_ENTRIES, 
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_FCV4_MAP].map_name = "fc_v4_map";
   xh->maps[LL_DP_FCV4_MAP].has_pb   = 0;
   xh->maps[LL_DP_FCV4_MAP].max_entries = LLB_FCV4_MAP_ENTRIES;
 
+  xh->maps[LL_DP_FCV6_MAP].map_name = "fc_v6_map";
+  xh->maps[LL_DP_FCV6_MAP].has_pb   = 0;
+  xh->maps[LL_DP_FCV6_MAP].max_entries = LLB_FCV6_MAP_ENTRIES;
+
   xh->maps[LL_DP_FCV4_STATS_MAP].map_name = "fc_v4_stats_map";
   xh->maps[LL_DP_FCV4_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_FCV4_STATS_MAP].max_entries = LLB_FCV4_MAP_ENTRIES;
-  xh->maps[LL_DP_FCV4_STATS_MAP].pbs = calloc(LLB_FCV4_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_PGM_MAP].map_name = "pgm_tbl";
   xh->maps[LL_DP_PGM_MAP].has_pb   = 0;
@@ -1491,8 +2204,6 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_NAT_STATS_MAP].map_name = "nat_stats_map";
   xh->maps[LL_DP_NAT_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_NAT_STATS_MAP].max_entries = LLB_NATV4_STAT_MAP_ENTRIES;
-  xh->maps[LL_DP_NAT_STATS_MAP].pbs = calloc(LLB_NATV4_STAT_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_PKT_PERF_RING].map_name = "pkt_ring";
   xh->maps[LL_DP_PKT_PERF_RING].has_pb   = 0;
@@ -1506,8 +2217,6 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_SESS4_STATS_MAP].map_name = "sess_v4_stats_map";
   xh->maps[LL_DP_SESS4_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_SESS4_STATS_MAP].max_entries = LLB_SESS_MAP_ENTRIES;
-  xh->maps[LL_DP_SESS4_STATS_MAP].pbs = calloc(LLB_SESS_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_FW4_MAP].map_name = "fw_v4_map";
   xh->maps[LL_DP_FW4_MAP].has_pb   = 1;
@@ -1517,8 +2226,6 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_FW_STATS_MAP].map_name = "fw_stats_map";
   xh->maps[LL_DP_FW_STATS_MAP].has_pb   = 1;
   xh->maps[LL_DP_FW_STATS_MAP].max_entries = LLB_FW4_MAP_ENTRIES + LLB_FW6_MAP_ENTRIES;
-  xh->maps[LL_DP_FW_STATS_MAP].pbs = calloc(LLB_FW4_MAP_ENTRIES + LLB_FW6_MAP_ENTRIES,
-                                            sizeof(struct dp_pbc_stats));
 
   xh->maps[LL_DP_FW6_MAP].map_name = "fw_v6_map";
   xh->maps[LL_DP_FW6_MAP].has_pb   = 1;
@@ -1561,7 +2268,67 @@ llb_xh_init(llb_dp_struct_t *xh)
   xh->maps[LL_DP_SOCK_PROXY_MAP].has_pb   = 0;
   xh->maps[LL_DP_SOCK_PROXY_MAP].max_entries = LLB_SOCK_MAP_SZ;
 
-  strcpy(xh->psecs[0].name, LLB_SECTION_PASS);
+  xh->maps[LL_DP_FW_GEN_MAP].map_name = "fw_gen_map";
+  xh->maps[LL_DP_FW_GEN_MAP].has_pb   = 0;
+  xh->maps[LL_DP_FW_GEN_MAP].max_entries = 2;
+
+  xh->maps[LL_DP_FW4_TSS_MASK_MAP].map_name = "fw4_tss_mask_map";
+  xh->maps[LL_DP_FW4_TSS_MASK_MAP].has_pb   = 0;
+  xh->maps[LL_DP_FW4_TSS_MASK_MAP].max_entries = LLB_FW4_TSS_MASKS * LLB_FW_MAP_BANKS;
+
+  xh->maps[LL_DP_FW4_TSS_MAP].map_name = "fw4_tss_map";
+  xh->maps[LL_DP_FW4_TSS_MAP].has_pb   = 0;
+  xh->maps[LL_DP_FW4_TSS_MAP].max_entries = LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS;
+
+  xh->maps[LL_DP_FW4_XM_MAP].map_name = "fw4_xm_map";
+  xh->maps[LL_DP_FW4_XM_MAP].has_pb   = 0;
+  xh->maps[LL_DP_FW4_XM_MAP].max_entries = LLB_FW4_MAP_ENTRIES * LLB_FW_MAP_BANKS;
+
+  xh->maps[LL_DP_RTV4_MSTATS_MAP].map_name = "rt_v4_mstats_map";
+  xh->maps[LL_DP_RTV4_MSTATS_MAP].has_pb   = 0;
+  xh->maps[LL_DP_RTV4_MSTATS_MAP].max_entries = LLB_RTV4_MAP_ENTRIES * LLB_MSTAT_STRIPES;
+
+  xh->maps[LL_DP_NAT_MSTATS_MAP].map_name = "nat_mstats_map";
+  xh->maps[LL_DP_NAT_MSTATS_MAP].has_pb   = 0;
+  xh->maps[LL_DP_NAT_MSTATS_MAP].max_entries = LLB_NATV4_STAT_MAP_ENTRIES * LLB_MSTAT_STRIPES;
+
+  xh->maps[LL_DP_FW_MSTATS_MAP].map_name = "fw_mstats_map";
+  xh->maps[LL_DP_FW_MSTATS_MAP].has_pb   = 0;
+  xh->maps[LL_DP_FW_MSTATS_MAP].max_entries = (LLB_FW4_MAP_ENTRIES + LLB_FW6_MAP_ENTRIES) * LLB_MSTAT_STRIPES;
+
+  xh->maps[LL_DP_FC_GEN_MAP].map_name = "fc_gen_map";
+  xh->maps[LL_DP_FC_GEN_MAP].has_pb   = 0;
+  xh->maps[LL_DP_FC_GEN_MAP].max_entries = 1;
+
+  xh->maps[LL_DP_NAT_MAGLEV_MAP].map_name = "nat_maglev_map";
+  xh->maps[LL_DP_NAT_MAGLEV_MAP].has_pb   = 0;
+  xh->maps[LL_DP_NAT_MAGLEV_MAP].max_entries = LLB_MAGLEV_MAP_ENTRIES;
+
+  xh->maps[LL_DP_NAT_WSEL_MAP].map_name = "nat_wsel_map";
+  xh->maps[LL_DP_NAT_WSEL_MAP].has_pb   = 0;
+  xh->maps[LL_DP_NAT_WSEL_MAP].max_entries = LLB_WSEL_MAP_ENTRIES;
+
+  xh->maps[LL_DP_NAT_LCP_MAP].map_name = "nat_lcp_map";
+  xh->maps[LL_DP_NAT_LCP_MAP].has_pb   = 0;
+  xh->maps[LL_DP_NAT_LCP_MAP].max_entries = LLB_NATV4_STAT_MAP_ENTRIES;
+
+  xh->maps[LL_DP_NAT_LCP_DEC_MAP].map_name = "nat_lcp_dec_map";
+  xh->maps[LL_DP_NAT_LCP_DEC_MAP].has_pb   = 0;
+  xh->maps[LL_DP_NAT_LCP_DEC_MAP].max_entries = LLB_NATV4_STAT_MAP_ENTRIES;
+
+  xh->maps[LL_DP_NAT_XFRM_MAP].map_name = "nat_xfrm_map";
+  xh->maps[LL_DP_NAT_XFRM_MAP].has_pb   = 0;
+  xh->maps[LL_DP_NAT_XFRM_MAP].max_entries = LLB_NAT_XFRM_MAP_ENTRIES;
+
+  /* Stats indices of these are handed out by us and get cleared on add
+   * so stats collection can stop at the highest one in use
+   */
+  xh->maps[LL_DP_TMAC_STATS_MAP].st_hwm_on = 1;
+  xh->maps[LL_DP_RTV4_STATS_MAP].st_hwm_on = 1;
+  xh->maps[LL_DP_NAT_STATS_MAP].st_hwm_on = 1;
+  xh->maps[LL_DP_FW_STATS_MAP].st_hwm_on = 1;
+
+  strcpy(xh->psecs[0].name, LLB_SECTION_PASS);
   strcpy(xh->psecs[1].name, XDP_LL_SEC_DEFAULT);
   xh->psecs[1].setup = llb_dflt_sec_map2fd_all;
 
@@ -1608,6 +2375,158 @@ llb_xh_init(llb_dp_struct_t *xh)
   return;
 }
 
+static inline uint32_t
+llb_pbc_slot(llb_pbc_tbl_t *h, uint32_t idx)
+{
+  /* Fibonacci hashing - the top bits of the product mix in all of idx */
+  return (idx * 2654435761U) >> h->shift;
+}
+
+static struct dp_pbc_stats *
+llb_pbc_find(llb_pbc_tbl_t *h, uint32_t idx)
+{
+  uint32_t i;
+
+  if (h->cap == 0) return NULL;
+
+  for (i = llb_pbc_slot(h, idx); h->ents[i].idx != LLB_PBC_EMPTY;
+       i = (i + 1) & (h->cap - 1)) {
+    if (h->ents[i].idx == idx) {
+      return &h->ents[i].s;
+    }
+  }
+
+  return NULL;
+}
+
+static llb_pbc_ent_t *
+llb_pbc_ins__(llb_pbc_tbl_t *h, uint32_t idx)
+{
+  uint32_t i;
+
+  for (i = llb_pbc_slot(h, idx); h->ents[i].idx != LLB_PBC_EMPTY;
+       i = (i + 1) & (h->cap - 1));
+
+  h->ents[i].idx = idx;
+  h->n++;
+  return &h->ents[i];
+}
+
+static int
+llb_pbc_grow(llb_pbc_tbl_t *h)
+{
+  llb_pbc_ent_t *oents = h->ents;
+  uint32_t ocap = h->cap;
+  uint32_t ncap = ocap ? ocap * 2 : LLB_PBC_MIN_CAP;
+  llb_pbc_ent_t *e;
+  uint32_t i;
+
+  h->ents = malloc(ncap * sizeof(*h->ents));
+  if (!h->ents) {
+    h->ents = oents;
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < ncap; i++) {
+    h->ents[i].idx = LLB_PBC_EMPTY;
+  }
+  h->cap = ncap;
+  h->shift = 32 - __builtin_ctz(ncap);
+  h->n = 0;
+
+  for (i = 0; i < ocap; i++) {
+    if (oents[i].idx == LLB_PBC_EMPTY) continue;
+    e = llb_pbc_ins__(h, oents[i].idx);
+    memcpy(&e->s, &oents[i].s, sizeof(e->s));
+  }
+
+  if (oents) free(oents);
+  return 0;
+}
+
+/*
+ * llb_pbc_get - Cached stats of idx, allocated on first use
+ */
+static struct dp_pbc_stats *
+llb_pbc_get(llb_pbc_tbl_t *h, uint32_t idx)
+{
+  struct dp_pbc_stats *s;
+  llb_pbc_ent_t *e;
+
+  s = llb_pbc_find(h, idx);
+  if (s) return s;
+
+  /* Load factor is kept below 0.7 */
+  if ((uint64_t)(h->n + 1) * 10 > (uint64_t)h->cap * 7) {
+    if (llb_pbc_grow(h) != 0) {
+      return NULL;
+    }
+  }
+
+  e = llb_pbc_ins__(h, idx);
+  memset(&e->s, 0, sizeof(e->s));
+  return &e->s;
+}
+
+static void
+llb_pbc_del(llb_pbc_tbl_t *h, uint32_t idx)
+{
+  uint32_t m = h->cap - 1;
+  uint32_t i, j, k;
+
+  if (h->cap == 0) return;
+
+  for (i = llb_pbc_slot(h, idx); h->ents[i].idx != idx; i = (i + 1) & m) {
+    if (h->ents[i].idx == LLB_PBC_EMPTY) return;
+  }
+
+  /* Shift back later entries of the probe run so no tombstones are needed */
+  for (j = (i + 1) & m; h->ents[j].idx != LLB_PBC_EMPTY; j = (j + 1) & m) {
+    k = llb_pbc_slot(h, h->ents[j].idx);
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      h->ents[i] = h->ents[j];
+      i = j;
+    }
+  }
+
+  h->ents[i].idx = LLB_PBC_EMPTY;
+  h->n--;
+}
+
+static void
+llb_pbc_flush(llb_pbc_tbl_t *h)
+{
+  if (h->ents) free(h->ents);
+  h->ents = NULL;
+  h->cap = 0;
+  h->shift = 0;
+  h->n = 0;
+}
+
+int
+llb_get_stats_cache_info(int tbl, struct dp_stats_cache_info *info)
+{
+  llb_dp_map_t *t;
+  int i;
+
+  if (!info || tbl >= LL_DP_MAX_MAP) return -EINVAL;
+
+  memset(info, 0, sizeof(*info));
+  for (i = 0; i < LL_DP_MAX_MAP; i++) {
+    if (tbl >= 0 && i != tbl) continue;
+    t = &xh->maps[i];
+    if (!t->has_pb || t->pb_xtid > 0) continue;
+
+    pthread_rwlock_rdlock(&t->stat_lock);
+    info->entries += t->pbs.n;
+    info->slots += t->pbs.cap;
+    info->mem_bytes += (uint64_t)t->pbs.cap * sizeof(llb_pbc_ent_t);
+    pthread_rwlock_unlock(&t->stat_lock);
+  }
+
+  return 0;
+}
+
 static void
 llb_clear_stats_pcpu_arr(int mfd, __u32 idx) 
 {
@@ -1621,36 +2540,40 @@ llb_clear_stats_pcpu_arr(int mfd, __u32 idx)
   }
 }
 
+/*
+ * ll_stats_pcpu_sum - Sum per-CPU counters of one index. The values are
+ * walked as a flat u64 array with two independent accumulators and no
+ * branches, which the compiler turns into vector adds.
+ */
+static inline void
+ll_stats_pcpu_sum(const struct dp_pb_stats *values, unsigned int nr_cpus,
+                  __u64 *pkts, __u64 *bytes)
+{
+  const __u64 *v = (const __u64 *)values;
+  __u64 sb = 0;
+  __u64 sp = 0;
+  unsigned int i;
+
+  for (i = 0; i < 2*nr_cpus; i += 2) {
+    sb += v[i];
+    sp += v[i+1];
+  }
+
+  *bytes = sb;
+  *pkts = sp;
+}
+
 static void
-ll_get_stats_pcpu_arr(int mfd, __u32 idx, 
-                      struct dp_pbc_stats *s,
-                      dp_ts_cb_t cb)
+ll_stats_pbc_update(struct dp_pbc_stats *s, __u32 idx,
+                    __u64 sum_pkts, __u64 sum_bytes,
+                    __u64 cts, dp_ts_cb_t cb)
 {
-  /* For percpu maps, userspace gets a value per possible CPU */
-  unsigned int nr_cpus = bpf_num_possible_cpus();
-  struct dp_pb_stats values[nr_cpus];
-  __u64 sum_bytes = 0;
-  __u64 sum_pkts = 0;
   __u64 opc = 0;
-  __u64 cts;
-  int i;
 
-  if ((bpf_map_lookup_elem(mfd, &idx, values)) != 0) {
-    log_error("bpf_map_lookup_elem failed idx:0x%X", idx);
-    return;
-  }
-  
-  cts = get_os_nsecs();
   opc = s->st.packets;
   if (s->lts_used == 0)
     s->lts_used = cts;
 
-  /* Sum values from each CPU */
-  for (i = 0; i < nr_cpus; i++) {
-    sum_pkts  += values[i].packets;
-    sum_bytes += values[i].bytes;
-  }
-
   s->st.packets = sum_pkts;
   s->st.bytes   = sum_bytes;
 
@@ -1672,10 +2595,170 @@ ll_get_stats_pcpu_arr(int mfd, __u32 idx,
   }
 }
 
+/*
+ * ll_stats_pbc_sync - Fold fresh counter sums of idx into the stats cache
+ * of t. Indices get a cache entry only once they are seen non-zero.
+ */
+static void
+ll_stats_pbc_sync(llb_dp_map_t *t, __u32 idx, __u64 sum_pkts,
+                  __u64 sum_bytes, __u64 cts, dp_ts_cb_t cb)
+{
+  struct dp_pbc_stats *s;
+
+  if (sum_pkts || sum_bytes) {
+    if (idx >= t->st_hwm) t->st_hwm = idx + 1;
+    s = llb_pbc_get(&t->pbs, idx);
+  } else {
+    /* Idle and unchanged */
+    s = llb_pbc_find(&t->pbs, idx);
+    if (!s || (!s->st.packets && !s->st.bytes)) return;
+  }
+
+  if (!s) return;
+
+  ll_stats_pbc_update(s, idx, sum_pkts, sum_bytes, cts, cb);
+}
+
+/*
+ * ll_read_stats_pcpu - Read the summed counters of idx of stats map t.
+ * Only touches the map itself, so callers needn't hold stat_lock.
+ */
+static int
+ll_read_stats_pcpu(llb_dp_map_t *t, __u32 idx, __u64 *pkts, __u64 *bytes)
+{
+  /* For percpu maps, userspace gets a value per possible CPU */
+  unsigned int nr_cpus = bpf_num_possible_cpus();
+  struct dp_pb_stats values[nr_cpus];
+
+  if (t->ms) {
+    if (idx >= t->ms_ents) return -1;
+    ll_mstats_sum(t, idx, pkts, bytes);
+    return 0;
+  }
+
+  if ((bpf_map_lookup_elem(t->map_fd, &idx, values)) != 0) {
+    log_error("bpf_map_lookup_elem failed idx:0x%X", idx);
+    return -1;
+  }
+
+  ll_stats_pcpu_sum(values, nr_cpus, pkts, bytes);
+  return 0;
+}
+
+static void
+ll_get_stats_pcpu_arr(llb_dp_map_t *t, __u32 idx, dp_ts_cb_t cb)
+{
+  __u64 sum_bytes = 0;
+  __u64 sum_pkts = 0;
+
+  if (ll_read_stats_pcpu(t, idx, &sum_pkts, &sum_bytes) != 0) {
+    return;
+  }
+
+  ll_stats_pbc_sync(t, idx, sum_pkts, sum_bytes, get_os_nsecs(), cb);
+}
+
+/*
+ * llb_fetch_map_stats_mmap - Harvest stats of indices [0, end) of stats
+ * map t straight from its mapped counter stripes
+ */
+static void
+llb_fetch_map_stats_mmap(int tid, llb_dp_map_t *t, uint32_t end,
+                         dp_ts_cb_t cb, dp_tiv_cb_t vcb)
+{
+  __u64 sum_bytes;
+  __u64 sum_pkts;
+  __u64 cts = get_os_nsecs();
+  uint32_t e;
+
+  if (end > t->ms_ents) end = t->ms_ents;
+
+  for (e = 0; e < end; e++) {
+    if (vcb && vcb(tid, e) == 0) continue;
+
+    ll_mstats_sum(t, e, &sum_pkts, &sum_bytes);
+    ll_stats_pbc_sync(t, e, sum_pkts, sum_bytes, cts, cb);
+  }
+}
+
+/*
+ * llb_fetch_map_stats_batch - Harvest per-CPU stats of indices [0, end)
+ * of stats map t in slices of batch_sz with one syscall per slice.
+ * Returns -1 if the map can't be read in batches.
+ */
+static int
+llb_fetch_map_stats_batch(int tid, llb_dp_map_t *t, uint32_t end,
+                          dp_ts_cb_t cb, dp_tiv_cb_t vcb)
+{
+  LIBBPF_OPTS(bpf_map_batch_opts, opts);
+  unsigned int nr_cpus = bpf_num_possible_cpus();
+  struct dp_pb_stats *vals;
+  uint32_t *keys;
+  uint32_t ibatch = 0;
+  uint32_t obatch = 0;
+  uint32_t n = 0;
+  uint32_t cnt;
+  uint32_t e;
+  uint32_t i;
+  __u64 sum_bytes;
+  __u64 sum_pkts;
+  __u64 cts;
+  int ret;
+
+  if (t->no_batch || xh->batch_sz <= 1 || nr_cpus == 0) {
+    return -1;
+  }
+
+  keys = calloc(xh->batch_sz, sizeof(*keys));
+  vals = calloc((size_t)xh->batch_sz * nr_cpus, sizeof(*vals));
+  if (!keys || !vals) {
+    if (keys) free(keys);
+    if (vals) free(vals);
+    return -1;
+  }
+
+  while (n < end) {
+    cnt = end - n < xh->batch_sz ? end - n : xh->batch_sz;
+    ret = bpf_map_lookup_batch(t->map_fd, n ? &ibatch : NULL, &obatch,
+                               keys, vals, &cnt, &opts);
+    if (ret != 0 && errno != ENOENT) {
+      if (n == 0 && (errno == EINVAL || errno == ENOTSUPP ||
+                     errno == EOPNOTSUPP)) {
+        log_info("TID %d map batch not supported (%d)", tid, errno);
+        t->no_batch = 1;
+        free(keys);
+        free(vals);
+        return -1;
+      }
+      log_error("TID %d stats batch lookup failed (%d)", tid, errno);
+      break;
+    }
+
+    cts = get_os_nsecs();
+    for (i = 0; i < cnt; i++) {
+      e = keys[i];
+      if (e >= end) continue;
+      if (vcb && vcb(tid, e) == 0) continue;
+
+      ll_stats_pcpu_sum(&vals[i*nr_cpus], nr_cpus, &sum_pkts, &sum_bytes);
+      ll_stats_pbc_sync(t, e, sum_pkts, sum_bytes, cts, cb);
+    }
+
+    n += cnt;
+    if (ret != 0 || cnt == 0) break;
+    ibatch = obatch;
+  }
+
+  free(keys);
+  free(vals);
+  return 0;
+}
+
 static void 
 llb_fetch_map_stats_raw(int tid, dp_ts_cb_t cb, dp_tiv_cb_t vcb)
 {
   int e = 0;
+  uint32_t end;
   llb_dp_map_t *t;
 
   if (tid < 0 || tid >= LL_DP_MAX_MAP) 
@@ -1688,23 +2771,60 @@ llb_fetch_map_stats_raw(int tid, dp_ts_cb_t cb, dp_tiv_cb_t vcb)
   if (t->has_pb) {
 
     pthread_rwlock_wrlock(&t->stat_lock);
+
+    /* Indices past the high-water mark were never handed out */
+    end = t->max_entries;
+    if (t->st_hwm_on && t->st_hwm_ok && t->st_hwm < end) {
+      end = t->st_hwm;
+    }
+
     /* FIXME : Handle non-pcpu */
-    for (e = 0; e < t->max_entries; e++) {
-      if (vcb && vcb(tid, e) == 0) {
-        continue;
-      }
+    if (t->ms) {
+      llb_fetch_map_stats_mmap(tid, t, end, cb, vcb);
+    } else if (llb_fetch_map_stats_batch(tid, t, end, cb, vcb) != 0) {
+      for (e = 0; e < end; e++) {
+        if (vcb && vcb(tid, e) == 0) {
+          continue;
+        }
 
-      ll_get_stats_pcpu_arr(t->map_fd, e, &t->pbs[e], cb);
+        ll_get_stats_pcpu_arr(t, e, cb);
+      }
     }
+
+    /* First full pass has seen anything left over in pinned maps */
+    t->st_hwm_ok = 1;
     pthread_rwlock_unlock(&t->stat_lock);
   }
 }
 
+/*
+ * llb_nat_cid2sidx - Map NAT stats cid (LLB_NAT_STAT_CID) to the stats id
+ * counting it in the datapath
+ */
+static int
+llb_nat_cid2sidx(uint32_t cid, uint32_t *sidx)
+{
+  uint32_t rid = LLB_NAT_STAT_RID(cid);
+  uint32_t aid = LLB_NAT_STAT_AID(cid);
+  int ret = -1;
+
+  pthread_mutex_lock(&xh->nat_sr_lock);
+  if (aid < xh->nat_sr[rid].n) {
+    *sidx = xh->nat_sr[rid].sbase + aid;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&xh->nat_sr_lock);
+
+  return ret;
+}
+
 int
 llb_fetch_map_stats_cached(int tbl, uint32_t e, int raw,
                            void *bytes, void *packets)
 {
   llb_dp_map_t *t;
+  __u64 b = 0;
+  __u64 p = 0;
 
   if (tbl < 0 || tbl >= LL_DP_MAX_MAP) 
     return -1;
@@ -1712,7 +2832,7 @@ llb_fetch_map_stats_cached(int tbl, uint32_t e, int raw,
   if (tbl == LL_DP_NAT_STATS_MAP) {
     uint64_t b = 0;
     uint64_t p = 0;
-    proxy_get_entry_stats((uint32_t )((e >> 4) & 0xfff), (int)(e & 0xf), &p, &b);
+    proxy_get_entry_stats(LLB_NAT_STAT_RID(e), (int)LLB_NAT_STAT_AID(e), &p, &b);
     *(uint64_t *)packets += p;
     *(uint64_t *)bytes += b;
   }
@@ -1720,6 +2840,11 @@ llb_fetch_map_stats_cached(int tbl, uint32_t e, int raw,
   if (xh->have_noebpf)
     return 0;
 
+  if (tbl == LL_DP_NAT_MAP || tbl == LL_DP_NAT_STATS_MAP) {
+    if (llb_nat_cid2sidx(e, &e) != 0)
+      return 0;
+  }
+
   t = &xh->maps[tbl];
   if (t->has_pb && t->pb_xtid > 0) { 
     if (t->pb_xtid >= LL_DP_MAX_MAP)
@@ -1733,24 +2858,40 @@ llb_fetch_map_stats_cached(int tbl, uint32_t e, int raw,
   }
 
   /* FIXME : Handle non-pcpu */
+  /* The map read is the costly part, it needn't hold stat_lock */
+  if (raw && ll_read_stats_pcpu(t, e, &p, &b) != 0) {
+    raw = 0;
+  }
+
   pthread_rwlock_wrlock(&t->stat_lock);
   if (raw) {
-    ll_get_stats_pcpu_arr(t->map_fd, e, &t->pbs[e], NULL);
+    ll_stats_pbc_sync(t, e, p, b, get_os_nsecs(), NULL);
   }
 
   if (e < t->max_entries) {
-    *(uint64_t *)bytes += t->pbs[e].st.bytes;
-    *(uint64_t *)packets += t->pbs[e].st.packets;
+    struct dp_pbc_stats *s = llb_pbc_find(&t->pbs, e);
+    if (s) {
+      *(uint64_t *)bytes += s->st.bytes;
+      *(uint64_t *)packets += s->st.packets;
+    }
   }
   pthread_rwlock_unlock(&t->stat_lock);
 
   return 0;
 }
 
+/*
+ * llb_fetch_map_stats_used - Get (and optionally clear) the used flag of
+ * e. With sync set, the counters of e are refreshed first under the same
+ * stat_lock hold, the map read itself is done before taking it.
+ */
 static int
-llb_fetch_map_stats_used(int tbl, uint32_t e, int clr, int *used)
+llb_fetch_map_stats_used(int tbl, uint32_t e, int sync, int clr, int *used)
 {
+  struct dp_pbc_stats *s;
   llb_dp_map_t *t;
+  __u64 b = 0;
+  __u64 p = 0;
 
   if (tbl < 0 || tbl >= LL_DP_MAX_MAP)
     return -1;
@@ -1763,14 +2904,23 @@ llb_fetch_map_stats_used(int tbl, uint32_t e, int clr, int *used)
     t = &xh->maps[t->pb_xtid];
   }
 
+  if (sync && (!t->has_pb || ll_read_stats_pcpu(t, e, &p, &b) != 0)) {
+    sync = 0;
+  }
+
   pthread_rwlock_wrlock(&t->stat_lock);
 
+  if (sync) {
+    ll_stats_pbc_sync(t, e, p, b, get_os_nsecs(), NULL);
+  }
+
+  s = llb_pbc_find(&t->pbs, e);
   if (used) {
-    *used = t->pbs[e].used;
+    *used = s ? s->used : 0;
   }
 
-  if (clr) {
-    t->pbs[e].used = 0;
+  if (clr && s) {
+    s->used = 0;
   }
   
   pthread_rwlock_unlock(&t->stat_lock);
@@ -1886,56 +3036,374 @@ next:
 }
 
 static void
-llb_clear_map_stats_internal(int tid, __u32 idx, bool wipe)
+llb_map_delete_batch(int tid, llb_dp_map_t *t, uint8_t *keys,
+                     size_t key_sz, uint32_t nd)
 {
-  int e = 0;
-  llb_dp_map_t *t;
+  LIBBPF_OPTS(bpf_map_batch_opts, opts);
+  uint32_t cnt = nd;
+  uint32_t i;
 
-  if (tid < 0 || tid >= LL_DP_MAX_MAP) 
-    return;
+  for (i = 0; i < nd; i++) {
+    llb_maptrace_uhook(tid, 0, keys + i*key_sz, key_sz, NULL, 0);
+  }
 
-  if (xh->have_noebpf)
+  if (bpf_map_delete_batch(t->map_fd, keys, &cnt, &opts) == 0) {
     return;
+  }
 
-  t = &xh->maps[tid];
-  if (t->has_pb) {
-    if (t->pb_xtid > 0) {
-      if (t->pb_xtid >= LL_DP_MAX_MAP)
-        return;
-      t = &xh->maps[t->pb_xtid];
-      if (!t->has_pb || t->pb_xtid > 0) {
-        return;
-      }
-    }
-    /* FIXME : Handle non-pcpu */
-    if (!wipe) {
-        llb_clear_stats_pcpu_arr(t->map_fd, idx);
-    } else {
-      for (e = 0; e < t->max_entries; e++) {
-        llb_clear_stats_pcpu_arr(t->map_fd, e);
-      }
-    }
+  /* Callbacks might have already removed some keys (e.g reverse CT
+   * entries). Batch delete stops at first failure so finish the rest
+   * one at a time.
+   */
+  for (i = cnt; i < nd; i++) {
+    bpf_map_delete_elem(t->map_fd, keys + i*key_sz);
   }
 }
 
-void
-llb_clear_map_stats(int tid, __u32 idx)
+/*
+ * llb_map_chunk_eval_seq - Run the walker callback over a chunk of
+ * looked-up entries and collect the keys to be deleted in dkeys.
+ */
+static uint32_t
+llb_map_chunk_eval_seq(int tid, dp_map_walker_t cb, dp_map_ita_t *it,
+                       uint8_t *keys, uint8_t *vals, uint32_t cnt,
+                       uint8_t *dkeys)
 {
-  return llb_clear_map_stats_internal(tid, idx, false);
-}
+  uint32_t nd = 0;
+  uint32_t i;
 
-int
-llb_map2fd(int t)
-{
-  return xh->maps[t].map_fd;
+  for (i = 0; i < cnt; i++) {
+    memcpy(it->next_key, keys + i*it->key_sz, it->key_sz);
+    memcpy(it->val, vals + i*it->val_sz, it->val_sz);
+    if (cb(tid, it->next_key, it)) {
+      memcpy(dkeys + nd*it->key_sz, keys + i*it->key_sz, it->key_sz);
+      nd++;
+    }
+  }
+
+  return nd;
 }
 
-static void ll_map_ct_rm_related(uint32_t rid, uint32_t *aids, int naid);
+/* A hash bucket bigger than the batch fails with ENOSPC */
+#define LLB_MAP_BATCH_GROW_MAX (16*LLB_MAP_BATCH_SZ)
 
+/*
+ * llb_map_walk_batch_slice - Walk a map in chunks of xh->batch_sz
+ * entries using BPF_MAP_LOOKUP_BATCH and remove the entries selected by
+ * the walker callback using BPF_MAP_DELETE_BATCH. This brings down the
+ * syscall count from three per entry to two per chunk. The walk resumes
+ * from cur and stops after max_ents entries or max_us microseconds
+ * (checked per chunk, zero means no limit). cur->done is set once the
+ * end of map is reached. Each chunk is handed over to eval (default
+ * llb_map_chunk_eval_seq) to pick the entries to be deleted. Returns -1
+ * if the map/kernel has no batch support, in which case the caller needs
+ * to fall back.
+ */
 static int
-llb_add_map_elem_nat_post_proc(void *k, void *v)
+llb_map_walk_batch_slice(int tid, dp_map_walker_t cb, dp_map_ita_t *it,
+                         llb_map_cursor_t *cur, uint32_t max_ents,
+                         uint64_t max_us, llb_map_chunk_eval_t eval)
 {
-  struct dp_proxy_tacts *na = v;
+  LIBBPF_OPTS(bpf_map_batch_opts, opts);
+  llb_dp_map_t *t;
+  uint8_t *keys = NULL;
+  uint8_t *vals = NULL;
+  uint8_t *dkeys = NULL;
+  uint64_t sts = get_os_usecs();
+  __u64 obatch = 0;
+  uint32_t bsz;
+  uint32_t cnt;
+  uint32_t nd;
+  uint32_t n = 0;
+  int ret;
+
+  t = &xh->maps[tid];
+  bsz = xh->batch_sz;
+
+  if (!eval) {
+    eval = llb_map_chunk_eval_seq;
+  }
+
+  if (t->no_batch || bsz <= 1 || it->key_sz == 0 || it->val_sz == 0) {
+    return -1;
+  }
+
+  keys = calloc(bsz, it->key_sz);
+  vals = calloc(bsz, it->val_sz);
+  dkeys = calloc(bsz, it->key_sz);
+  if (!keys || !vals || !dkeys) {
+    goto out;
+  }
+
+  while (!cur->done && cur->nvisit < t->max_entries) {
+    if (max_ents && n >= max_ents) break;
+    if (max_us && get_os_usecs() - sts >= max_us) break;
+
+    cnt = bsz;
+    ret = bpf_map_lookup_batch(t->map_fd, cur->started ? &cur->batch : NULL,
+                               &obatch, keys, vals, &cnt, &opts);
+    if (ret != 0 && errno == ENOSPC && bsz < LLB_MAP_BATCH_GROW_MAX) {
+      uint8_t *nk, *nv, *ndk;
+
+      /* Nothing got copied, retry the same bucket with a bigger batch */
+      bsz *= 2;
+      nk = realloc(keys, (size_t)bsz * it->key_sz);
+      if (nk) keys = nk;
+      nv = realloc(vals, (size_t)bsz * it->val_sz);
+      if (nv) vals = nv;
+      ndk = realloc(dkeys, (size_t)bsz * it->key_sz);
+      if (ndk) dkeys = ndk;
+      if (!nk || !nv || !ndk) {
+        log_error("TID %d map batch grow failed", tid);
+        cur->done = 1;
+        break;
+      }
+      continue;
+    }
+    if (ret != 0 && errno != ENOENT) {
+      if (!cur->started && (errno == EINVAL || errno == ENOTSUPP ||
+                            errno == EOPNOTSUPP)) {
+        log_info("TID %d map batch not supported (%d)", tid, errno);
+        t->no_batch = 1;
+        free(keys);
+        free(vals);
+        free(dkeys);
+        return -1;
+      }
+      log_error("TID %d map batch lookup failed (%d)", tid, errno);
+      cur->done = 1;
+      break;
+    }
+
+    cur->started = 1;
+    nd = cnt ? eval(tid, cb, it, keys, vals, cnt, dkeys) : 0;
+
+    if (nd) {
+      llb_map_delete_batch(tid, t, dkeys, it->key_sz, nd);
+    }
+
+    n += cnt;
+    cur->nvisit += cnt;
+    cur->ndel += nd;
+    if (ret != 0) {
+      /* ENOENT - Reached end of map */
+      cur->done = 1;
+      break;
+    }
+    cur->batch = obatch;
+  }
+
+  if (cur->nvisit >= t->max_entries) {
+    cur->done = 1;
+  }
+
+#ifdef LLB_DP_CT_DEBUG
+  log_trace("TID %d entry batch loop count: %d", tid, n);
+#endif
+
+out:
+  if (keys) free(keys);
+  if (vals) free(vals);
+  if (dkeys) free(dkeys);
+  return 0;
+}
+
+/*
+ * llb_map_walk_step_slice - Same as llb_map_walk_batch_slice() but one
+ * entry at a time for maps/kernels without batch support. The cursor
+ * holds the next key to be visited. If that key vanishes in between
+ * slices, bpf_map_get_next_key() restarts from the first key and the
+ * cycle gets bounded by max_entries instead.
+ */
+static void
+llb_map_walk_step_slice(int tid, dp_map_walker_t cb, dp_map_ita_t *it,
+                        llb_map_cursor_t *cur, uint32_t max_ents,
+                        uint64_t max_us)
+{
+  llb_dp_map_t *t;
+  uint8_t nkey[1024];
+  uint64_t sts = get_os_usecs();
+  uint32_t n = 0;
+  int visit;
+  int ret;
+
+  t = &xh->maps[tid];
+
+  if (it->key_sz == 0 || it->key_sz > sizeof(cur->key)) {
+    cur->done = 1;
+    return;
+  }
+
+  if (!cur->started) {
+    cur->started = 1;
+    if (bpf_map_get_next_key(t->map_fd, NULL, cur->key) != 0) {
+      cur->done = 1;
+      return;
+    }
+  }
+
+  while (!cur->done && cur->nvisit < t->max_entries) {
+    if (max_ents && n >= max_ents) break;
+    if (max_us && get_os_usecs() - sts >= max_us) break;
+
+    memcpy(it->next_key, cur->key, it->key_sz);
+    visit = 0;
+    if (bpf_map_lookup_elem(t->map_fd, cur->key, it->val) == 0) {
+      visit = cb(tid, it->next_key, it);
+    }
+
+    ret = bpf_map_get_next_key(t->map_fd, cur->key, nkey);
+    if (visit) {
+      llb_maptrace_uhook(tid, 0, cur->key, it->key_sz, NULL, 0);
+      bpf_map_delete_elem(t->map_fd, cur->key);
+      cur->ndel++;
+    }
+
+    n++;
+    cur->nvisit++;
+    if (ret != 0) {
+      cur->done = 1;
+      break;
+    }
+    memcpy(cur->key, nkey, it->key_sz);
+  }
+
+  if (cur->nvisit >= t->max_entries) {
+    cur->done = 1;
+  }
+}
+
+/*
+ * llb_map_walk_slice - Resumable map walk which visits at most max_ents
+ * entries or spends at most max_us microseconds per call. Uses batched
+ * map ops where possible, in which case eval (may be NULL) is used to
+ * evaluate each chunk.
+ */
+static void
+llb_map_walk_slice(int tid, dp_map_walker_t cb, dp_map_ita_t *it,
+                   llb_map_cursor_t *cur, uint32_t max_ents,
+                   uint64_t max_us, llb_map_chunk_eval_t eval)
+{
+  if (xh->have_noebpf) {
+    cur->done = 1;
+    return;
+  }
+
+  if (!cb || tid < 0 || tid >= LL_DP_MAX_MAP) {
+    cur->done = 1;
+    return;
+  }
+
+  if (cur->started && !cur->batched) {
+    llb_map_walk_step_slice(tid, cb, it, cur, max_ents, max_us);
+    return;
+  }
+
+  cur->batched = 1;
+  if (llb_map_walk_batch_slice(tid, cb, it, cur, max_ents, max_us,
+                               eval) < 0) {
+    cur->batched = 0;
+    llb_map_walk_step_slice(tid, cb, it, cur, max_ents, max_us);
+  }
+}
+
+/*
+ * llb_map_loop_and_delete_batch - Walk the whole map using batched map
+ * ops. Falls back to llb_map_loop_and_delete() for maps/kernels without
+ * batch support or when the iterator does not carry key/value sizes.
+ */
+void
+llb_map_loop_and_delete_batch(int tid, dp_map_walker_t cb, dp_map_ita_t *it)
+{
+  llb_map_cursor_t cur;
+
+  if (xh->have_noebpf) {
+    return;
+  }
+
+  if (!cb) return;
+
+  if (tid < 0 || tid >= LL_DP_MAX_MAP)
+    return;
+
+  memset(&cur, 0, sizeof(cur));
+  if (llb_map_walk_batch_slice(tid, cb, it, &cur, 0, 0, NULL) < 0) {
+    llb_map_loop_and_delete(tid, cb, it);
+  }
+}
+
+static void
+llb_clear_map_stats_internal(int tid, __u32 idx, bool wipe)
+{
+  int e = 0;
+  llb_dp_map_t *t;
+
+  if (tid < 0 || tid >= LL_DP_MAX_MAP) 
+    return;
+
+  if (xh->have_noebpf)
+    return;
+
+  t = &xh->maps[tid];
+  if (t->has_pb) {
+    if (t->pb_xtid > 0) {
+      if (t->pb_xtid >= LL_DP_MAX_MAP)
+        return;
+      t = &xh->maps[t->pb_xtid];
+      if (!t->has_pb || t->pb_xtid > 0) {
+        return;
+      }
+    }
+    /* FIXME : Handle non-pcpu */
+    if (!wipe) {
+        if (t->ms) {
+          if (idx < t->ms_ents) ll_mstats_clear(t, idx);
+        } else {
+          llb_clear_stats_pcpu_arr(t->map_fd, idx);
+        }
+        if (idx < t->max_entries) {
+          pthread_rwlock_wrlock(&t->stat_lock);
+          if (idx >= t->st_hwm) t->st_hwm = idx + 1;
+          llb_pbc_del(&t->pbs, idx);
+          pthread_rwlock_unlock(&t->stat_lock);
+        }
+    } else {
+      for (e = 0; e < t->max_entries; e++) {
+        if (t->ms) {
+          if (e < t->ms_ents) ll_mstats_clear(t, e);
+        } else {
+          llb_clear_stats_pcpu_arr(t->map_fd, e);
+        }
+      }
+      pthread_rwlock_wrlock(&t->stat_lock);
+      llb_pbc_flush(&t->pbs);
+      pthread_rwlock_unlock(&t->stat_lock);
+    }
+  }
+}
+
+void
+llb_clear_map_stats(int tid, __u32 idx)
+{
+  if (tid == LL_DP_NAT_MAP || tid == LL_DP_NAT_STATS_MAP) {
+    if (llb_nat_cid2sidx(idx, &idx) != 0)
+      return;
+  }
+  return llb_clear_map_stats_internal(tid, idx, false);
+}
+
+int
+llb_map2fd(int t)
+{
+  return xh->maps[t].map_fd;
+}
+
+static void ll_map_ct_rm_related(uint32_t rid, uint32_t *aids, int naid);
+
+static int
+llb_add_map_elem_nat_post_proc(void *k, void *v)
+{
+  struct dp_proxy_tacts *na = v;
   struct mf_xfrm_inf *ep_arm;
   uint32_t inact_aids[LLB_MAX_NXFRMS];
   int i = 0;
@@ -1959,605 +3427,2540 @@ llb_add_map_elem_nat_post_proc(void *k, void *v)
 
 }
 
+#define LLB_MAGLEV_EMPTY 0xffff
+
+static uint32_t
+llb_maglev_hash(const void *d, int len, uint32_t seed)
+{
+  const uint8_t *p = d;
+  uint32_t h = 2166136261u ^ seed;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/*
+ * llb_maglev_build - Populate tbl from the active end-points of na as per
+ * the Maglev paper. The permutation of an end-point depends only on its
+ * identity (xip, xport) and not on its arm index or on the other
+ * end-points, so a change of one end-point remaps only about 1/n of the
+ * slots. Returns the number of end-points placed in tbl.
+ */
 static int
-llb_del_map_elem_nat_post_proc(void *k, void *v)
+llb_maglev_build(struct dp_proxy_tacts *na, struct dp_maglev_tbl *tbl)
 {
-  struct dp_proxy_tacts *na = v;
+  uint32_t pos[LLB_MAX_NXFRMS];
+  uint32_t skip[LLB_MAX_NXFRMS];
+  uint16_t eps[LLB_MAX_NXFRMS];
   struct mf_xfrm_inf *ep_arm;
-  uint32_t inact_aids[LLB_MAX_NXFRMS];
-  int i = 0;
-  int j = 0;
+  uint32_t id[5];
+  uint32_t filled = 0;
+  int n = 0;
+  int i;
 
-  memset(inact_aids, 0, sizeof(inact_aids));
+  for (i = 0; i < LLB_MAGLEV_TBL_SZ; i++) {
+    tbl->ep[i] = LLB_MAGLEV_EMPTY;
+  }
 
   for (i = 0; i < na->nxfrm && i < LLB_MAX_NXFRMS; i++) {
     ep_arm = &na->nxfrms[i];
+    if (ep_arm->inactive) continue;
 
-    if (ep_arm->inactive == 0) {
-      inact_aids[j++] = i;
+    memcpy(id, ep_arm->nat_xip, sizeof(ep_arm->nat_xip));
+    id[4] = ep_arm->nat_xport;
+    pos[n] = llb_maglev_hash(id, sizeof(id), 0) % LLB_MAGLEV_TBL_SZ;
+    skip[n] = llb_maglev_hash(id, sizeof(id), 0x9e3779b9) %
+                (LLB_MAGLEV_TBL_SZ - 1) + 1;
+    eps[n++] = i;
+  }
+
+  if (n == 0) return 0;
+
+  while (1) {
+    for (i = 0; i < n; i++) {
+      while (tbl->ep[pos[i]] != LLB_MAGLEV_EMPTY) {
+        pos[i] = (pos[i] + skip[i]) % LLB_MAGLEV_TBL_SZ;
+      }
+      tbl->ep[pos[i]] = eps[i];
+      pos[i] = (pos[i] + skip[i]) % LLB_MAGLEV_TBL_SZ;
+      if (++filled == LLB_MAGLEV_TBL_SZ) {
+        return n;
+      }
     }
   }
 
-  if (j > 0) {
-    ll_map_ct_rm_related(na->ca.cidx, inact_aids, j);
+  return n;
+}
+
+static void
+llb_maglev_del(uint32_t rid)
+{
+  llb_maglev_ent_t *e;
+
+  bpf_map_delete_elem(llb_map2fd(LL_DP_NAT_MAGLEV_MAP), &rid);
+
+  HASH_FIND(hh, xh->maglev, &rid, sizeof(rid), e);
+  if (e) {
+    HASH_DEL(xh->maglev, e);
+    free(e);
   }
+}
 
-  return 0;
+/*
+ * llb_maglev_update - (Re)build the Maglev table of NAT rule na if it uses
+ * NAT_LB_SEL_MAGLEV or drop any stale one otherwise. The table is written
+ * only if some slot changed. Needs NAT map lock held.
+ */
+static int
+llb_maglev_update(struct dp_proxy_tacts *na)
+{
+  struct dp_maglev_tbl *tbl, *otbl;
+  llb_maglev_ent_t *e;
+  uint32_t rid = na->ca.cidx;
+  uint32_t changed = 0;
+  uint64_t sts;
+  int fd = llb_map2fd(LL_DP_NAT_MAGLEV_MAP);
+  int ret = 0;
+  int n;
+  int i;
+
+  if (na->sel_type != NAT_LB_SEL_MAGLEV) {
+    HASH_FIND(hh, xh->maglev, &rid, sizeof(rid), e);
+    if (e) llb_maglev_del(rid);
+    return 0;
+  }
+
+  tbl = calloc(1, sizeof(*tbl));
+  otbl = calloc(1, sizeof(*otbl));
+  if (!tbl || !otbl) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  sts = get_os_nsecs();
+  n = llb_maglev_build(na, tbl);
+
+  if (bpf_map_lookup_elem(fd, &rid, otbl) == 0) {
+    for (i = 0; i < LLB_MAGLEV_TBL_SZ; i++) {
+      if (tbl->ep[i] != otbl->ep[i]) changed++;
+    }
+  } else {
+    changed = LLB_MAGLEV_TBL_SZ;
+  }
+
+  if (changed && bpf_map_update_elem(fd, &rid, tbl, 0) != 0) {
+    log_error("maglev: rule %u table update failed", rid);
+    ret = -EFAULT;
+    goto out;
+  }
+
+  HASH_FIND(hh, xh->maglev, &rid, sizeof(rid), e);
+  if (!e) {
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+      ret = -ENOMEM;
+      goto out;
+    }
+    e->rid = rid;
+    HASH_ADD(hh, xh->maglev, rid, sizeof(e->rid), e);
+  }
 
+  e->st.tbl_sz = LLB_MAGLEV_TBL_SZ;
+  e->st.n_eps = n;
+  e->st.rebuilds++;
+  e->st.changed = changed;
+  e->st.build_ns = get_os_nsecs() - sts;
+
+  log_debug("maglev: rule %u eps %d changed %u (%lluns)", rid, n, changed,
+            (unsigned long long)e->st.build_ns);
+out:
+  if (tbl) free(tbl);
+  if (otbl) free(otbl);
+  return ret;
 }
 
-static void
-llb_nat_dec_act_sessions(uint32_t rid, uint32_t aid)
+#define NAT_LB_SEL_WEIGHTED(t) \
+  ((t) == NAT_LB_SEL_WRR || (t) == NAT_LB_SEL_WHASH)
+
+/*
+ * llb_wsel_build - Fill the weighted slot table of na. An active end-point
+ * gets wprio slots (0 counts as 1) after dividing all weights by their gcd,
+ * scaled down if they don't fit the table. The slots are ordered as per
+ * smooth weighted RR so that consecutive slots interleave end-points.
+ * Returns the number of slots.
+ */
+static int
+llb_wsel_build(struct dp_proxy_tacts *na, struct dp_wsel_tbl *tbl)
 {
-  llb_dp_map_t *t;
-  struct dp_nat_epacts epa;
+  int32_t cw[LLB_MAX_NXFRMS];
+  int32_t w[LLB_MAX_NXFRMS];
+  uint16_t eps[LLB_MAX_NXFRMS];
+  int32_t tot = 0;
+  int32_t g = 0;
+  int32_t a, b, t;
+  int n = 0;
+  int best;
+  int i, j;
+
+  for (i = 0; i < na->nxfrm && i < LLB_MAX_NXFRMS; i++) {
+    if (na->nxfrms[i].inactive) continue;
+
+    w[n] = na->nxfrms[i].wprio ? na->nxfrms[i].wprio : 1;
+    for (a = g, b = w[n]; b; t = a % b, a = b, b = t);
+    g = a;
+    eps[n++] = i;
+  }
+
+  for (i = 0; i < n; i++) {
+    w[i] /= g;
+    cw[i] = 0;
+    tot += w[i];
+  }
+
+  /* Scale down so that every end-point still gets a slot */
+  if (tot > LLB_WSEL_TBL_SZ) {
+    int32_t stot = 0;
+
+    for (i = 0; i < n; i++) {
+      w[i] = (int32_t)(((int64_t)w[i] * (LLB_WSEL_TBL_SZ - n)) / tot);
+      if (w[i] == 0) w[i] = 1;
+      stot += w[i];
+    }
+    tot = stot;
+  }
+
+  for (i = 0; i < tot && i < LLB_WSEL_TBL_SZ; i++) {
+    best = 0;
+    for (j = 0; j < n; j++) {
+      cw[j] += w[j];
+      if (cw[j] > cw[best]) best = j;
+    }
+    cw[best] -= tot;
+    tbl->ep[i] = eps[best];
+  }
+
+  tbl->nslots = i;
+  return i;
+}
+
+/*
+ * llb_wsel_update - (Re)build the weighted slot table of NAT rule na if it
+ * uses a weighted mode or drop any stale one otherwise. Needs NAT map lock
+ * held.
+ */
+static int
+llb_wsel_update(struct dp_proxy_tacts *na)
+{
+  struct dp_wsel_tbl *tbl;
+  uint32_t rid = na->ca.cidx;
+  int fd = llb_map2fd(LL_DP_NAT_WSEL_MAP);
+  int ret = 0;
+
+  if (!NAT_LB_SEL_WEIGHTED(na->sel_type)) {
+    /* Rule may have switched mode, NAT updates are rare enough */
+    bpf_map_delete_elem(fd, &rid);
+    return 0;
+  }
+
+  tbl = calloc(1, sizeof(*tbl));
+  if (!tbl) return -ENOMEM;
+
+  if (llb_wsel_build(na, tbl) == 0) {
+    bpf_map_delete_elem(fd, &rid);
+  } else if (bpf_map_update_elem(fd, &rid, tbl, 0) != 0) {
+    log_error("wsel: rule %u table update failed", rid);
+    ret = -EFAULT;
+  }
+
+  free(tbl);
+  return ret;
+}
+
+int
+llb_get_maglev_stats(uint32_t rid, struct dp_maglev_stats *st)
+{
+  llb_maglev_ent_t *e;
+  int ret = -EINVAL;
+
+  if (!st) return -EINVAL;
+
+  XH_RD_LOCK();
+  llb_map_lock(LL_DP_NAT_MAP);
+  HASH_FIND(hh, xh->maglev, &rid, sizeof(rid), e);
+  if (e) {
+    memcpy(st, &e->st, sizeof(*st));
+    ret = 0;
+  }
+  llb_map_unlock(LL_DP_NAT_MAP);
+  XH_UNLOCK();
+
+  return ret;
+}
+
+static int
+llb_del_map_elem_nat_post_proc(llb_nat_xr_t *xr)
+{
+  uint32_t inact_aids[LLB_MAX_NXFRMS];
+  int i = 0;
+  int j = 0;
+
+  memset(inact_aids, 0, sizeof(inact_aids));
+
+  for (i = 0; i < xr->nxfrm && i < LLB_MAX_NXFRMS; i++) {
+    if (xr->act[i/64] & (1ULL << (i%64))) {
+      inact_aids[j++] = i;
+    }
+  }
+
+  if (j > 0) {
+    ll_map_ct_rm_related(xr->rid, inact_aids, j);
+  }
+
+  return 0;
+
+}
+
+/*
+ * llb_nat_lcp_reset - Clear the session counters of stats ids
+ * [sbase, sbase + n)
+ */
+static void
+llb_nat_lcp_reset(uint32_t sbase, uint32_t n)
+{
+  unsigned int nr_cpus = bpf_num_possible_cpus();
+  struct dp_nat_lcp lcs[nr_cpus];
+  uint32_t sidx;
+
+  memset(lcs, 0, sizeof(lcs));
+
+  pthread_mutex_lock(&xh->lcp_lock);
+  for (sidx = sbase; sidx < sbase + n &&
+       sidx < LLB_NATV4_STAT_MAP_ENTRIES; sidx++) {
+    bpf_map_update_elem(llb_map2fd(LL_DP_NAT_LCP_MAP), &sidx, lcs, 0);
+    bpf_map_update_elem(llb_map2fd(LL_DP_NAT_LCP_DEC_MAP), &sidx, &lcs[0], 0);
+  }
+  pthread_mutex_unlock(&xh->lcp_lock);
+}
+
+/*
+ * llb_nat_lcp_dec - Account a NAT_LB_SEL_LC_P2C session aged out by us.
+ * sidx is the stats id the session was counted under, as kept in its CT
+ * entry, which stays valid even if the rule moved to new ids since
+ */
+static void
+llb_nat_lcp_dec(uint32_t sidx)
+{
+  struct dp_nat_lcp ld;
+
+  if (sidx >= LLB_NATV4_STAT_MAP_ENTRIES) return;
+
+  pthread_mutex_lock(&xh->lcp_lock);
+  if (bpf_map_lookup_elem(llb_map2fd(LL_DP_NAT_LCP_DEC_MAP), &sidx, &ld) == 0) {
+    ld.cnt++;
+    bpf_map_update_elem(llb_map2fd(LL_DP_NAT_LCP_DEC_MAP), &sidx, &ld, 0);
+  }
+  pthread_mutex_unlock(&xh->lcp_lock);
+}
+
+static void
+llb_nat_dec_act_sessions(uint32_t rid, uint32_t aid)
+{
+  llb_dp_map_t *t;
+  struct dp_nat_epacts epa;
+
+  t = &xh->maps[LL_DP_NAT_EP_MAP];
+
+  /* CT aging workers get here concurrently */
+  if (t != NULL) {
+    memset(&epa, 0, sizeof(epa));
+    pthread_mutex_lock(&xh->nat_ep_lock);
+    if ((bpf_map_lookup_elem_flags(t->map_fd, &rid, &epa, BPF_F_LOCK)) == 0) {
+      if (aid < LLB_NAT_LC_EPS && epa.active_sess[aid] > 0) {
+        epa.active_sess[aid]--;
+        bpf_map_update_elem(t->map_fd, &rid, &epa, BPF_F_LOCK);
+      }
+    }
+    pthread_mutex_unlock(&xh->nat_ep_lock);
+  }
+}
+
+static void
+llb_nat_rst_act_sessions(uint32_t rid)
+{
+  llb_dp_map_t *t;
+  struct dp_nat_epacts epa;
+  int i;
+
+  t = &xh->maps[LL_DP_NAT_EP_MAP];
+
+  if (t != NULL) {
+    memset(&epa, 0, sizeof(epa));
+    pthread_mutex_lock(&xh->nat_ep_lock);
+    if ((bpf_map_lookup_elem_flags(t->map_fd, &rid, &epa, BPF_F_LOCK)) == 0) {
+      epa.ca.act_type = 0;
+      for (i = 0; i < LLB_NAT_LC_EPS; i++) {
+        epa.active_sess[i] = 0;
+      }
+      bpf_map_update_elem(t->map_fd, &rid, &epa, BPF_F_LOCK);
+    }
+    pthread_mutex_unlock(&xh->nat_ep_lock);
+  }
+}
+
+/*
+ * NAT arm ranges - The arms of a NAT rule live in nat_xfrm_map and its
+ * arms are counted under stats ids, both as ranges of a power of 2 size
+ * (at least 4) aligned to their size. Ranges are handed out first-fit from
+ * a bitmap under NAT map lock.
+ */
+static int
+llb_nat_xr_alloc(uint64_t *bm, uint32_t nbits, uint32_t sz)
+{
+  uint64_t m = sz >= 64 ? ~0ULL : ((1ULL << sz) - 1);
+  uint32_t nw = (sz + 63)/64;
+  uint32_t b, w;
+
+  for (b = 0; b + sz <= nbits; b += sz) {
+    for (w = 0; w < nw; w++) {
+      if (bm[b/64 + w] & (m << (b % 64))) break;
+    }
+    if (w == nw) {
+      for (w = 0; w < nw; w++) {
+        bm[b/64 + w] |= m << (b % 64);
+      }
+      return b;
+    }
+  }
+
+  return -1;
+}
+
+static void
+llb_nat_xr_free(uint64_t *bm, uint32_t base, uint32_t sz)
+{
+  uint64_t m = sz >= 64 ? ~0ULL : ((1ULL << sz) - 1);
+  uint32_t w;
+
+  for (w = 0; w < (sz + 63)/64; w++) {
+    bm[base/64 + w] &= ~(m << (base % 64));
+  }
+}
+
+/*
+ * llb_nat_xr_reap - Free deferred ranges which are past the grace period.
+ * Drain ranges are left to llb_nat_xr_drain().
+ */
+static void
+llb_nat_xr_reap(void)
+{
+  llb_nat_xr_gc_t *g;
+  uint64_t ts = get_os_nsecs();
+  int i, j = 0;
+
+  for (i = 0; i < xh->nat_xgc_n; i++) {
+    g = &xh->nat_xgc[i];
+    if (!g->drain && ts - g->ts >= LLB_NAT_XR_GRACE_NS) {
+      llb_nat_xr_free(g->bm, g->base, g->sz);
+    } else {
+      xh->nat_xgc[j++] = *g;
+    }
+  }
+  xh->nat_xgc_n = j;
+}
+
+/*
+ * llb_nat_xr_grace_left - Time until the latest deferred range, if any,
+ * is past the grace period
+ */
+static uint64_t
+llb_nat_xr_grace_left(void)
+{
+  uint64_t ts = get_os_nsecs();
+  uint64_t left = 0;
+  int i;
+
+  for (i = 0; i < xh->nat_xgc_n; i++) {
+    if (xh->nat_xgc[i].drain ||
+        ts - xh->nat_xgc[i].ts >= LLB_NAT_XR_GRACE_NS) {
+      continue;
+    }
+    if (LLB_NAT_XR_GRACE_NS - (ts - xh->nat_xgc[i].ts) > left) {
+      left = LLB_NAT_XR_GRACE_NS - (ts - xh->nat_xgc[i].ts);
+    }
+  }
+
+  return left;
+}
+
+/*
+ * llb_nat_xr_defer_free - Free a range no longer pointed to by nat_map once
+ * packets which looked up the rule before are done, as for FW bank flips.
+ * With drain set, the range is also held until its sessions are gone.
+ */
+static void
+llb_nat_xr_defer_free(uint64_t *bm, uint32_t base, uint32_t sz, int drain)
+{
+  llb_nat_xr_gc_t *g;
+  int max;
+
+  if (xh->nat_xgc_n >= xh->nat_xgc_max) {
+    max = xh->nat_xgc_max ? xh->nat_xgc_max * 2 : LLB_NAT_XR_GC_MIN;
+    g = realloc(xh->nat_xgc, max * sizeof(*g));
+    if (!g) {
+      /* Better to leak the range than to hand it out too early */
+      log_error("nat: no memory to free range %u/%u", base, sz);
+      return;
+    }
+    xh->nat_xgc = g;
+    xh->nat_xgc_max = max;
+  }
+
+  g = &xh->nat_xgc[xh->nat_xgc_n++];
+  g->bm = bm;
+  g->base = base;
+  g->sz = sz;
+  g->ts = get_os_nsecs();
+  g->drain = drain;
+}
+
+/*
+ * llb_nat_xr_alloc_busy - llb_nat_xr_alloc() which flags nat_xr_busy if
+ * there is no room only until deferred ranges are past the grace period
+ */
+static int
+llb_nat_xr_alloc_busy(uint64_t *bm, uint32_t nbits, uint32_t sz)
+{
+  int ret;
+
+  ret = llb_nat_xr_alloc(bm, nbits, sz);
+  if (ret < 0 && llb_nat_xr_grace_left()) {
+    xh->nat_xr_busy = 1;
+  }
+
+  return ret;
+}
+
+/*
+ * llb_nat_xr_install - Install NAT rule nv with key k. The arms are written
+ * to a new nat_xfrm_map range before nat_map points to it, so lookups never
+ * see a half updated rule. The old range is freed after a grace period.
+ * The stats ids of the rule are kept as long as they fit. Otherwise the
+ * old ids are drained, as sessions of the rule keep counting under the ids
+ * in their CT entries. Needs NAT map lock held and never sleeps, see
+ * llb_add_map_elem_nat__() for running out of room.
+ */
+static int
+llb_nat_xr_install(struct dp_nat_key *k, struct dp_proxy_tacts *nv)
+{
+  struct dp_nat_tacts kv;
+  struct dp_nat_xfrm x;
+  uint16_t aids[LLB_MAX_NXFRMS];
+  uint64_t act[LLB_MAX_NXFRMS/64];
+  llb_nat_xr_t *xr, *nxr = NULL;
+  uint32_t rid = nv->ca.cidx;
+  uint32_t nx = nv->nxfrm < LLB_MAX_NXFRMS ? nv->nxfrm : LLB_MAX_NXFRMS;
+  uint32_t cap, scap, xbase, sbase, idx;
+  uint32_t n = 0;
+  uint32_t i;
+  int newsr = 0;
+  int fd;
+  int ret;
+
+  if (rid >= LLB_NAT_EP_MAP_ENTRIES) {
+    return -EINVAL;
+  }
+
+  HASH_FIND(hh, xh->nat_xr, &rid, sizeof(rid), xr);
+  if (!xr) {
+    nxr = calloc(1, sizeof(*nxr));
+    if (!nxr) return -ENOMEM;
+  }
+
+  for (cap = 4; cap < nx; cap <<= 1);
+
+  llb_nat_xr_reap();
+
+  ret = llb_nat_xr_alloc_busy(xh->nat_xbm, LLB_NAT_XFRM_MAP_ENTRIES, cap);
+  if (ret < 0) {
+    log_error("nat: rule %u no room for %u arms", rid, nx);
+    free(nxr);
+    return -ENOMEM;
+  }
+  xbase = ret;
+
+  if (xr && xr->scap && nx <= xr->scap) {
+    sbase = xr->sbase;
+    scap = xr->scap;
+  } else {
+    ret = llb_nat_xr_alloc_busy(xh->nat_sbm, LLB_NATV4_STAT_MAP_ENTRIES, cap);
+    if (ret < 0) {
+      /* Rule works without stats and LC_P2C falls back to hash */
+      log_warn("nat: rule %u out of stats ids", rid);
+      sbase = LLB_NATV4_STAT_MAP_ENTRIES;
+      scap = 0;
+    } else {
+      sbase = ret;
+      scap = cap;
+    }
+    newsr = 1;
+  }
+
+  memset(act, 0, sizeof(act));
+  for (i = 0; i < nx; i++) {
+    if (nv->nxfrms[i].inactive) continue;
+    act[i/64] |= 1ULL << (i%64);
+    aids[n++] = i;
+  }
+
+  fd = llb_map2fd(LL_DP_NAT_XFRM_MAP);
+  for (i = 0; i < nx; i++) {
+    memset(&x, 0, sizeof(x));
+    memcpy(&x.xi, &nv->nxfrms[i], sizeof(x.xi));
+    x.act_aid = i < n ? aids[i] : 0;
+    idx = xbase + i;
+    if (bpf_map_update_elem(fd, &idx, &x, 0) != 0) {
+      log_error("nat: rule %u arm %u update failed", rid, i);
+      ret = -EFAULT;
+      goto err;
+    }
+  }
+
+  memset(&kv, 0, sizeof(kv));
+  memcpy(&kv.ca, &nv->ca, sizeof(kv.ca));
+  kv.ito = nv->ito;
+  kv.pto = nv->pto;
+  kv.nxfrm = nx;
+  kv.nactive = n;
+  kv.lc_amask = act[0] & ((1ULL << (LLB_NAT_LC_EPS/2)) - 1);
+  kv.xbase = xbase;
+  kv.sbase = sbase;
+  kv.sel_hint = nv->sel_hint;
+  kv.sel_type = nv->sel_type;
+  kv.opflags = nv->opflags;
+  kv.cdis = nv->cdis;
+  kv.npmhh = nv->npmhh;
+  kv.ppv2 = nv->ppv2;
+  kv.lts = nv->lts;
+  kv.base_to = nv->base_to;
+  memcpy(kv.pmhh, nv->pmhh, sizeof(kv.pmhh));
+
+  for (i = 0; i < nx && scap; i++) {
+    llb_clear_map_stats_internal(LL_DP_NAT_MAP, sbase + i, false);
+  }
+
+  if (nv->sel_type == NAT_LB_SEL_LC_P2C &&
+      (newsr || xr->sel_type != NAT_LB_SEL_LC_P2C)) {
+    llb_nat_lcp_reset(sbase, scap);
+  }
+
+  if (bpf_map_update_elem(llb_map2fd(LL_DP_NAT_MAP), k, &kv, 0) != 0) {
+    ret = -EFAULT;
+    goto err;
+  }
+
+  if (xr) {
+    llb_nat_xr_defer_free(xh->nat_xbm, xr->xbase, xr->xcap, 0);
+    if (newsr && xr->scap) {
+      log_info("nat: rule %u stats ids moved, draining %u/%u", rid,
+               xr->sbase, xr->scap);
+      llb_nat_xr_defer_free(xh->nat_sbm, xr->sbase, xr->scap, 1);
+    }
+  } else {
+    xr = nxr;
+    xr->rid = rid;
+    HASH_ADD(hh, xh->nat_xr, rid, sizeof(xr->rid), xr);
+  }
+
+  xr->xbase = xbase;
+  xr->xcap = cap;
+  xr->sbase = sbase;
+  xr->scap = scap;
+  xr->nxfrm = nx;
+  xr->sel_type = nv->sel_type;
+  memcpy(xr->act, act, sizeof(act));
+
+  pthread_mutex_lock(&xh->nat_sr_lock);
+  xh->nat_sr[rid].sbase = sbase;
+  xh->nat_sr[rid].n = scap ? nx : 0;
+  pthread_mutex_unlock(&xh->nat_sr_lock);
+
+  return 0;
+
+err:
+  llb_nat_xr_free(xh->nat_xbm, xbase, cap);
+  if (newsr && scap) {
+    llb_nat_xr_free(xh->nat_sbm, sbase, scap);
+  }
+  free(nxr);
+  return ret;
+}
+
+/*
+ * llb_nat_xr_release - Give back the ranges of NAT rule xr after a grace
+ * period, its stats ids once they are drained. Needs NAT map lock held.
+ */
+static void
+llb_nat_xr_release(llb_nat_xr_t *xr)
+{
+  pthread_mutex_lock(&xh->nat_sr_lock);
+  memset(&xh->nat_sr[xr->rid], 0, sizeof(xh->nat_sr[xr->rid]));
+  pthread_mutex_unlock(&xh->nat_sr_lock);
+
+  llb_nat_xr_defer_free(xh->nat_xbm, xr->xbase, xr->xcap, 0);
+  if (xr->scap) {
+    llb_nat_xr_defer_free(xh->nat_sbm, xr->sbase, xr->scap, 1);
+  }
+
+  HASH_DEL(xh->nat_xr, xr);
+  free(xr);
+}
+
+static void
+llb_dp_pdik2_ufw4(struct pdi_rule *new, struct pdi_key *k) 
+{
+  memset(k, 0, sizeof(struct pdi_key));
+
+  PDI_MATCH_COPY(&k->dest, &new->key.k4.dest);
+  PDI_MATCH_COPY(&k->source, &new->key.k4.source);
+  PDI_RMATCH_COPY(&k->sport, &new->key.k4.sport);
+  PDI_RMATCH_COPY(&k->dport, &new->key.k4.dport);
+  PDI_MATCH_COPY(&k->inport, &new->key.k4.inport);
+  PDI_MATCH_COPY(&k->protocol, &new->key.k4.protocol);
+  PDI_MATCH_COPY(&k->zone, &new->key.k4.zone);
+}
+
+static void
+llb_dp_ufw42_pdik(struct pdi_rule *new, struct pdi_key *k)
+{
+  PDI_MATCH_COPY(&new->key.k4.dest, &k->dest);
+  PDI_MATCH_COPY(&new->key.k4.source, &k->source);
+  PDI_RMATCH_COPY(&new->key.k4.sport, &k->sport);
+  PDI_RMATCH_COPY(&new->key.k4.dport, &k->dport);
+  PDI_MATCH_COPY(&new->key.k4.inport, &k->inport);
+  PDI_MATCH_COPY(&new->key.k4.protocol, &k->protocol);
+  PDI_MATCH_COPY(&new->key.k4.zone, &k->zone);
+}
+
+static void
+llb_dp_pdik2_ufw6(struct pdi_rule *new, struct pdi6_key *k) 
+{
+  memset(k, 0, sizeof(struct pdi6_key));
+
+  PDI_MATCH6_COPY(&k->dest, &new->key.k6.dest);
+  PDI_MATCH6_COPY(&k->source, &new->key.k6.source);
+  PDI_RMATCH_COPY(&k->sport, &new->key.k6.sport);
+  PDI_RMATCH_COPY(&k->dport, &new->key.k6.dport);
+  PDI_MATCH_COPY(&k->inport, &new->key.k6.inport);
+  PDI_MATCH_COPY(&k->protocol, &new->key.k6.protocol);
+  PDI_MATCH_COPY(&k->zone, &new->key.k6.zone);
+}
+
+static void
+llb_dp_ufw62_pdik(struct pdi_rule *new, struct pdi6_key *k)
+{
+  PDI_MATCH6_COPY(&new->key.k6.dest, &k->dest);
+  PDI_MATCH6_COPY(&new->key.k6.source, &k->source);
+  PDI_RMATCH_COPY(&new->key.k6.sport, &k->sport);
+  PDI_RMATCH_COPY(&new->key.k6.dport, &k->dport);
+  PDI_MATCH_COPY(&new->key.k6.inport, &k->inport);
+  PDI_MATCH_COPY(&new->key.k6.protocol, &k->protocol);
+  PDI_MATCH_COPY(&new->key.k6.zone, &k->zone);
+}
+
+static void
+llb_dp_pdiop2_ufwa(struct pdi_rule *new, struct dp_fw_tact *fwa) 
+{
+  memset(fwa, 0, sizeof(*fwa));
+  fwa->ca.cidx = new->data.rid;
+  fwa->ca.mark = new->data.opts.mark;
+  fwa->ca.record = new->data.opts.record;
+
+  switch (new->data.op) {
+  case PDI_SET_DROP:
+    fwa->ca.act_type = DP_SET_DROP;
+    break;
+  case PDI_SET_TRAP:
+    fwa->ca.act_type = DP_SET_TOCP;
+    break;
+  case PDI_SET_RDR:
+    fwa->ca.act_type = DP_SET_RDR_PORT;
+    fwa->port_act.oport = new->data.opts.port;
+    break;
+  case PDI_SET_FWD:
+    fwa->ca.act_type = DP_SET_NOP;
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+llb_dp_ufw2pdiop(struct pdi_rule *new, struct dp_fw_tact *fwa)
+{
+  new->data.rid = fwa->ca.cidx;
+  new->data.pref = fwa->ca.oaux; // Overloaded field
+  new->data.opts.mark = fwa->ca.mark;
+  new->data.opts.record = fwa->ca.record;
+
+  switch (fwa->ca.act_type) {
+  case DP_SET_DROP:
+    new->data.op = PDI_SET_DROP;
+    break;
+  case DP_SET_TOCP:
+    new->data.op = PDI_SET_TRAP;
+    break;
+  case DP_SET_RDR_PORT:
+    new->data.op = PDI_SET_RDR;
+    new->data.opts.port = fwa->port_act.oport;
+    break;
+  case DP_SET_NOP:
+    new->data.op = PDI_SET_FWD;
+  default:
+    break; 
+  }
+}
+
+static void ll_map_ct_rm_fw_related(pdi_key_t *fk, int v6);
+
+/*
+ * Tuple space search (TSS) tables for the v4 firewall. Every distinct
+ * wildcard pattern in the rule list becomes a mask group and each rule is
+ * stored in fw4_tss_map under its group id (mid). Groups are laid out in
+ * the order of their best rule so that the datapath can stop early. The
+ * linear table is always kept as well and used when rules can't be
+ * expressed as masks (port ranges) or there are too many groups.
+ */
+#define LLB_TSS_FVAL(f) ((f)->valid ? (f)->val : 0)
+#define LLB_TSS_RVAL(f) ((f)->u.v.valid ? (f)->u.v.val : 0)
+
+static int
+ll_fw4_tss_ent_in_bank(int tid, void *k, void *ita)
+{
+  dp_map_ita_t *it = ita;
+  struct dp_fw4_tss_key *key = k;
+  uint32_t bank = *(uint32_t *)it->uarg;
+
+  return key->mid / LLB_FW4_TSS_MASKS == bank;
+}
+
+static int
+ll_fw4_xm_ent_in_bank(int tid, void *k, void *ita)
+{
+  dp_map_ita_t *it = ita;
+  struct dp_fw4_xm_key *key = k;
+  uint32_t bank = *(uint32_t *)it->uarg;
+
+  return key->bank == bank;
+}
+
+/*
+ * llb_fw4_is_exact - Rule matches a single 5-tuple in a zone and can live
+ * in the exact match table
+ */
+static int
+llb_fw4_is_exact(struct pdi_key *k)
+{
+  return k->dest.valid == 0xffffffff &&
+         k->source.valid == 0xffffffff &&
+         !k->dport.has_range && k->dport.u.v.valid == 0xffff &&
+         !k->sport.has_range && k->sport.u.v.valid == 0xffff &&
+         k->protocol.valid == 0xff &&
+         k->zone.valid == 0xffff && k->zone.val != 0 &&
+         k->inport.valid == 0 && k->bd.valid == 0;
+}
+
+/*
+ * llb_fw4_tss_build - Split n linear entries into TSS mask groups of bank.
+ * Returns number of groups or -1 if the rule set needs the linear engine.
+ */
+static int
+llb_fw4_tss_build(struct dp_fwv4_ent *fwe, uint32_t n, uint32_t bank,
+                  struct dp_fw4_tss_mask *masks, struct dp_fw4_tss_key *keys,
+                  struct dp_fw4_tss_ent *vals, uint32_t *nkeys)
+{
+  struct dp_fw4_tss_mask m;
+  struct dp_fw4_tss_key *tk;
+  struct pdi_key *k;
+  uint32_t nm = 0;
+  uint32_t i, j;
+
+  *nkeys = 0;
+  for (i = 0; i < n; i++) {
+    k = &fwe[i].k;
+
+    /* Datapath never matches these */
+    if (k->zone.val == 0) continue;
+
+    if (k->dport.has_range || k->sport.has_range) {
+      return -1;
+    }
+
+    memset(&m, 0, sizeof(m));
+    m.m.dest = k->dest.valid;
+    m.m.source = k->source.valid;
+    m.m.dport = k->dport.u.v.valid;
+    m.m.sport = k->sport.u.v.valid;
+    m.m.inport = k->inport.valid;
+    m.m.zone = k->zone.valid;
+    m.m.bd = k->bd.valid;
+    m.m.protocol = k->protocol.valid;
+
+    for (j = 0; j < nm; j++) {
+      if (memcmp(&masks[j].m, &m.m, sizeof(m.m)) == 0) break;
+    }
+    if (j == nm) {
+      if (nm >= LLB_FW4_TSS_MASKS) {
+        return -1;
+      }
+      m.order = i;
+      m.valid = 1;
+      memcpy(&masks[nm++], &m, sizeof(m));
+    }
+
+    /* Values are taken as is, so a rule with bits outside its mask
+     * never matches, same as in the linear table
+     */
+    tk = &keys[*nkeys];
+    memset(tk, 0, sizeof(*tk));
+    tk->mid = bank*LLB_FW4_TSS_MASKS + j;
+    tk->dest = LLB_TSS_FVAL(&k->dest);
+    tk->source = LLB_TSS_FVAL(&k->source);
+    tk->dport = LLB_TSS_RVAL(&k->dport);
+    tk->sport = LLB_TSS_RVAL(&k->sport);
+    tk->inport = LLB_TSS_FVAL(&k->inport);
+    tk->zone = LLB_TSS_FVAL(&k->zone);
+    tk->bd = LLB_TSS_FVAL(&k->bd);
+    tk->protocol = LLB_TSS_FVAL(&k->protocol);
+
+    memset(&vals[*nkeys], 0, sizeof(vals[*nkeys]));
+    vals[*nkeys].order = i;
+    memcpy(&vals[*nkeys].fwa, &fwe[i].fwa, sizeof(fwe[i].fwa));
+    (*nkeys)++;
+  }
+
+  return nm;
+}
+
+/*
+ * llb_fw_bank_hash_replace - Replace entries of (standby) bank in one of
+ * the banked firewall hash maps (TSS or exact match) with n new ones.
+ * Entries sharing a key are inserted last to first so that the one with
+ * the best priority stays. Must be called only after the grace period of
+ * the bank has passed. On success the new keys are owned by bh.
+ */
+static int
+llb_fw_bank_hash_replace(int tid, uint32_t bank, llb_fw_bank_hash_t *bh,
+                         dp_map_walker_t in_bank, uint8_t *keys,
+                         uint8_t *vals, uint32_t n, size_t ksz, size_t vsz)
+{
+  LIBBPF_OPTS(bpf_map_batch_opts, opts);
+  int fd = llb_map2fd(tid);
+  uint8_t tmp[256];
+  uint32_t i, cnt;
+
+  /* Entries left in this bank by an earlier run are not known to us */
+  if (!bh->synced) {
+    dp_map_ita_t it;
+    uint8_t skey[1024];
+    uint8_t sval[1024];
+
+    memset(&it, 0, sizeof(it));
+    it.next_key = &skey;
+    it.key_sz = ksz;
+    it.val = &sval;
+    it.uarg = &bank;
+    llb_map_loop_and_delete(tid, in_bank, &it);
+    bh->synced = 1;
+  }
+
+  cnt = bh->n;
+  if (cnt && bpf_map_delete_batch(fd, bh->keys, &cnt, &opts) != 0) {
+    for (i = 0; i < bh->n; i++) {
+      bpf_map_delete_elem(fd, bh->keys + i*ksz);
+    }
+  }
+  if (bh->keys) free(bh->keys);
+  bh->keys = NULL;
+  bh->n = 0;
+
+  for (i = 0; i < n/2; i++) {
+    memcpy(tmp, keys + i*ksz, ksz);
+    memcpy(keys + i*ksz, keys + (n-1-i)*ksz, ksz);
+    memcpy(keys + (n-1-i)*ksz, tmp, ksz);
+    memcpy(tmp, vals + i*vsz, vsz);
+    memcpy(vals + i*vsz, vals + (n-1-i)*vsz, vsz);
+    memcpy(vals + (n-1-i)*vsz, tmp, vsz);
+  }
+
+  cnt = n;
+  if (n && bpf_map_update_batch(fd, keys, vals, &cnt, &opts) != 0) {
+    for (i = 0; i < n; i++) {
+      if (bpf_map_update_elem(fd, keys + i*ksz, vals + i*vsz, 0) != 0) {
+        log_error("fw-bank: %s ent %u add failed", xh->maps[tid].map_name, i);
+        /* Whatever got in is wiped next time this bank is used */
+        bh->keys = keys;
+        bh->n = n;
+        return -EFAULT;
+      }
+    }
+  }
+
+  bh->keys = keys;
+  bh->n = n;
+  return 0;
+}
+
+/*
+ * llb_fw4_tss_masks_commit - Replace the TSS mask groups of (standby) bank.
+ */
+static int
+llb_fw4_tss_masks_commit(uint32_t bank, struct dp_fw4_tss_mask *masks)
+{
+  LIBBPF_OPTS(bpf_map_batch_opts, opts);
+  int mfd = llb_map2fd(LL_DP_FW4_TSS_MASK_MAP);
+  uint32_t mkeys[LLB_FW4_TSS_MASKS];
+  uint32_t i, n;
+
+  for (i = 0; i < LLB_FW4_TSS_MASKS; i++) {
+    mkeys[i] = bank*LLB_FW4_TSS_MASKS + i;
+  }
+  n = LLB_FW4_TSS_MASKS;
+  if (bpf_map_update_batch(mfd, mkeys, masks, &n, &opts) != 0) {
+    for (i = 0; i < LLB_FW4_TSS_MASKS; i++) {
+      if (bpf_map_update_elem(mfd, &mkeys[i], &masks[i], 0) != 0) {
+        return -EFAULT;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * llb_fw_commit - Rebuild the firewall table of tbl from its pdi rule list
+ * into the standby bank of the map and then make it active by flipping
+ * the bank index in fw_gen_map with a single update. The datapath latches
+ * the bank once per packet, so it sees either the old or the new table but
+ * never a mix of both. With the TSS engine, v4 TSS tables of the bank are
+ * rebuilt too and the flip also tells the datapath which engine to use.
+ * Fully specified v4 rules go to the exact match table instead, tagged with
+ * the number of wildcard rules ahead of them to keep rule priority.
+ */
+static int
+llb_fw_commit(int tbl)
+{
+  LIBBPF_OPTS(bpf_map_batch_opts, opts);
+  struct pdi_map *pm;
+  struct pdi_rule *r;
+  struct dp_fw4_tss_mask *masks = NULL;
+  struct dp_fw4_tss_key *tkeys = NULL;
+  struct dp_fw4_tss_ent *tvals = NULL;
+  struct dp_fw4_xm_key *xkeys = NULL;
+  struct dp_fw4_xm_ent *xvals = NULL;
+  uint8_t *vals;
+  uint32_t *keys;
+  uint32_t ents;
+  uint32_t bank;
+  uint32_t gval;
+  uint32_t fam;
+  uint32_t cnt;
+  uint32_t nkeys = 0;
+  uint32_t nx = 0;
+  uint32_t n = 0;
+  uint32_t i;
+  int tss = 0;
+  uint64_t ts;
+  size_t esz;
+  int fd;
+  int ret = 0;
+
+  if (tbl == LL_DP_FW4_MAP) {
+    fam = 0;
+    pm = xh->ufw4;
+    ents = LLB_FW4_MAP_ENTRIES;
+    esz = sizeof(struct dp_fwv4_ent);
+  } else {
+    fam = 1;
+    pm = xh->ufw6;
+    ents = LLB_FW6_MAP_ENTRIES;
+    esz = sizeof(struct dp_fwv6_ent);
+  }
+
+  fd = llb_map2fd(tbl);
+  bank = xh->fw_bank[fam] ^ 1;
+
+  vals = calloc(ents, esz);
+  keys = calloc(ents, sizeof(*keys));
+  if (!vals || !keys) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  if (fam == 0) {
+    xkeys = calloc(ents, sizeof(*xkeys));
+    xvals = calloc(ents, sizeof(*xvals));
+    if (!xkeys || !xvals) {
+      ret = -ENOMEM;
+      goto out;
+    }
+  }
+
+  PDI_MAP_LOCK(pm);
+  FOR_EACH_PDI_ENT(pm, r) {
+    if (n >= ents || nx >= ents) break;
+    if (fam == 0) {
+      struct dp_fwv4_ent *p = (struct dp_fwv4_ent *)(vals + n*esz);
+      llb_dp_pdik2_ufw4(r, &p->k);
+      llb_dp_pdiop2_ufwa(r, &p->fwa);
+      if (llb_fw4_is_exact(&p->k)) {
+        struct dp_fw4_xm_key *xk = &xkeys[nx];
+        xk->dest = p->k.dest.val;
+        xk->source = p->k.source.val;
+        xk->dport = p->k.dport.u.v.val;
+        xk->sport = p->k.sport.u.v.val;
+        xk->zone = p->k.zone.val;
+        xk->protocol = p->k.protocol.val;
+        xk->bank = bank;
+        xvals[nx].nwc = n;
+        memcpy(&xvals[nx].fwa, &p->fwa, sizeof(p->fwa));
+        memset(p, 0, sizeof(*p));
+        nx++;
+        continue;
+      }
+    } else {
+      struct dp_fwv6_ent *p6 = (struct dp_fwv6_ent *)(vals + n*esz);
+      llb_dp_pdik2_ufw6(r, &p6->k);
+      llb_dp_pdiop2_ufwa(r, &p6->fwa);
+      if (n == 0) {
+        PDI_VAL_INIT(&p6->k.nr, pm->nr);
+      }
+    }
+    n++;
+  }
+  PDI_MAP_ULOCK(pm);
+
+  /* Only wildcard rules are left for the linear walk */
+  if (fam == 0) {
+    PDI_VAL_INIT(&((struct dp_fwv4_ent *)vals)->k.nr, n);
+  }
+
+  if (fam == 0 && xh->fw_engine == LLB_FW_ENGINE_TSS) {
+    masks = calloc(LLB_FW4_TSS_MASKS, sizeof(*masks));
+    tkeys = calloc(n ? n : 1, sizeof(*tkeys));
+    tvals = calloc(n ? n : 1, sizeof(*tvals));
+    if (!masks || !tkeys || !tvals) {
+      ret = -ENOMEM;
+      goto out;
+    }
+    if (llb_fw4_tss_build((struct dp_fwv4_ent *)vals, n, bank, masks,
+                          tkeys, tvals, &nkeys) >= 0) {
+      tss = 1;
+    } else {
+      log_debug("fw4: rules need linear lookup");
+      memset(masks, 0, LLB_FW4_TSS_MASKS * sizeof(*masks));
+      nkeys = 0;
+    }
+  }
+
+  /* Stale entries from last use of this bank are wiped as well */
+  cnt = n > xh->fw_bank_n[fam][bank] ? n : xh->fw_bank_n[fam][bank];
+  if (cnt == 0) cnt = 1;
+  for (i = 0; i < cnt; i++) {
+    keys[i] = bank*ents + i;
+  }
+
+  /* Packets which latched this bank before the last flip must be done */
+  ts = get_os_nsecs();
+  if (ts - xh->fw_flip_ts[fam] < LLB_FW_FLIP_GRACE_NS) {
+    usleep((LLB_FW_FLIP_GRACE_NS - (ts - xh->fw_flip_ts[fam]))/1000);
+  }
+
+  n = cnt;
+  if (bpf_map_update_batch(fd, keys, vals, &n, &opts) != 0) {
+    for (i = 0; i < cnt; i++) {
+      if (bpf_map_update_elem(fd, &keys[i], vals + i*esz, 0) != 0) {
+        ret = -EFAULT;
+        goto out;
+      }
+    }
+  }
+  xh->fw_bank_n[fam][bank] = cnt;
+
+  if (fam == 0 && (tss || xh->fw_tss[bank].n)) {
+    if (!masks) {
+      masks = calloc(LLB_FW4_TSS_MASKS, sizeof(*masks));
+      if (!masks) {
+        ret = -ENOMEM;
+        goto out;
+      }
+    }
+    ret = llb_fw_bank_hash_replace(LL_DP_FW4_TSS_MAP, bank, &xh->fw_tss[bank],
+                                   ll_fw4_tss_ent_in_bank, (uint8_t *)tkeys,
+                                   (uint8_t *)tvals, nkeys, sizeof(*tkeys),
+                                   sizeof(*tvals));
+    tkeys = NULL;
+    if (ret != 0 || llb_fw4_tss_masks_commit(bank, masks) != 0) {
+      ret = -EFAULT;
+      goto out;
+    }
+  }
+
+  if (fam == 0 && (nx || xh->fw_xm[bank].n)) {
+    ret = llb_fw_bank_hash_replace(LL_DP_FW4_XM_MAP, bank, &xh->fw_xm[bank],
+                                   ll_fw4_xm_ent_in_bank, (uint8_t *)xkeys,
+                                   (uint8_t *)xvals, nx, sizeof(*xkeys),
+                                   sizeof(*xvals));
+    xkeys = NULL;
+    if (ret != 0) {
+      goto out;
+    }
+  }
+
+  gval = bank | (tss ? LLB_FW_GEN_TSS : 0) | (nx ? LLB_FW_GEN_XM : 0);
+  if (bpf_map_update_elem(llb_map2fd(LL_DP_FW_GEN_MAP), &fam, &gval, 0) != 0) {
+    ret = -EFAULT;
+    goto out;
+  }
+  xh->fw_bank[fam] = bank;
+  xh->fw_flip_ts[fam] = get_os_nsecs();
+
+out:
+  if (vals) free(vals);
+  if (keys) free(keys);
+  if (masks) free(masks);
+  if (tkeys) free(tkeys);
+  if (tvals) free(tvals);
+  if (xkeys) free(xkeys);
+  if (xvals) free(xvals);
+  return ret;
+}
+
+/*
+ * llb_mf_rule_add__ - Add firewall rule k to the pdi rule list of tbl.
+ * Returns 1 if the rule list changed, 0 if the rule already exists or
+ * -1 on error. fk is set to the rule key.
+ */
+static int
+llb_mf_rule_add__(int tbl, void *k, pdi_key_t *fk)
+{
+  int ret = 0;
+  int nr = 0;
+
+  memset(fk, 0, sizeof(*fk));
+
+  if (tbl == LL_DP_FW4_MAP) {
+    struct dp_fwv4_ent *e = k;
+    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
+    
+    if (!new) return -1;
+
+    llb_dp_ufw42_pdik(new, &e->k);
+    memcpy(fk, &new->key, sizeof(*fk));
+    llb_dp_ufw2pdiop(new, &e->fwa);
+
+    ret = pdi_rule_insert(xh->ufw4, new, &nr);
+    if (ret != 0) {
+      free(new);
+      if (ret == -EEXIST) {
+        return 0;
+      }
+      return -1;
+    }
+    return 1;
+
+  } else if (tbl == LL_DP_FW6_MAP) {
+    struct dp_fwv6_ent *e6 = k;
+    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
+
+    if (!new) return -1;
+
+    llb_dp_ufw62_pdik(new, &e6->k);
+    memcpy(fk, &new->key, sizeof(*fk));
+    llb_dp_ufw2pdiop(new, &e6->fwa);
+
+    ret = pdi_rule_insert(xh->ufw6, new, &nr);
+    if (ret != 0) {
+      free(new); 
+      if (ret == -EEXIST) {
+        return 0;
+      }
+      return -1;
+    }
+    return 1;
+  }
+
+  return -1;
+}
+
+int
+llb_add_mf_map_elem__(int tbl, void *k, void *v)
+{
+  pdi_key_t fk;
+  int ret;
+
+  ret = llb_mf_rule_add__(tbl, k, &fk);
+  if (ret <= 0) return ret;
+
+  ret = llb_fw_commit(tbl);
+  if (ret == 0) ll_map_ct_rm_fw_related(&fk, tbl == LL_DP_FW6_MAP);
+  return ret;
+}
+
+static int
+llb_conv_nat2proxy(void *k, void *v, struct proxy_ent *pent, struct proxy_arg *pval)
+{
+  struct dp_nat_key *nat_key = k;
+  struct dp_proxy_tacts *dat = v;
+  int i = 0;
+  int j = 0;
+
+  pent->xip = nat_key->daddr[0];
+  pent->xport = nat_key->dport;
+  pent->protocol = nat_key->l4proto;
+
+  strncpy(pval->host_url, (const char *)dat->host_url, sizeof(pval->host_url) - 1);
+  pval->host_url[sizeof(pval->host_url) - 1] = '\0';
+
+  if (!strcmp(pval->host_url, "")) {
+    char ab1[INET6_ADDRSTRLEN];
+    const char *host = inet_ntop(AF_INET, (struct in_addr *)&pent->xip, ab1, INET_ADDRSTRLEN);
+    if (host != NULL) {
+      sprintf(pval->host_url, "%s:%u", host, ntohs(pent->xport));
+    }
+  }
+
+  for (i = 0; i < dat->nxfrm && i < LLB_MAX_NXFRMS && j < MAX_PROXY_EP; i++) {
+    struct mf_xfrm_inf *mf = &dat->nxfrms[i];
+    struct proxy_ent *proxy_ep = &pval->eps[j];
+
+    if (mf->inactive) continue;
+
+    proxy_ep->xip = mf->nat_xip[0];
+    proxy_ep->xport = mf->nat_xport;
+    proxy_ep->protocol = nat_key->l4proto;
+
+    j++;
+  }
+
+  if (j <= 0) {
+    return -1;
+  }
+
+  if (dat->sel_type == NAT_LB_SEL_N2) {
+    pval->proxy_mode = PROXY_MODE_ALL;
+    pval->select =  PROXY_SEL_N2;
+  }
+
+  if (dat->sec_mode == SEC_MODE_HTTPS) {
+    pval->have_ssl = 1;
+  } else if (dat->sec_mode == SEC_MODE_HTTPS_E2E) {
+    pval->have_ssl = 1;
+    pval->have_epssl = 1;
+  }
+
+  pval->_id = dat->ca.cidx;
+  pval->n_eps = j;
+  return 0;
+}
+
+/*
+ * llb_add_map_elem_pre__ - Any table which has stats pb needs to get stats
+ * cleared before use
+ */
+static void
+llb_add_map_elem_pre__(int tbl, void *k, void *v)
+{
+  if (tbl == LL_DP_NAT_MAP ||
+      tbl == LL_DP_TMAC_MAP ||
+      tbl == LL_DP_FW4_MAP  ||
+      tbl == LL_DP_FW6_MAP  ||
+      tbl == LL_DP_RTV4_MAP) {
+    __u32 cidx = 0;
+
+    if (tbl == LL_DP_FW4_MAP) {
+      struct dp_fwv4_ent *e = k;
+      cidx = e->fwa.ca.cidx;
+    } else if (tbl == LL_DP_FW6_MAP) {
+      struct dp_fwv6_ent *e = k;
+      cidx = e->fwa.ca.cidx;
+    } else {
+      struct dp_cmn_act *ca = v;
+      cidx = ca->cidx;
+    }
+
+    if (tbl == LL_DP_NAT_MAP) {
+      /* Arm stats are cleared by llb_nat_xr_install() */
+      llb_nat_rst_act_sessions(cidx);
+    } else {
+      llb_clear_map_stats(tbl, cidx);
+    }
+  }
+}
+
+static int
+llb_add_map_elem__(int tbl, void *k, void *v)
+{
+  int ret = -EINVAL;
+
+  llb_add_map_elem_pre__(tbl, k, v);
+
+  if (tbl == LL_DP_NAT_MAP) {
+    struct dp_nat_key *nk = k;
+    struct dp_proxy_tacts *nv = v;
+    struct proxy_ent pk = { 0 };
+    struct proxy_arg pv = { 0 };
+
+    if (nv->ca.act_type == DP_SET_FULLPROXY &&
+        (nk->l4proto == IPPROTO_TCP || nk->l4proto == IPPROTO_SCTP) && nk->v6 == 0) {
+      llb_conv_nat2proxy(k, v, &pk, &pv);
+      // FIXME
+      ret = proxy_add_entry(&pk, &pv);
+      goto out;
+    }
+  }
+
+  if (xh->have_noebpf) {
+    return 0;
+  }
+
+  /* Selection state has to be in place before the rule starts using it */
+  if (tbl == LL_DP_NAT_MAP) {
+    struct dp_proxy_tacts *nv = v;
+
+    ret = llb_maglev_update(nv);
+    if (ret == 0) {
+      ret = llb_wsel_update(nv);
+    }
+    if (ret != 0) {
+      return ret;
+    }
+    ret = llb_nat_xr_install(k, nv);
+  } else if (tbl == LL_DP_FW4_MAP || tbl == LL_DP_FW6_MAP) {
+    ret = llb_add_mf_map_elem__(tbl, k, v);
+  } else {
+    ret = bpf_map_update_elem(llb_map2fd(tbl), k, v, 0);
+  }
+out:
+  if (ret != 0) {
+    ret = -EFAULT;
+  } else {
+    /* Need some post-processing for certain maps */
+    if (tbl == LL_DP_NAT_MAP) {
+      llb_add_map_elem_nat_post_proc(k, v);
+    }
+  }
+
+  return ret;
+}
+
+/*
+ * llb_add_map_elem_nat__ - llb_add_map_elem__() for the NAT map. If the
+ * rule found no room only because of ranges still in their grace period,
+ * that is slept out with the NAT map lock given up and the add retried.
+ * Called with the NAT map lock held.
+ */
+static int
+llb_add_map_elem_nat__(void *k, void *v)
+{
+  uint64_t left;
+  int ret;
+
+  xh->nat_xr_busy = 0;
+  ret = llb_add_map_elem__(LL_DP_NAT_MAP, k, v);
+  if (ret == 0 || !xh->nat_xr_busy) {
+    return ret;
+  }
+
+  xh->nat_xr_busy = 0;
+  left = llb_nat_xr_grace_left();
+  llb_map_unlock(LL_DP_NAT_MAP);
+  usleep(left/1000 + 1);
+  llb_map_lock(LL_DP_NAT_MAP);
+
+  return llb_add_map_elem__(LL_DP_NAT_MAP, k, v);
+}
+
+int
+llb_add_map_elem(int tbl, void *k, void *v)
+{
+  int ret = -EINVAL;
+  if (tbl < 0 || tbl >= LL_DP_MAX_MAP) {
+    return ret; 
+  }
+
+  XH_RD_LOCK();
+  llb_map_lock(tbl);
+  if (tbl == LL_DP_NAT_MAP && !xh->have_noebpf) {
+    ret = llb_add_map_elem_nat__(k, v);
+  } else {
+    ret = llb_add_map_elem__(tbl, k, v);
+  }
+  llb_map_unlock(tbl);
+  XH_UNLOCK();
+
+  return ret;
+}
+
+static int
+ll_cidx_cmp(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static int
+ll_map_elem_in_cidx_set(int tid, void *k, void *ita)
+{
+  dp_map_ita_t *it = ita;
+  ll_cidx_set_t *cs;
+  struct dp_cmn_act *ca;
+
+  if (!it|| !it->uarg || !it->val) return 0;
+
+  if (tid != LL_DP_CT_MAP &&
+      tid != LL_DP_TMAC_MAP &&
+      tid != LL_DP_FCV4_MAP &&
+      tid != LL_DP_FCV6_MAP &&
+      tid != LL_DP_RTV4_MAP) {
+    return 0;
+  }
+
+  cs = it->uarg;
+  ca = it->val;
+
+  return bsearch(&ca->cidx, cs->cidx, cs->n, sizeof(uint32_t),
+                 ll_cidx_cmp) != NULL;
+}
+
+/*
+ * llb_del_map_elem_with_cidx_set - Remove all entries of a map whose
+ * common action cidx is in the given set, with a single walk of the map.
+ */
+static void
+llb_del_map_elem_with_cidx_set(int tbl, ll_cidx_set_t *cs)
+{
+  dp_map_ita_t it;
+  uint8_t skey[1024];
+  uint8_t sval[1024];
+
+  if (!cs || cs->n == 0) return;
+
+  qsort(cs->cidx, cs->n, sizeof(uint32_t), ll_cidx_cmp);
+
+  memset(&it, 0, sizeof(it));
+  memset(&skey, 0, sizeof(skey));
+  memset(&sval, 0, sizeof(sval));
+
+  it.next_key = &skey;
+  it.val = &sval;
+  it.uarg = cs;
+
+  llb_map_lock(tbl);
+  llb_map_loop_and_delete(tbl, ll_map_elem_in_cidx_set, &it);
+  llb_map_unlock(tbl);
+}
+
+static void
+ll_cidx_set_add(ll_cidx_set_t *cs, uint32_t cidx)
+{
+  uint32_t *n;
+
+  if (cs->n >= cs->max) {
+    n = realloc(cs->cidx, (cs->max ? cs->max * 2 : 64) * sizeof(uint32_t));
+    if (!n) return;
+    cs->cidx = n;
+    cs->max = cs->max ? cs->max * 2 : 64;
+  }
+  cs->cidx[cs->n++] = cidx;
+}
+
+/*
+ * llb_mf_rule_del__ - Remove firewall rule k from the pdi rule list of
+ * tbl. Returns 1 if the rule list changed or -1 on error. fk is set to
+ * the rule key.
+ */
+static int
+llb_mf_rule_del__(int tbl, void *k, pdi_key_t *fk)
+{
+  int ret = 0;
+  int nr = 0;
+
+  memset(fk, 0, sizeof(*fk));
+
+  if (tbl == LL_DP_FW4_MAP) {
+    struct dp_fwv4_ent *e = k;
+    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
+    
+    if (!new) return -1;
+
+    llb_dp_ufw42_pdik(new, &e->k);
+    memcpy(fk, &new->key, sizeof(*fk));
+    llb_dp_ufw2pdiop(new, &e->fwa) ;
+
+    ret = pdi_rule_delete(xh->ufw4, &new->key, new->data.pref, &nr);
+    if (ret != 0) {
+      free(new);
+      return -1;
+    }
+
+    free(new);
+    return 1;
+  } else if (tbl == LL_DP_FW6_MAP) {
+    struct dp_fwv6_ent *e6 = k;
+    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
+    
+    if (!new) return -1;
+
+    llb_dp_ufw62_pdik(new, &e6->k);
+    memcpy(fk, &new->key, sizeof(*fk));
+    llb_dp_ufw2pdiop(new, &e6->fwa) ;
+
+    ret = pdi_rule_delete(xh->ufw6, &new->key, new->data.pref, &nr);
+    if (ret != 0) {
+      free(new);
+      return -1;
+    }
+
+    free(new);
+    return 1;
+  }
+
+  return -1;
+}
+
+int 
+llb_del_mf_map_elem__(int tbl, void *k)
+{
+  pdi_key_t fk;
+  int ret;
+
+  ret = llb_mf_rule_del__(tbl, k, &fk);
+  if (ret < 0) return ret;
+
+  ret = llb_fw_commit(tbl);
+  if (ret == 0) ll_map_ct_rm_fw_related(&fk, tbl == LL_DP_FW6_MAP);
+
+  return ret;
+}
+
+/*
+ * llb_mf_map_elems__ - Add (or delete) n firewall rules with a single
+ * rebuild of the firewall table. If adds is given, adds[i] tells whether
+ * rule i is to be added or deleted instead of add.
+ */
+static void
+llb_mf_map_elems__(int tbl, uint8_t *keys, uint32_t key_sz, int n,
+                   int *status, int add, uint8_t *adds)
+{
+  pdi_key_t *fks;
+  uint8_t *chg;
+  int nchg = 0;
+  int ret;
+  int i;
+
+  fks = calloc(n, sizeof(*fks));
+  chg = calloc(n, sizeof(*chg));
+  if (!fks || !chg) {
+    for (i = 0; i < n; i++) status[i] = -ENOMEM;
+    goto out;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (adds ? adds[i] : add) {
+      ret = llb_mf_rule_add__(tbl, keys + i*key_sz, &fks[i]);
+    } else {
+      ret = llb_mf_rule_del__(tbl, keys + i*key_sz, &fks[i]);
+    }
+    status[i] = ret < 0 ? -EFAULT : 0;
+    if (ret > 0) {
+      chg[i] = 1;
+      nchg++;
+    }
+  }
+
+  if (nchg == 0) goto out;
+
+  ret = llb_fw_commit(tbl);
+  for (i = 0; i < n; i++) {
+    if (!chg[i]) continue;
+    if (ret != 0) {
+      status[i] = -EFAULT;
+    } else {
+      ll_map_ct_rm_fw_related(&fks[i], tbl == LL_DP_FW6_MAP);
+    }
+  }
+
+out:
+  if (fks) free(fks);
+  if (chg) free(chg);
+}
+
+static int
+llb_del_map_elem_wval__(int tbl, void *k, void *v)
+{
+  int ret = -EINVAL;
+  struct dp_nat_tacts t = { 0 };
+
+  /* Need some pre-processing for certain maps */
+  if (tbl == LL_DP_NAT_MAP) {
+    struct dp_nat_key *nk = k;
+    struct dp_proxy_tacts *nv = v;
+    struct proxy_ent pk = { 0 };
+    struct proxy_arg pa = { 0 };
+
+    assert(nv);
+
+    if (nv->ca.act_type == DP_SET_FULLPROXY &&
+        (nk->l4proto == IPPROTO_TCP || nk->l4proto == IPPROTO_SCTP) && nk->v6 == 0) {
+      llb_conv_nat2proxy(nk, nv, &pk, &pa);
+      proxy_delete_entry(&pk, &pa);
+    }
+
+    if (xh->have_noebpf) {
+      return 0;
+    }
+
+    ret = bpf_map_lookup_elem(llb_map2fd(tbl), k, &t);
+    if (ret != 0) {
+      return -EINVAL;
+    }
+  }
+
+  if (xh->have_noebpf) {
+    return 0;
+  }
+
+  if (tbl == LL_DP_FW4_MAP || tbl == LL_DP_FW6_MAP) {
+    ret = llb_del_mf_map_elem__(tbl, k);
+  } else {
+    ret = bpf_map_delete_elem(llb_map2fd(tbl), k);
+  }
+  if (ret != 0) {
+    ret = -EFAULT;
+  }
+
+  /* Need some post-processing for certain maps */
+  if (tbl == LL_DP_NAT_MAP) {
+    llb_nat_xr_t *xr;
+
+    HASH_FIND(hh, xh->nat_xr, &t.ca.cidx, sizeof(t.ca.cidx), xr);
+    if (xr) {
+      llb_del_map_elem_nat_post_proc(xr);
+      llb_nat_xr_release(xr);
+    }
+    if (t.sel_type == NAT_LB_SEL_MAGLEV) {
+      llb_maglev_del(t.ca.cidx);
+    } else if (NAT_LB_SEL_WEIGHTED(t.sel_type)) {
+      bpf_map_delete_elem(llb_map2fd(LL_DP_NAT_WSEL_MAP), &t.ca.cidx);
+    }
+  }
+
+  return ret;
+}
+
+int
+llb_del_map_elem_wval(int tbl, void *k, void *v)
+{
+  int ret = -EINVAL;
+
+  if (tbl < 0 || tbl >= LL_DP_MAX_MAP) {
+    return ret;
+  }
+
+  XH_RD_LOCK();
+  llb_map_lock(tbl);
+  ret = llb_del_map_elem_wval__(tbl, k, v);
+  llb_map_unlock(tbl);
+  XH_UNLOCK();
+
+  return ret;
+}
+
+/*
+ * llb_map_elems_batch__ - Update (or delete) n elements of a plain map in
+ * batches of batch_sz. Elements the batch op could not take are retried
+ * one by one so that each gets its own status.
+ */
+static void
+llb_map_elems_batch__(int tbl, uint8_t *keys, uint32_t key_sz, uint8_t *vals,
+                      uint32_t val_sz, int n, int *status, int add)
+{
+  LIBBPF_OPTS(bpf_map_batch_opts, opts);
+  llb_dp_map_t *t = &xh->maps[tbl];
+  uint32_t cnt;
+  int i = 0;
+  int ret;
+  int j;
+
+  while (i < n) {
+    cnt = n - i;
+    if (cnt > xh->batch_sz) cnt = xh->batch_sz;
+
+    if (!t->no_batch && cnt > 1) {
+      if (add) {
+        ret = bpf_map_update_batch(t->map_fd, keys + i*key_sz,
+                                   vals + i*val_sz, &cnt, &opts);
+      } else {
+        ret = bpf_map_delete_batch(t->map_fd, keys + i*key_sz, &cnt, &opts);
+      }
+
+      /* Done ones are in, the one which failed the batch goes singly */
+      if (ret == 0 || cnt > 0) {
+        for (j = 0; j < cnt; j++) status[i+j] = 0;
+        i += cnt;
+        continue;
+      }
+
+      if (errno == EINVAL || errno == ENOTSUPP || errno == EOPNOTSUPP) {
+        log_info("TID %d map batch not supported (%d)", tbl, errno);
+        t->no_batch = 1;
+      }
+    }
+
+    if (add) {
+      ret = bpf_map_update_elem(t->map_fd, keys + i*key_sz, vals + i*val_sz, 0);
+    } else {
+      ret = bpf_map_delete_elem(t->map_fd, keys + i*key_sz);
+    }
+    status[i] = ret != 0 ? -EFAULT : 0;
+    i++;
+  }
+}
+
+/*
+ * llb_add_map_elems - Add n elements to tbl taking the lock once. keys and
+ * vals are arrays of key_sz and val_sz sized elements laid out the same
+ * way as for llb_add_map_elem(). status[i] gets the result of element i.
+ * Returns 0 if all elements were added or -EFAULT otherwise.
+ */
+int
+llb_add_map_elems(int tbl, void *keys, uint32_t key_sz, void *vals,
+                  uint32_t val_sz, int n, int *status)
+{
+  uint8_t *k = keys;
+  uint8_t *v = vals;
+  int ret = 0;
+  int i;
+
+  if (tbl < 0 || tbl >= LL_DP_MAX_MAP || !keys || !vals || !status || n <= 0) {
+    return -EINVAL;
+  }
+
+  XH_RD_LOCK();
+  llb_map_lock(tbl);
+
+  if (!xh->have_noebpf && (tbl == LL_DP_FW4_MAP || tbl == LL_DP_FW6_MAP)) {
+    llb_mf_map_elems__(tbl, k, key_sz, n, status, 1, NULL);
+  } else if (tbl == LL_DP_NAT_MAP && !xh->have_noebpf) {
+    for (i = 0; i < n; i++) {
+      status[i] = llb_add_map_elem_nat__(k + i*key_sz, v + i*val_sz);
+    }
+  } else if (xh->have_noebpf) {
+    for (i = 0; i < n; i++) {
+      status[i] = llb_add_map_elem__(tbl, k + i*key_sz, v + i*val_sz);
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      llb_add_map_elem_pre__(tbl, k + i*key_sz, v + i*val_sz);
+    }
+    llb_map_elems_batch__(tbl, k, key_sz, v, val_sz, n, status, 1);
+  }
 
-  t = &xh->maps[LL_DP_NAT_EP_MAP];
+  llb_map_unlock(tbl);
+  XH_UNLOCK();
 
-  if (t != NULL) {
-    memset(&epa, 0, sizeof(epa));
-    if ((bpf_map_lookup_elem_flags(t->map_fd, &rid, &epa, BPF_F_LOCK)) != 0) {
-      if (epa.active_sess[aid] > 0) {
-        epa.active_sess[aid]--;
-        bpf_map_update_elem(t->map_fd, &rid, &epa, BPF_F_LOCK);
-      }
-    }
+  for (i = 0; i < n; i++) {
+    if (status[i] != 0) ret = -EFAULT;
   }
+
+  return ret;
 }
 
-static void
-llb_nat_rst_act_sessions(uint32_t rid)
+/*
+ * llb_del_map_elems - Delete n elements from tbl taking the lock once.
+ * vals is needed only for tables which need it in llb_del_map_elem_wval()
+ * (NAT) and can be NULL otherwise. status[i] gets the result of element i.
+ * Returns 0 if all elements were deleted or -EFAULT otherwise.
+ */
+int
+llb_del_map_elems(int tbl, void *keys, uint32_t key_sz, void *vals,
+                  uint32_t val_sz, int n, int *status)
 {
-  llb_dp_map_t *t;
-  struct dp_nat_epacts epa;
+  uint8_t *k = keys;
+  uint8_t *v = vals;
+  int ret = 0;
   int i;
 
-  t = &xh->maps[LL_DP_NAT_EP_MAP];
+  if (tbl < 0 || tbl >= LL_DP_MAX_MAP || !keys || !status || n <= 0) {
+    return -EINVAL;
+  }
 
-  if (t != NULL) {
-    memset(&epa, 0, sizeof(epa));
-    if ((bpf_map_lookup_elem_flags(t->map_fd, &rid, &epa, BPF_F_LOCK)) != 0) {
-      epa.ca.act_type = 0;
-      for (i = 0; i < LLB_MAX_NXFRMS; i++) {
-        epa.active_sess[i] = 0;
-      }
-      bpf_map_update_elem(t->map_fd, &rid, &epa, BPF_F_LOCK);
+  if (tbl == LL_DP_NAT_MAP && !vals) {
+    return -EINVAL;
+  }
+
+  XH_RD_LOCK();
+  llb_map_lock(tbl);
+
+  if (tbl == LL_DP_NAT_MAP) {
+    /* Goes singly in noebpf mode too so that proxy entries are removed */
+    for (i = 0; i < n; i++) {
+      status[i] = llb_del_map_elem_wval__(tbl, k + i*key_sz, v + i*val_sz);
     }
+  } else if (xh->have_noebpf) {
+    for (i = 0; i < n; i++) status[i] = 0;
+  } else if (tbl == LL_DP_FW4_MAP || tbl == LL_DP_FW6_MAP) {
+    llb_mf_map_elems__(tbl, k, key_sz, n, status, 0, NULL);
+  } else {
+    llb_map_elems_batch__(tbl, k, key_sz, NULL, 0, n, status, 0);
   }
-}
 
-static void
-llb_dp_pdik2_ufw4(struct pdi_rule *new, struct pdi_key *k) 
-{
-  memset(k, 0, sizeof(struct pdi_key));
+  llb_map_unlock(tbl);
+  XH_UNLOCK();
 
-  PDI_MATCH_COPY(&k->dest, &new->key.k4.dest);
-  PDI_MATCH_COPY(&k->source, &new->key.k4.source);
-  PDI_RMATCH_COPY(&k->sport, &new->key.k4.sport);
-  PDI_RMATCH_COPY(&k->dport, &new->key.k4.dport);
-  PDI_MATCH_COPY(&k->inport, &new->key.k4.inport);
-  PDI_MATCH_COPY(&k->protocol, &new->key.k4.protocol);
-  PDI_MATCH_COPY(&k->zone, &new->key.k4.zone);
+  for (i = 0; i < n; i++) {
+    if (status[i] != 0) ret = -EFAULT;
+  }
+
+  return ret;
 }
 
-static void
-llb_dp_ufw42_pdik(struct pdi_rule *new, struct pdi_key *k)
+int
+llb_del_map_elem(int tbl, void *k)
 {
-  PDI_MATCH_COPY(&new->key.k4.dest, &k->dest);
-  PDI_MATCH_COPY(&new->key.k4.source, &k->source);
-  PDI_RMATCH_COPY(&new->key.k4.sport, &k->sport);
-  PDI_RMATCH_COPY(&new->key.k4.dport, &k->dport);
-  PDI_MATCH_COPY(&new->key.k4.inport, &k->inport);
-  PDI_MATCH_COPY(&new->key.k4.protocol, &k->protocol);
-  PDI_MATCH_COPY(&new->key.k4.zone, &k->zone);
+  return llb_del_map_elem_wval(tbl, k, NULL);
 }
 
-static void
-llb_dp_pdik2_ufw6(struct pdi_rule *new, struct pdi6_key *k) 
-{
-  memset(k, 0, sizeof(struct pdi6_key));
+/*
+ * Async map updates - Producers push update ops on a lock-free intrusive
+ * MPSC queue (Vyukov) and a single libdp thread drains it. Ops to the same
+ * (tbl, key) within a drained batch are coalesced into the later one where
+ * that is safe and consecutive ops of the same kind are applied by one bulk
+ * call. Each op
+ * completes via goMapUpdDoneHandler() and a count on an eventfd.
+ */
+#define LLB_MUPD_BATCH  (256)
+#define LLB_MUPD_KV_MAX (4096)
+
+typedef struct llb_mupd {
+  struct llb_mupd *next;
+  int tbl;
+  int add;
+  uint32_t key_sz;
+  uint32_t val_sz;
+  uint64_t cookie;
+  int status;
+  struct llb_mupd *sup;
+  uint8_t data[];
+} llb_mupd_t;
+
+typedef struct llb_mupd_q {
+  llb_mupd_t *head;
+  llb_mupd_t *tail;
+  llb_mupd_t stub;
+  sem_t sem;
+  int efd;
+  pthread_t thr;
+  struct dp_map_upd_stats st;
+} llb_mupd_q_t;
 
-  PDI_MATCH6_COPY(&k->dest, &new->key.k6.dest);
-  PDI_MATCH6_COPY(&k->source, &new->key.k6.source);
-  PDI_RMATCH_COPY(&k->sport, &new->key.k6.sport);
-  PDI_RMATCH_COPY(&k->dport, &new->key.k6.dport);
-  PDI_MATCH_COPY(&k->inport, &new->key.k6.inport);
-  PDI_MATCH_COPY(&k->protocol, &new->key.k6.protocol);
-  PDI_MATCH_COPY(&k->zone, &new->key.k6.zone);
+void __attribute__((weak))
+goMapUpdDoneHandler(uint64_t cookie, int status)
+{
 }
 
 static void
-llb_dp_ufw62_pdik(struct pdi_rule *new, struct pdi6_key *k)
+llb_mupd_push(llb_mupd_q_t *q, llb_mupd_t *m)
 {
-  PDI_MATCH6_COPY(&new->key.k6.dest, &k->dest);
-  PDI_MATCH6_COPY(&new->key.k6.source, &k->source);
-  PDI_RMATCH_COPY(&new->key.k6.sport, &k->sport);
-  PDI_RMATCH_COPY(&new->key.k6.dport, &k->dport);
-  PDI_MATCH_COPY(&new->key.k6.inport, &k->inport);
-  PDI_MATCH_COPY(&new->key.k6.protocol, &k->protocol);
-  PDI_MATCH_COPY(&new->key.k6.zone, &k->zone);
+  llb_mupd_t *prev;
+
+  __atomic_store_n(&m->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n(&q->head, m, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
 }
 
-static void
-llb_dp_pdiop2_ufwa(struct pdi_rule *new, struct dp_fw_tact *fwa) 
+/*
+ * llb_mupd_pop - Consumer side. Returns NULL if the queue is empty or a
+ * producer is half-way through a push; its sem_post wakes us again.
+ */
+static llb_mupd_t *
+llb_mupd_pop(llb_mupd_q_t *q)
 {
-  memset(fwa, 0, sizeof(*fwa));
-  fwa->ca.cidx = new->data.rid;
-  fwa->ca.mark = new->data.opts.mark;
-  fwa->ca.record = new->data.opts.record;
+  llb_mupd_t *tail = q->tail;
+  llb_mupd_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
 
-  switch (new->data.op) {
-  case PDI_SET_DROP:
-    fwa->ca.act_type = DP_SET_DROP;
-    break;
-  case PDI_SET_TRAP:
-    fwa->ca.act_type = DP_SET_TOCP;
-    break;
-  case PDI_SET_RDR:
-    fwa->ca.act_type = DP_SET_RDR_PORT;
-    fwa->port_act.oport = new->data.opts.port;
-    break;
-  case PDI_SET_FWD:
-    fwa->ca.act_type = DP_SET_NOP;
-    break;
-  default:
-    break;
+  if (tail == &q->stub) {
+    if (!next) return NULL;
+    q->tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
   }
-}
 
-static void
-llb_dp_ufw2pdiop(struct pdi_rule *new, struct dp_fw_tact *fwa)
-{
-  new->data.rid = fwa->ca.cidx;
-  new->data.pref = fwa->ca.oaux; // Overloaded field
-  new->data.opts.mark = fwa->ca.mark;
-  new->data.opts.record = fwa->ca.record;
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
 
-  switch (fwa->ca.act_type) {
-  case DP_SET_DROP:
-    new->data.op = PDI_SET_DROP;
-    break;
-  case DP_SET_TOCP:
-    new->data.op = PDI_SET_TRAP;
-    break;
-  case DP_SET_RDR_PORT:
-    new->data.op = PDI_SET_RDR;
-    new->data.opts.port = fwa->port_act.oport;
-    break;
-  case DP_SET_NOP:
-    new->data.op = PDI_SET_FWD;
-  default:
-    break; 
+  if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+    return NULL;
   }
-}
 
-static void ll_map_ct_rm_any(void);
+  llb_mupd_push(q, &q->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
 
-int
-llb_add_mf_map_elem__(int tbl, void *k, void *v)
-{
-  int ret = 0;
-  int n = 0;
-  int nr = 0;
-  struct dp_fwv4_ent p = { 0 };
-  struct dp_fwv6_ent p6 = { 0 };
+  return NULL;
+}
 
-  if (tbl == LL_DP_FW4_MAP) {
-    struct dp_fwv4_ent *e = k;
-    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
-    
-    if (!new) return -1;
+static inline int
+llb_mupd_same_key(llb_mupd_t *a, llb_mupd_t *b)
+{
+  return a->tbl == b->tbl && a->key_sz == b->key_sz &&
+         memcmp(a->data, b->data, a->key_sz) == 0;
+}
 
-    llb_dp_ufw42_pdik(new, &e->k);
-    llb_dp_ufw2pdiop(new, &e->fwa);
+static inline int
+llb_mupd_same_run(llb_mupd_t *a, llb_mupd_t *b)
+{
+  return a->tbl == b->tbl && a->add == b->add &&
+         a->key_sz == b->key_sz && a->val_sz == b->val_sz;
+}
 
-    ret = pdi_rule_insert(xh->ufw4, new, &nr);
-    if (ret != 0) {
-      free(new);
-      if (ret == -EEXIST) {
-        return 0;
+/*
+ * llb_mupd_apply - Apply a drained batch of ops in submission order. An op
+ * superseded by a later op to the same key is not applied and completes
+ * with the status of the op which replaced it.
+ */
+static void
+llb_mupd_apply(llb_mupd_q_t *q, llb_mupd_t **ops, int n,
+               uint8_t *keys, uint8_t *vals, int *status)
+{
+  llb_mupd_t *run[LLB_MUPD_BATCH];
+  llb_mupd_t *m;
+  int nrun;
+  int i, j, r;
+
+  for (i = 0; i < n; i++) {
+    ops[i]->sup = NULL;
+    for (j = i + 1; j < n; j++) {
+      if (!llb_mupd_same_key(ops[i], ops[j])) continue;
+      /* A delete replaces anything before it, an add replaces only an
+       * earlier add and not for firewall tables where an add of an
+       * existing rule is a no-op
+       */
+      if (!ops[j]->add ||
+          (ops[i]->add && ops[i]->tbl != LL_DP_FW4_MAP &&
+           ops[i]->tbl != LL_DP_FW6_MAP)) {
+        ops[i]->sup = ops[j];
+        q->st.coalesced++;
       }
-      return -1;
+      break;
     }
+  }
 
-    PDI_MAP_LOCK(xh->ufw4);
-    FOR_EACH_PDI_ENT(xh->ufw4, new) {
-      if (n == 0 || n >= nr) {
-        memset(&p, 0, sizeof(p));
-        llb_dp_pdik2_ufw4(new, &p.k);
-        llb_dp_pdiop2_ufwa(new, &p.fwa);
-        if (n == 0) {
-          PDI_VAL_INIT(&p.k.nr, xh->ufw4->nr);
-        }
-        ret = bpf_map_update_elem(llb_map2fd(tbl), &n, &p, 0);
-        if (ret != 0) {
-          ret = -EFAULT;
-        }
-      }  
-      n++;
+  for (i = 0; i < n; i = j) {
+    nrun = 0;
+    for (j = i; j < n && (ops[j]->sup || nrun == 0 ||
+                          llb_mupd_same_run(run[0], ops[j])); j++) {
+      if (ops[j]->sup) continue;
+      run[nrun++] = ops[j];
     }
-    PDI_MAP_ULOCK(xh->ufw4);
-
-  } else if (tbl == LL_DP_FW6_MAP) {
-    struct dp_fwv6_ent *e6 = k;
-    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
-
-    if (!new) return -1;
+    if (nrun == 0) continue;
 
-    llb_dp_ufw62_pdik(new, &e6->k);
-    llb_dp_ufw2pdiop(new, &e6->fwa);
+    m = run[0];
+    for (r = 0; r < nrun; r++) {
+      memcpy(keys + r*m->key_sz, run[r]->data, m->key_sz);
+      memcpy(vals + r*m->val_sz, run[r]->data + m->key_sz, m->val_sz);
+    }
 
-    ret = pdi_rule_insert(xh->ufw6, new, &nr);
-    if (ret != 0) {
-      free(new); 
-      if (ret == -EEXIST) {
-        return 0;
-      }
-      return -1;
+    if (m->add) {
+      llb_add_map_elems(m->tbl, keys, m->key_sz, vals, m->val_sz, nrun,
+                        status);
+    } else {
+      llb_del_map_elems(m->tbl, keys, m->key_sz, m->val_sz ? vals : NULL,
+                        m->val_sz, nrun, status);
     }
+    q->st.batches++;
 
-    PDI_MAP_LOCK(xh->ufw6);
-    FOR_EACH_PDI_ENT(xh->ufw6, new) {
-      if (n == 0 || n >= nr) {
-        memset(&p6, 0, sizeof(p6));
-        llb_dp_pdik2_ufw6(new, &p6.k);
-        llb_dp_pdiop2_ufwa(new, &p6.fwa);
-        if (n == 0) {
-          PDI_VAL_INIT(&p6.k.nr, xh->ufw6->nr);
-        }
-        ret = bpf_map_update_elem(llb_map2fd(tbl), &n, &p6, 0);
-        if (ret != 0) {
-          ret = -EFAULT;
-        }
-      }  
-      n++;
+    for (r = 0; r < nrun; r++) {
+      run[r]->status = status[r];
     }
-    PDI_MAP_ULOCK(xh->ufw6);
   }
 
-  if (ret == 0) ll_map_ct_rm_any();
-  return ret;
+  for (i = n - 1; i >= 0; i--) {
+    if (ops[i]->sup) ops[i]->status = ops[i]->sup->status;
+  }
 }
 
-static int
-llb_conv_nat2proxy(void *k, void *v, struct proxy_ent *pent, struct proxy_arg *pval)
+static void *
+llb_mupd_main(void *arg)
 {
-  struct dp_nat_key *nat_key = k;
-  struct dp_proxy_tacts *dat = v;
-  int i = 0;
-  int j = 0;
+  llb_mupd_q_t *q = arg;
+  llb_mupd_t *ops[LLB_MUPD_BATCH];
+  uint8_t *keys;
+  uint8_t *vals;
+  int status[LLB_MUPD_BATCH];
+  uint64_t cnt;
+  int n;
+  int i;
 
-  pent->xip = nat_key->daddr[0];
-  pent->xport = nat_key->dport;
-  pent->protocol = nat_key->l4proto;
+  keys = calloc(LLB_MUPD_BATCH, LLB_MUPD_KV_MAX);
+  vals = calloc(LLB_MUPD_BATCH, LLB_MUPD_KV_MAX);
+  assert(keys && vals);
 
-  strncpy(pval->host_url, (const char *)dat->host_url, sizeof(pval->host_url) - 1);
-  pval->host_url[sizeof(pval->host_url) - 1] = '\0';
+  while (1) {
+    while (sem_wait(&q->sem) != 0 && errno == EINTR);
 
-  if (!strcmp(pval->host_url, "")) {
-    char ab1[INET6_ADDRSTRLEN];
-    const char *host = inet_ntop(AF_INET, (struct in_addr *)&pent->xip, ab1, INET_ADDRSTRLEN);
-    if (host != NULL) {
-      sprintf(pval->host_url, "%s:%u", host, ntohs(pent->xport));
+    while (1) {
+      for (n = 0; n < LLB_MUPD_BATCH; n++) {
+        ops[n] = llb_mupd_pop(q);
+        if (!ops[n]) break;
+      }
+      if (n == 0) break;
+
+      llb_mupd_apply(q, ops, n, keys, vals, status);
+
+      for (i = 0; i < n; i++) {
+        goMapUpdDoneHandler(ops[i]->cookie, ops[i]->status);
+        if (ops[i]->status != 0) {
+          q->st.failed++;
+        }
+        free(ops[i]);
+      }
+      q->st.completed += n;
+
+      cnt = n;
+      if (write(q->efd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+        log_error("map-upd: eventfd write failed");
+      }
     }
   }
 
-  for (i = 0; i < LLB_MAX_NXFRMS && i < MAX_PROXY_EP; i++) {
-    struct mf_xfrm_inf *mf = &dat->nxfrms[i];
-    struct proxy_ent *proxy_ep = &pval->eps[j];
+  return NULL;
+}
 
-    if (mf->inactive) continue;
+static int
+llb_map_upd_submit(int tbl, int add, void *k, uint32_t key_sz,
+                   void *v, uint32_t val_sz, uint64_t cookie)
+{
+  llb_mupd_q_t *q = xh->mupd;
+  llb_mupd_t *m;
 
-    proxy_ep->xip = mf->nat_xip[0];
-    proxy_ep->xport = mf->nat_xport;
-    proxy_ep->protocol = nat_key->l4proto;
+  if (!q) return -EOPNOTSUPP;
 
-    j++;
+  if (tbl < 0 || tbl >= LL_DP_MAX_MAP || !k || key_sz == 0 ||
+      key_sz > LLB_MUPD_KV_MAX || val_sz > LLB_MUPD_KV_MAX ||
+      (val_sz && !v) || (add && !val_sz)) {
+    return -EINVAL;
   }
 
-  if (j <= 0) {
-    return -1;
-  }
+  m = malloc(sizeof(*m) + key_sz + val_sz);
+  if (!m) return -ENOMEM;
 
-  if (dat->sel_type == NAT_LB_SEL_N2) {
-    pval->proxy_mode = PROXY_MODE_ALL;
-    pval->select =  PROXY_SEL_N2;
-  }
+  m->tbl = tbl;
+  m->add = add;
+  m->key_sz = key_sz;
+  m->val_sz = val_sz;
+  m->cookie = cookie;
+  m->status = 0;
+  memcpy(m->data, k, key_sz);
+  if (val_sz) memcpy(m->data + key_sz, v, val_sz);
 
-  if (dat->sec_mode == SEC_MODE_HTTPS) {
-    pval->have_ssl = 1;
-  } else if (dat->sec_mode == SEC_MODE_HTTPS_E2E) {
-    pval->have_ssl = 1;
-    pval->have_epssl = 1;
-  }
+  __sync_fetch_and_add(&q->st.submitted, 1);
+  llb_mupd_push(q, m);
+  sem_post(&q->sem);
 
-  pval->_id = dat->ca.cidx;
-  pval->n_eps = j;
   return 0;
 }
 
+/*
+ * llb_add_map_elem_async - Queue an add of (k, v) to tbl. Returns once the
+ * op is queued. cookie is handed back on completion.
+ */
+int
+llb_add_map_elem_async(int tbl, void *k, uint32_t key_sz, void *v,
+                       uint32_t val_sz, uint64_t cookie)
+{
+  return llb_map_upd_submit(tbl, 1, k, key_sz, v, val_sz, cookie);
+}
+
+/*
+ * llb_del_map_elem_async - Queue a delete of k from tbl. v is needed only
+ * for tables which need it in llb_del_map_elem_wval() and can be NULL
+ * (val_sz 0) otherwise.
+ */
+int
+llb_del_map_elem_async(int tbl, void *k, uint32_t key_sz, void *v,
+                       uint32_t val_sz, uint64_t cookie)
+{
+  return llb_map_upd_submit(tbl, 0, k, key_sz, v, val_sz, cookie);
+}
+
+int
+llb_map_upd_async_efd(void)
+{
+  return xh->mupd ? xh->mupd->efd : -1;
+}
+
 int
-llb_add_map_elem(int tbl, void *k, void *v)
+llb_get_map_upd_stats(struct dp_map_upd_stats *st)
 {
-  int ret = -EINVAL;
-  if (tbl < 0 || tbl >= LL_DP_MAX_MAP) {
-    return ret; 
-  }
+  llb_mupd_q_t *q = xh->mupd;
 
-  XH_LOCK();
+  if (!st) return -EINVAL;
 
-  /* Any table which has stats pb needs to get stats cleared before use */
-  if (tbl == LL_DP_NAT_MAP ||
-      tbl == LL_DP_TMAC_MAP ||
-      tbl == LL_DP_FW4_MAP  ||
-      tbl == LL_DP_FW6_MAP  ||
-      tbl == LL_DP_RTV4_MAP) {
-    __u32 cidx = 0;
+  memset(st, 0, sizeof(*st));
+  if (!q) return 0;
 
-    if (tbl == LL_DP_FW4_MAP) {
-      struct dp_fwv4_ent *e = k;
-      cidx = e->fwa.ca.cidx;
-    } else if (tbl == LL_DP_FW6_MAP) {
-      struct dp_fwv6_ent *e = k;
-      cidx = e->fwa.ca.cidx;
-    } else {
-      struct dp_cmn_act *ca = v;
-      cidx = ca->cidx;
-    }
+  st->submitted = __atomic_load_n(&q->st.submitted, __ATOMIC_RELAXED);
+  st->completed = __atomic_load_n(&q->st.completed, __ATOMIC_RELAXED);
+  st->failed = __atomic_load_n(&q->st.failed, __ATOMIC_RELAXED);
+  st->coalesced = __atomic_load_n(&q->st.coalesced, __ATOMIC_RELAXED);
+  st->batches = __atomic_load_n(&q->st.batches, __ATOMIC_RELAXED);
 
-    if (tbl == LL_DP_NAT_MAP) {
-      int aid = 0;
-      for (aid = 0; aid < LLB_MAX_NXFRMS; aid++) {
-        llb_clear_map_stats(tbl, LLB_NAT_STAT_CID(cidx, aid));
-        llb_nat_rst_act_sessions(cidx);
-      }
-    } else {
-      llb_clear_map_stats(tbl, cidx);
-    }
-  }
+  return 0;
+}
 
-  if (tbl == LL_DP_NAT_MAP) {
-    struct dp_nat_key *nk = k;
-    struct dp_proxy_tacts *nv = v;
-    struct proxy_ent pk = { 0 };
-    struct proxy_arg pv = { 0 };
+static int
+llb_mupd_init(void)
+{
+  llb_mupd_q_t *q;
 
-    if (nv->ca.act_type == DP_SET_FULLPROXY &&
-        (nk->l4proto == IPPROTO_TCP || nk->l4proto == IPPROTO_SCTP) && nk->v6 == 0) {
-      llb_conv_nat2proxy(k, v, &pk, &pv);
-      // FIXME
-      ret = proxy_add_entry(&pk, &pv);
-      goto out;
-    }
-  }
+  q = calloc(1, sizeof(*q));
+  if (!q) return -ENOMEM;
 
-  if (xh->have_noebpf) {
-    ret = 0;
-    goto ulock_out;
+  q->head = &q->stub;
+  q->tail = &q->stub;
+  q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q->efd < 0) {
+    free(q);
+    return -EFAULT;
   }
 
-  if (tbl == LL_DP_FW4_MAP || tbl == LL_DP_FW6_MAP) {
-    ret = llb_add_mf_map_elem__(tbl, k, v);
-  } else {
-    ret = bpf_map_update_elem(llb_map2fd(tbl), k, v, 0);
+  sem_init(&q->sem, 0, 0);
+  if (pthread_create(&q->thr, NULL, llb_mupd_main, q) != 0) {
+    log_error("map-upd: failed to start thread");
+    close(q->efd);
+    free(q);
+    return -EFAULT;
   }
-out:
-  if (ret != 0) {
-    ret = -EFAULT;
-  } else {
-    /* Need some post-processing for certain maps */
-    if (tbl == LL_DP_NAT_MAP) {
-      llb_add_map_elem_nat_post_proc(k, v);
-    }
+
+  xh->mupd = q;
+  return 0;
+}
+
+/*
+ * Map transactions - Updates to several tables are staged and applied
+ * under the locks of all tables involved (taken in tid order), so that no
+ * other control path interleaves. Packets can't see all of them change at
+ * once, so ops are ordered to keep every intermediate state consistent:
+ * deletes go from referring (root) to referred (leaf) tables, then adds and
+ * updates go from leaf to root, e.g. nat_ep_map and stats before nat_map.
+ * Firewall ops of a family are applied with a single bank flip. Failed ops
+ * are reported and are not rolled back.
+ */
+#define LLB_TXN_RANK_LEAF  (0)
+#define LLB_TXN_RANK_MID   (1)
+#define LLB_TXN_RANK_ROOT  (2)
+
+struct dp_map_txn {
+  llb_mupd_t **ops;
+  int n;
+  int cap;
+};
+
+static int
+llb_map_txn_rank(int tbl)
+{
+  switch (tbl) {
+  case LL_DP_NH_MAP:
+  case LL_DP_DMAC_MAP:
+  case LL_DP_SMAC_MAP:
+  case LL_DP_TX_INTF_MAP:
+  case LL_DP_MIRROR_MAP:
+  case LL_DP_POL_MAP:
+  case LL_DP_NAT_EP_MAP:
+    return LLB_TXN_RANK_LEAF;
+  case LL_DP_NAT_MAP:
+    return LLB_TXN_RANK_ROOT;
+  default:
+    break;
   }
-ulock_out:
-  XH_UNLOCK();
 
-  return ret;
+  return LLB_TXN_RANK_MID;
+}
+
+struct dp_map_txn *
+llb_map_txn_begin(void)
+{
+  return calloc(1, sizeof(struct dp_map_txn));
 }
 
 static int
-ll_map_elem_cmp_cidx(int tid, void *k, void *ita)
+llb_map_txn_stage(struct dp_map_txn *txn, int tbl, int add, void *k,
+                  uint32_t key_sz, void *v, uint32_t val_sz)
 {
-  dp_map_ita_t *it = ita;
-  uint32_t cidx;
+  llb_mupd_t **ops;
+  llb_mupd_t *m;
 
-  if (!it|| !it->uarg || !it->val) return 0;
+  if (!txn || tbl < 0 || tbl >= LL_DP_MAX_MAP || !k || key_sz == 0 ||
+      (val_sz && !v) || (add && !val_sz)) {
+    return -EINVAL;
+  }
 
-  cidx = *(uint32_t *)it->uarg;
+  /* CT/FC locks nest under other table locks, see llb_map_lock() */
+  if (tbl == LL_DP_CT_MAP || tbl == LL_DP_FCV4_MAP ||
+      tbl == LL_DP_FCV6_MAP) {
+    return -EINVAL;
+  }
 
-  if (tid == LL_DP_CT_MAP || 
-      tid == LL_DP_TMAC_MAP ||
-      tid == LL_DP_FCV4_MAP ||
-      tid == LL_DP_RTV4_MAP) {
-    struct dp_cmn_act *ca = it->val;
-    if (ca->cidx == cidx) return 1;
+  if (txn->n == txn->cap) {
+    ops = realloc(txn->ops, (txn->cap ? txn->cap * 2 : 16) * sizeof(*ops));
+    if (!ops) return -ENOMEM;
+    txn->ops = ops;
+    txn->cap = txn->cap ? txn->cap * 2 : 16;
   }
 
+  m = malloc(sizeof(*m) + key_sz + val_sz);
+  if (!m) return -ENOMEM;
+
+  memset(m, 0, sizeof(*m));
+  m->tbl = tbl;
+  m->add = add;
+  m->key_sz = key_sz;
+  m->val_sz = val_sz;
+  memcpy(m->data, k, key_sz);
+  if (val_sz) memcpy(m->data + key_sz, v, val_sz);
+
+  txn->ops[txn->n++] = m;
   return 0;
 }
 
-static void
-llb_del_map_elem_with_cidx(int tbl, uint32_t cidx)
+int
+llb_map_txn_add(struct dp_map_txn *txn, int tbl, void *k, uint32_t key_sz,
+                void *v, uint32_t val_sz)
 {
-  dp_map_ita_t it;
-  uint8_t skey[1024];
-  uint8_t sval[1024];
+  return llb_map_txn_stage(txn, tbl, 1, k, key_sz, v, val_sz);
+}
 
-  memset(&it, 0, sizeof(it));
-  memset(&skey, 0, sizeof(skey));
-  memset(&sval, 0, sizeof(sval));
+int
+llb_map_txn_del(struct dp_map_txn *txn, int tbl, void *k, uint32_t key_sz,
+                void *v, uint32_t val_sz)
+{
+  return llb_map_txn_stage(txn, tbl, 0, k, key_sz, v, val_sz);
+}
 
-  it.next_key = &skey;
-  it.val = &sval;
-  it.uarg = &cidx;
+void
+llb_map_txn_abort(struct dp_map_txn *txn)
+{
+  int i;
+
+  if (!txn) return;
 
-  llb_map_loop_and_delete(tbl, ll_map_elem_cmp_cidx, &it);
+  for (i = 0; i < txn->n; i++) {
+    free(txn->ops[i]);
+  }
+  if (txn->ops) free(txn->ops);
+  free(txn);
 }
 
-int 
-llb_del_mf_map_elem__(int tbl, void *k)
+/*
+ * llb_map_txn_fw__ - Apply all firewall ops of txn for tbl with one
+ * rebuild of the firewall table
+ */
+static void
+llb_map_txn_fw__(struct dp_map_txn *txn, int tbl, int *status)
 {
-  int ret = 0;
+  uint32_t key_sz = 0;
+  uint8_t *keys;
+  uint8_t *adds;
+  int *st;
+  int *map;
   int n = 0;
-  int nr = 0;
-  struct dp_fwv4_ent p = { 0 };
-  struct dp_fwv6_ent p6 = { 0 };
-
-  if (tbl == LL_DP_FW4_MAP) {
-    struct dp_fwv4_ent *e = k;
-    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
-    
-    if (!new) return -1;
-
-    llb_dp_ufw42_pdik(new, &e->k);
-    llb_dp_ufw2pdiop(new, &e->fwa) ;
+  int i;
 
-    ret = pdi_rule_delete(xh->ufw4, &new->key, new->data.pref, &nr);
-    if (ret != 0) {
-      free(new);
-      return -1;
+  for (i = 0; i < txn->n; i++) {
+    if (txn->ops[i]->tbl != tbl) continue;
+    if (!key_sz) key_sz = txn->ops[i]->key_sz;
+    if (txn->ops[i]->key_sz != key_sz) {
+      status[i] = -EINVAL;
+      continue;
     }
+    n++;
+  }
+  if (n == 0) return;
 
-    free(new);
-
-    PDI_MAP_LOCK(xh->ufw4);
-    FOR_EACH_PDI_ENT(xh->ufw4, new) {
-      if (n == 0 || n >= nr) {
-        memset(&p, 0, sizeof(p));
-        llb_dp_pdik2_ufw4(new, &p.k);
-        llb_dp_pdiop2_ufwa(new, &p.fwa);
-        if (n == 0) {
-          PDI_VAL_INIT(&p.k.nr, xh->ufw4->nr);
-        }
-        ret = bpf_map_update_elem(llb_map2fd(tbl), &n, &p, 0);
-        if (ret != 0) {
-          ret = -EFAULT;
-        }
-      }
-      n++;
+  keys = calloc(n, key_sz);
+  adds = calloc(n, sizeof(*adds));
+  st = calloc(n, sizeof(*st));
+  map = calloc(n, sizeof(*map));
+  if (!keys || !adds || !st || !map) {
+    for (i = 0; i < txn->n; i++) {
+      if (txn->ops[i]->tbl == tbl) status[i] = -ENOMEM;
     }
-    PDI_MAP_ULOCK(xh->ufw4);
+    goto out;
+  }
 
-    while (n < LLB_FW4_MAP_ENTRIES) {
-      memset(&p, 0, sizeof(p));
-      bpf_map_update_elem(llb_map2fd(tbl), &n, &p, 0);
-      n++;
-    }
-  } else if (tbl == LL_DP_FW6_MAP) {
-    struct dp_fwv6_ent *e6 = k;
-    struct pdi_rule *new = calloc(1, sizeof(struct pdi_rule));
-    
-    if (!new) return -1;
+  n = 0;
+  for (i = 0; i < txn->n; i++) {
+    if (txn->ops[i]->tbl != tbl || status[i] != 0) continue;
+    memcpy(keys + n*key_sz, txn->ops[i]->data, key_sz);
+    adds[n] = txn->ops[i]->add;
+    map[n++] = i;
+  }
 
-    llb_dp_ufw62_pdik(new, &e6->k);
-    llb_dp_ufw2pdiop(new, &e6->fwa) ;
+  llb_mf_map_elems__(tbl, keys, key_sz, n, st, 0, adds);
 
-    ret = pdi_rule_delete(xh->ufw6, &new->key, new->data.pref, &nr);
-    if (ret != 0) {
-      free(new);
-      return -1;
-    }
+  for (i = 0; i < n; i++) {
+    status[map[i]] = st[i];
+  }
 
-    free(new);
+out:
+  if (keys) free(keys);
+  if (adds) free(adds);
+  if (st) free(st);
+  if (map) free(map);
+}
 
-    PDI_MAP_LOCK(xh->ufw6);
-    FOR_EACH_PDI_ENT(xh->ufw6, new) {
-      if (n == 0 || n >= nr) {
-        memset(&p6, 0, sizeof(p6));
-        llb_dp_pdik2_ufw6(new, &p6.k);
-        llb_dp_pdiop2_ufwa(new, &p6.fwa);
-        if (n == 0) {
-          PDI_VAL_INIT(&p6.k.nr, xh->ufw6->nr);
-        }
-        ret = bpf_map_update_elem(llb_map2fd(tbl), &n, &p6, 0);
-        if (ret != 0) {
-          ret = -EFAULT;
-        }
-      }
-      n++;
-    }
-    PDI_MAP_ULOCK(xh->ufw6);
+static void
+llb_map_txn_op__(llb_mupd_t *m, int *status)
+{
+  void *v = m->val_sz ? m->data + m->key_sz : NULL;
 
-    while (n < LLB_FW6_MAP_ENTRIES) {
-      memset(&p6, 0, sizeof(p6));
-      bpf_map_update_elem(llb_map2fd(tbl), &n, &p6, 0);
-      n++;
-    }
+  if (m->add) {
+    *status = llb_add_map_elem__(m->tbl, m->data, v);
+  } else if (m->tbl == LL_DP_NAT_MAP && !v) {
+    *status = -EINVAL;
+  } else {
+    *status = llb_del_map_elem_wval__(m->tbl, m->data, v);
   }
-
-  if (ret == 0) ll_map_ct_rm_any();
-
-  return ret;
 }
 
+/*
+ * llb_map_txn_commit - Apply and free txn. status (optional) gets the
+ * result of each op in staging order. Returns 0 if all ops succeeded or
+ * -EFAULT otherwise.
+ */
 int
-llb_del_map_elem_wval(int tbl, void *k, void *v)
+llb_map_txn_commit(struct dp_map_txn *txn, int *status)
 {
-  int ret = -EINVAL;
-  struct dp_proxy_tacts t = { 0 };
+  uint8_t used[LL_DP_MAX_MAP];
+  int fw_done[2] = { 0, 0 };
+  uint64_t sts, lat;
+  int *st;
+  int rank;
+  int ret = 0;
+  int i;
 
-  if (tbl < 0 || tbl >= LL_DP_MAX_MAP) {
-    return ret;
+  if (!txn) return -EINVAL;
+
+  if (txn->n == 0) {
+    llb_map_txn_abort(txn);
+    return 0;
   }
 
-  XH_LOCK();
+  st = calloc(txn->n, sizeof(*st));
+  if (!st) {
+    llb_map_txn_abort(txn);
+    return -ENOMEM;
+  }
 
-  /* Need some pre-processing for certain maps */
-  if (tbl == LL_DP_NAT_MAP) {
-    struct dp_nat_key *nk = k;
-    struct dp_proxy_tacts *nv = v;
-    struct proxy_ent pk = { 0 };
-    struct proxy_arg pa = { 0 };
+  memset(used, 0, sizeof(used));
+  for (i = 0; i < txn->n; i++) {
+    used[txn->ops[i]->tbl] = 1;
+  }
 
-    assert(nv);
+  sts = get_os_nsecs();
 
-    if (nv->ca.act_type == DP_SET_FULLPROXY &&
-        (nk->l4proto == IPPROTO_TCP || nk->l4proto == IPPROTO_SCTP) && nk->v6 == 0) {
-      llb_conv_nat2proxy(nk, nv, &pk, &pa);
-      proxy_delete_entry(&pk, &pa);
-    }
+  XH_RD_LOCK();
+  for (i = 0; i < LL_DP_MAX_MAP; i++) {
+    if (used[i]) llb_map_lock(i);
+  }
 
-    if (xh->have_noebpf) {
-      XH_UNLOCK();
-      return 0;
-    }
+  /* Deletes, root to leaf */
+  for (rank = LLB_TXN_RANK_ROOT; rank >= LLB_TXN_RANK_LEAF; rank--) {
+    for (i = 0; i < txn->n; i++) {
+      llb_mupd_t *m = txn->ops[i];
 
-    ret = bpf_map_lookup_elem(llb_map2fd(tbl), k, &t);
-    if (ret != 0) {
-      XH_UNLOCK();
-      return -EINVAL;
+      if (m->add || llb_map_txn_rank(m->tbl) != rank) continue;
+      if (m->tbl == LL_DP_FW4_MAP || m->tbl == LL_DP_FW6_MAP) continue;
+      llb_map_txn_op__(m, &st[i]);
     }
   }
 
-  if (xh->have_noebpf) {
-    XH_UNLOCK();
-    return 0;
-  }
+  /* Adds and updates, leaf to root */
+  for (rank = LLB_TXN_RANK_LEAF; rank <= LLB_TXN_RANK_ROOT; rank++) {
+    for (i = 0; i < txn->n; i++) {
+      llb_mupd_t *m = txn->ops[i];
 
-  if (tbl == LL_DP_FW4_MAP || tbl == LL_DP_FW6_MAP) {
-    ret = llb_del_mf_map_elem__(tbl, k);
-  } else {
-    ret = bpf_map_delete_elem(llb_map2fd(tbl), k);
+      if (llb_map_txn_rank(m->tbl) != rank) continue;
+      if (m->tbl == LL_DP_FW4_MAP || m->tbl == LL_DP_FW6_MAP) {
+        int fi = m->tbl == LL_DP_FW6_MAP;
+
+        if (!fw_done[fi]) {
+          fw_done[fi] = 1;
+          if (xh->have_noebpf) continue;
+          llb_map_txn_fw__(txn, m->tbl, st);
+        }
+        continue;
+      }
+      if (!m->add) continue;
+      llb_map_txn_op__(m, &st[i]);
+    }
   }
-  if (ret != 0) {
-    ret = -EFAULT;
+
+  for (i = LL_DP_MAX_MAP - 1; i >= 0; i--) {
+    if (used[i]) llb_map_unlock(i);
   }
+  XH_UNLOCK();
 
-  /* Need some post-processing for certain maps */
-  if (tbl == LL_DP_NAT_MAP) {
-    llb_del_map_elem_nat_post_proc(k, &t);
+  lat = get_os_nsecs() - sts;
+
+  for (i = 0; i < txn->n; i++) {
+    if (st[i] != 0) ret = -EFAULT;
+    if (status) status[i] = st[i];
   }
 
-  XH_UNLOCK();
+  pthread_mutex_lock(&xh->txn_lock);
+  xh->txn_st.commits++;
+  xh->txn_st.ops += txn->n;
+  if (ret != 0) xh->txn_st.failed++;
+  xh->txn_st.last_ns = lat;
+  xh->txn_st.total_ns += lat;
+  if (lat > xh->txn_st.max_ns) xh->txn_st.max_ns = lat;
+  pthread_mutex_unlock(&xh->txn_lock);
+
+  free(st);
+  llb_map_txn_abort(txn);
 
   return ret;
 }
 
 int
-llb_del_map_elem(int tbl, void *k)
+llb_get_map_txn_stats(struct dp_map_txn_stats *st)
 {
-  return llb_del_map_elem_wval(tbl, k, NULL);
+  if (!st) return -EINVAL;
+
+  pthread_mutex_lock(&xh->txn_lock);
+  memcpy(st, &xh->txn_st, sizeof(*st));
+  pthread_mutex_unlock(&xh->txn_lock);
+
+  return 0;
 }
 
 unsigned long long
@@ -2594,6 +5997,11 @@ ll_fcmap_ent_has_aged(int tid, void *k, void *ita)
     return 1;
   }
 
+  if (fc_val->gen != xh->fc_gen) {
+    return 1;
+  }
+
+  llb_fcidx_add(fc_val->ca.cidx, tid, k);
   return 0;
 }
 
@@ -2602,6 +6010,7 @@ ll_age_fcmap(void)
 {
   dp_map_ita_t it;
   struct dp_fcv4_key next_key;
+  struct dp_fcv6_key next_key6;
   struct dp_fc_tacts *fc_val;
   uint64_t ns = get_os_nsecs();
 
@@ -2623,10 +6032,28 @@ ll_age_fcmap(void)
   it.next_key = &next_key;
   it.key_sz = sizeof(next_key);
   it.val = fc_val;
+  it.val_sz = sizeof(*fc_val);
   it.uarg = &ns;
 
-  XH_LOCK();
-  llb_map_loop_and_delete(LL_DP_FCV4_MAP, ll_fcmap_ent_has_aged, &it);
+  XH_RD_LOCK();
+  llb_map_lock(LL_DP_FCV4_MAP);
+  llb_map_lock(LL_DP_FCV6_MAP);
+  /* CT paths fall back to a (locked) FC walk while the index is rebuilt */
+  xh->fcidx_ok = 0;
+  llb_fcidx_flush();
+  xh->fcidx_lost = 0;
+  llb_map_loop_and_delete_batch(LL_DP_FCV4_MAP, ll_fcmap_ent_has_aged, &it);
+
+  memset(&next_key6, 0, sizeof(next_key6));
+  it.next_key = &next_key6;
+  it.key_sz = sizeof(next_key6);
+  llb_map_loop_and_delete_batch(LL_DP_FCV6_MAP, ll_fcmap_ent_has_aged, &it);
+
+  /* Only current generation entries are left */
+  xh->fc_gen_bumps = 0;
+  xh->fcidx_ok = xh->have_mtrace && !xh->fcidx_lost;
+  llb_map_unlock(LL_DP_FCV6_MAP);
+  llb_map_unlock(LL_DP_FCV4_MAP);
   XH_UNLOCK();
   if (fc_val) free(fc_val);
 }
@@ -2638,7 +6065,11 @@ typedef struct ct_arg_struct
   uint32_t aid[LLB_MAX_NXFRMS];
   int n_aids;
   int n_aged;
+  int n_rm;
   int dir;
+  int fwv6;
+  pdi_key_t fwk;
+  ll_cidx_set_t fcs;
 } ct_arg_struct_t;
 
 static int
@@ -2711,36 +6142,43 @@ ctm_proto_xfk_init(struct dp_ct_key *key,
 }
 
 static void
-ll_send_ctep_reset(struct dp_ct_key *ep, struct dp_ct_tact *adat)
+ll_send_ctep_rst(struct dp_ct_key *ep, __be32 seq)
 {
   struct mkr_args r;
-  ct_tcp_pinf_t *ts = &adat->ctd.pi.t;
 
-  if (ep->l4proto != IPPROTO_TCP) {
-    return;
+  memset(&r, 0, sizeof(r));
+
+  if (ep->v6 == 0) {
+    r.sip[0] = ntohl(ep->daddr[0]);
+    r.dip[0] = ntohl(ep->saddr[0]);
+  } else {
+    memcpy(r.sip, ep->daddr, 16);
+    memcpy(r.dip, ep->saddr, 16);
+    r.v6 = 1;
   }
+  r.sport = ntohs(ep->dport);
+  r.dport = ntohs(ep->sport);
+  r.protocol = ep->l4proto;
+  r.t.seq = ntohl(seq);
+  r.t.rst = 1;
 
-  if (ts->state != CT_TCP_EST) {
+  create_xmit_raw_tcp(&r);
+}
+
+static void
+ll_send_ctep_reset(struct dp_ct_key *ep, struct dp_ct_tact *adat)
+{
+  ct_tcp_pinf_t *ts = &adat->ctd.pi.t;
+
+  if (ep->l4proto != IPPROTO_TCP) {
     return;
   }
 
-  memset(&r, 0, sizeof(r));
-
-  if (ep->v6 == 0) {
-    r.sip[0] = ntohl(ep->daddr[0]);
-    r.dip[0] = ntohl(ep->saddr[0]);
-  } else {
-    memcpy(r.sip, ep->daddr, 16);
-    memcpy(r.dip, ep->saddr, 16);
-    r.v6 = 1;
+  if (ts->state != CT_TCP_EST) {
+    return;
   }
-  r.sport = ntohs(ep->dport);
-  r.dport = ntohs(ep->sport);
-  r.protocol = ep->l4proto;
-  r.t.seq = ntohl(adat->ctd.pi.t.tcp_cts[CT_DIR_IN].pack);
-  r.t.rst = 1;
 
-  create_xmit_raw_tcp(&r);
+  ll_send_ctep_rst(ep, ts->tcp_cts[CT_DIR_IN].pack);
 }
 
 static void
@@ -2802,8 +6240,21 @@ static void __always_inline
 dp_ct_related_fc_rm(struct dp_ct_key *ctk)
 {
   struct dp_fcv4_key key;
+  struct dp_fcv6_key key6;
+
+  if (ctk->ident || ctk->type) {
+    return;
+  }
+
+  if (ctk->v6) {
+    memset(&key6, 0, sizeof(key6));
+    DP_XADDR_CP(key6.daddr, ctk->daddr);
+    DP_XADDR_CP(key6.saddr, ctk->saddr);
+    key6.sport     = ctk->sport;
+    key6.dport     = ctk->dport;
+    key6.l4proto   = ctk->l4proto;
 
-  if (ctk->v6 || ctk->ident || ctk->type) {
+    bpf_map_delete_elem(llb_map2fd(LL_DP_FCV6_MAP), &key6);
     return;
   }
 
@@ -2841,8 +6292,8 @@ ll_ct_map_ent_has_aged(int tid, void *k, void *ita)
   uint64_t to = CT_V4_CPTO;
   char dstr[INET6_ADDRSTRLEN];
   char sstr[INET6_ADDRSTRLEN];
-  uint64_t bytes, pkts;
   llb_dp_map_t *t;
+  int clr;
 
   if (!it|| !it->uarg || !it->val) return 0;
 
@@ -2851,117 +6302,730 @@ ll_ct_map_ent_has_aged(int tid, void *k, void *ita)
   adat = it->val;
   dat = &adat->ctd;
 
+  /* Entries of the other direction get indexed along with their pair */
   if (as->dir >= 0 && as->dir != adat->ctd.dir) {
     return 0;
   }
 
-  if (key->v6 == 0) {
-    inet_ntop(AF_INET, key->saddr, sstr, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, key->daddr, dstr, INET_ADDRSTRLEN);
-  } else {
-    inet_ntop(AF_INET6, key->saddr, sstr, INET6_ADDRSTRLEN);
-    inet_ntop(AF_INET6, key->daddr, dstr, INET6_ADDRSTRLEN);
+  if (key->v6 == 0) {
+    inet_ntop(AF_INET, key->saddr, sstr, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, key->daddr, dstr, INET_ADDRSTRLEN);
+  } else {
+    inet_ntop(AF_INET6, key->saddr, sstr, INET6_ADDRSTRLEN);
+    inet_ntop(AF_INET6, key->daddr, dstr, INET6_ADDRSTRLEN);
+  }
+
+  if (adat->ctd.xi.nat_flags) {
+    has_nat = true;
+  }
+
+  ctm_proto_xfk_init(key, adat, &xkey, &okey);
+
+  t = &xh->maps[LL_DP_CT_MAP];
+
+  if (adat->ctd.pi.frag) {
+    memset(&axdat, 0, sizeof(axdat));
+  } else if (bpf_map_lookup_elem(t->map_fd, &xkey, &axdat) != 0) {
+    if (key->v6 == 0) {
+      inet_ntop(AF_INET, xkey.saddr, sstr, INET_ADDRSTRLEN);
+      inet_ntop(AF_INET, xkey.daddr, dstr, INET_ADDRSTRLEN);
+    } else {
+      inet_ntop(AF_INET6, xkey.saddr, sstr, INET6_ADDRSTRLEN);
+      inet_ntop(AF_INET6, xkey.daddr, dstr, INET6_ADDRSTRLEN);
+    }
+
+    ll_ct_get_state(&xkey, &axdat, &est, &to, &bidir);
+
+    if (est && curr_ns - adat->lts < CT_MISMATCH_FN_CPTO) {
+      llb_ctidx_add(key, dat->rid, dat->aid);
+      return 0;
+    }
+
+    dp_ct_related_fc_rm(key);
+
+    log_trace("ct: rdir not found #%s:%d -> %s:%d (%d)#",
+         sstr, ntohs(xkey.sport),
+         dstr, ntohs(xkey.dport),
+         xkey.l4proto);
+    llb_clear_map_stats(LL_DP_CT_STATS_MAP, adat->ca.cidx);
+    llb_ctidx_del(key);
+    as->n_aged++;
+    return 1;
+  }
+
+  if (adat->lts > axdat.lts) {
+    latest_ns = adat->lts;
+  } else {
+    latest_ns = axdat.lts;
+  }
+
+  /*
+   * CT is allocated both for current and reverse direction. Counters are
+   * refreshed and the used flags taken with one stat_lock hold each.
+   */
+  clr = curr_ns >= latest_ns;
+  llb_fetch_map_stats_used(LL_DP_CT_STATS_MAP, adat->ca.cidx, 1, clr, &used1);
+  llb_fetch_map_stats_used(LL_DP_CT_STATS_MAP, axdat.ca.cidx, 1, clr, &used2);
+
+  ll_ct_get_state(key, adat, &est, &to, &bidir);
+
+  if (!clr) goto alive;
+
+  if (est && adat->ito != 0) {
+    to = adat->ito;
+  }
+
+  if (bidir) {
+    any_used = used1 && used2;
+  } else {
+    any_used = used1 || used2;
+  }
+
+  if (curr_ns - latest_ns > to && (!est || !any_used)) {
+    log_trace("ct: #%s:%d -> %s:%d (%d)# rid:%u est:%d nat:%d (Aged:%lluns:%d:%d)",
+         sstr, ntohs(key->sport),
+         dstr, ntohs(key->dport),  
+         key->l4proto, dat->rid,
+         est, has_nat, curr_ns - latest_ns,
+         used1, used2);
+    ll_send_ctep_reset(key, adat);
+    llb_clear_map_stats(LL_DP_CT_STATS_MAP, adat->ca.cidx);
+    if (adat->ctd.xi.nat_flags) {
+      llb_nat_dec_act_sessions(adat->ctd.rid, adat->ctd.aid);
+    }
+    if ((adat->ca.act_type == DP_SET_SNAT ||
+         adat->ca.act_type == DP_SET_DNAT) && adat->nat_act.lcp) {
+      llb_nat_lcp_dec(adat->nat_act.sidx);
+    }
+
+    if (!adat->ctd.pi.frag) {
+      ll_send_ctep_reset(&xkey, &axdat);
+      llb_maptrace_uhook(LL_DP_CT_MAP, 0, &xkey, sizeof(xkey), NULL, 0);
+      bpf_map_delete_elem(t->map_fd, &xkey);
+      dp_ct_related_fc_rm(&xkey);
+      llb_clear_map_stats(LL_DP_CT_STATS_MAP, axdat.ca.cidx);
+      llb_ctidx_del(&xkey);
+    }
+    dp_ct_related_fc_rm(key);
+    llb_ctidx_del(key);
+    as->n_aged++;
+    return 1;
+  }
+
+alive:
+  /* Only entries which survived aging get (re)indexed */
+  llb_ctidx_add(key, dat->rid, dat->aid);
+  if (!adat->ctd.pi.frag) {
+    llb_ctidx_add(&xkey, axdat.ctd.rid, axdat.ctd.aid);
+  }
+
+#ifdef LLB_DP_CT_DEBUG
+  log_trace("ct f(%d) alive: #%s:%d -> %s:%d (%d)# "
+         "rid:%u est:%d nat:%d (Diff:%llus:TO:%llus,%d:%d)",
+         adat->ctd.pi.frag,
+         sstr, ntohs(key->sport),
+         dstr, ntohs(key->dport),
+         key->l4proto, dat->rid,
+         est, has_nat, (curr_ns - latest_ns)/1000000000,
+         to/1000000000,
+         used1, used2);
+#endif
+
+  return 0;
+}
+
+/*
+ * CT aging worker pool. The coordinator (aging thread) fetches a chunk of
+ * CT entries via batch lookup, splits it into shards by key hash and lets
+ * each worker run ll_ct_map_ent_has_aged() on its shard. Verdicts are then
+ * collected and the aged entries removed by a single batch delete. Only
+ * one direction of a CT pair is evaluated per pass (as->dir) and the
+ * reverse entry is removed from within the callback, so no two workers
+ * ever act on the same connection.
+ */
+typedef struct llb_ct_ager {
+  pthread_t thr;
+  int wid;
+  struct llb_ct_agep *p;
+  uint32_t *idx;
+  uint32_t nidx;
+  dp_map_ita_t it;
+  ct_arg_struct_t as;
+  struct dp_ct_ager_stats st;
+} llb_ct_ager_t;
+
+typedef struct llb_ct_agep {
+  int nw;
+  llb_ct_ager_t *w;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  pthread_cond_t dcv;
+  uint64_t gen;
+  uint32_t pending;
+  int stop;
+  int tid;
+  dp_map_walker_t cb;
+  uint8_t *keys;
+  uint8_t *vals;
+  uint8_t *res;
+  size_t key_sz;
+  size_t val_sz;
+} llb_ct_agep_t;
+
+static void *
+ll_ct_ager_main(void *arg)
+{
+  llb_ct_ager_t *w = arg;
+  llb_ct_agep_t *p = w->p;
+  uint64_t gen = 0;
+  uint64_t sts;
+  uint32_t e;
+  uint32_t i;
+
+  while (1) {
+    pthread_mutex_lock(&p->mtx);
+    while (p->gen == gen && !p->stop) {
+      pthread_cond_wait(&p->cv, &p->mtx);
+    }
+    if (p->stop) {
+      pthread_mutex_unlock(&p->mtx);
+      break;
+    }
+    gen = p->gen;
+    pthread_mutex_unlock(&p->mtx);
+
+    sts = get_os_nsecs();
+    for (i = 0; i < w->nidx; i++) {
+      e = w->idx[i];
+      w->it.next_key = p->keys + e*p->key_sz;
+      w->it.val = p->vals + e*p->val_sz;
+      p->res[e] = p->cb(p->tid, w->it.next_key, &w->it) ? 1 : 0;
+    }
+
+    pthread_mutex_lock(&p->mtx);
+    w->st.runs++;
+    w->st.visited += w->nidx;
+    w->st.aged += w->as.n_aged;
+    w->st.busy_ns += get_os_nsecs() - sts;
+    if (--p->pending == 0) {
+      pthread_cond_signal(&p->dcv);
+    }
+    pthread_mutex_unlock(&p->mtx);
+  }
+
+  return NULL;
+}
+
+static uint32_t
+ll_ct_ager_shard(const uint8_t *key, size_t key_sz, int nw)
+{
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < key_sz; i++) {
+    h = (h ^ key[i]) * 16777619U;
+  }
+
+  return h % nw;
+}
+
+/*
+ * ll_ct_age_chunk_eval_par - llb_map_chunk_eval_t which evaluates a chunk
+ * of CT entries in parallel across the aging worker pool.
+ */
+static uint32_t
+ll_ct_age_chunk_eval_par(int tid, dp_map_walker_t cb, dp_map_ita_t *it,
+                         uint8_t *keys, uint8_t *vals, uint32_t cnt,
+                         uint8_t *dkeys)
+{
+  llb_ct_agep_t *p = xh->ctap;
+  ct_arg_struct_t *as = it->uarg;
+  llb_ct_ager_t *w;
+  uint32_t nd = 0;
+  uint32_t i;
+  int n;
+
+  if (!p || cnt > xh->batch_sz) {
+    return llb_map_chunk_eval_seq(tid, cb, it, keys, vals, cnt, dkeys);
+  }
+
+  for (n = 0; n < p->nw; n++) {
+    w = &p->w[n];
+    w->nidx = 0;
+    w->it = *it;
+    w->as = *as;
+    w->as.n_aged = 0;
+    w->it.uarg = &w->as;
+  }
+
+  for (i = 0; i < cnt; i++) {
+    w = &p->w[ll_ct_ager_shard(keys + i*it->key_sz, it->key_sz, p->nw)];
+    w->idx[w->nidx++] = i;
+  }
+
+  pthread_mutex_lock(&p->mtx);
+  p->tid = tid;
+  p->cb = cb;
+  p->keys = keys;
+  p->vals = vals;
+  p->key_sz = it->key_sz;
+  p->val_sz = it->val_sz;
+  p->pending = p->nw;
+  p->gen++;
+  pthread_cond_broadcast(&p->cv);
+  while (p->pending) {
+    pthread_cond_wait(&p->dcv, &p->mtx);
+  }
+  pthread_mutex_unlock(&p->mtx);
+
+  for (n = 0; n < p->nw; n++) {
+    as->n_aged += p->w[n].as.n_aged;
+  }
+
+  for (i = 0; i < cnt; i++) {
+    if (p->res[i]) {
+      memcpy(dkeys + nd*it->key_sz, keys + i*it->key_sz, it->key_sz);
+      nd++;
+    }
+  }
+
+  return nd;
+}
+
+static void
+ll_ct_ager_free(llb_ct_agep_t *p, int nw)
+{
+  int n;
+
+  if (p->w) {
+    for (n = 0; n < nw; n++) {
+      if (p->w[n].idx) free(p->w[n].idx);
+    }
+    free(p->w);
+  }
+  if (p->res) free(p->res);
+  free(p);
+}
+
+static int
+ll_ct_ager_init(int nw)
+{
+  llb_ct_agep_t *p;
+  int n, i;
+
+  p = calloc(1, sizeof(*p));
+  if (!p) return -ENOMEM;
+
+  p->w = calloc(nw, sizeof(*p->w));
+  p->res = calloc(xh->batch_sz, sizeof(*p->res));
+  if (!p->w || !p->res) {
+    ll_ct_ager_free(p, nw);
+    return -ENOMEM;
+  }
+
+  for (n = 0; n < nw; n++) {
+    p->w[n].wid = n;
+    p->w[n].p = p;
+    p->w[n].idx = calloc(xh->batch_sz, sizeof(*p->w[n].idx));
+    if (!p->w[n].idx) {
+      ll_ct_ager_free(p, nw);
+      return -ENOMEM;
+    }
+  }
+
+  pthread_mutex_init(&p->mtx, NULL);
+  pthread_cond_init(&p->cv, NULL);
+  pthread_cond_init(&p->dcv, NULL);
+  p->nw = nw;
+
+  for (n = 0; n < nw; n++) {
+    if (pthread_create(&p->w[n].thr, NULL, ll_ct_ager_main, &p->w[n]) != 0) {
+      /* Stop the started workers, aging runs single-threaded */
+      log_error("ct-ager: failed to start worker %d", n);
+      pthread_mutex_lock(&p->mtx);
+      p->stop = 1;
+      pthread_cond_broadcast(&p->cv);
+      pthread_mutex_unlock(&p->mtx);
+      for (i = 0; i < n; i++) {
+        pthread_join(p->w[i].thr, NULL);
+      }
+      pthread_cond_destroy(&p->dcv);
+      pthread_cond_destroy(&p->cv);
+      pthread_mutex_destroy(&p->mtx);
+      ll_ct_ager_free(p, nw);
+      return -EFAULT;
+    }
+  }
+
+  /* Publish only a fully started pool */
+  xh->ctap = p;
+
+  log_info("ct-ager: %d workers", nw);
+  return 0;
+}
+
+int
+llb_get_ct_ager_stats(struct dp_ct_ager_stats *st, int max)
+{
+  llb_ct_agep_t *p = xh->ctap;
+  int n;
+
+  if (!st || max <= 0) return -EINVAL;
+
+  if (!p) return 0;
+
+  pthread_mutex_lock(&p->mtx);
+  for (n = 0; n < p->nw && n < max; n++) {
+    memcpy(&st[n], &p->w[n].st, sizeof(*st));
+  }
+  pthread_mutex_unlock(&p->mtx);
+
+  return n;
+}
+
+/*
+ * ll_age_ctmap_sweep - Single full pass over CT map, evaluated by the
+ * worker pool if one is configured.
+ */
+static void
+ll_age_ctmap_sweep(dp_map_ita_t *it)
+{
+  llb_map_cursor_t cur;
+
+  if (!xh->ctap) {
+    llb_map_loop_and_delete_batch(LL_DP_CT_MAP, ll_ct_map_ent_has_aged, it);
+    return;
+  }
+
+  memset(&cur, 0, sizeof(cur));
+  llb_map_walk_slice(LL_DP_CT_MAP, ll_ct_map_ent_has_aged, it, &cur, 0, 0,
+                     ll_ct_age_chunk_eval_par);
+}
+
+/* Stats id ranges checked by one llb_nat_xr_drain() run */
+#define LLB_NAT_XR_DCHK_MAX (64)
+
+typedef struct llb_nat_xr_dchk {
+  uint32_t base[LLB_NAT_XR_DCHK_MAX];
+  uint32_t sz[LLB_NAT_XR_DCHK_MAX];
+  int busy[LLB_NAT_XR_DCHK_MAX];
+  int n;
+} llb_nat_xr_dchk_t;
+
+static int
+ll_ct_map_ent_in_dchk(int tid, void *k, void *ita)
+{
+  dp_map_ita_t *it = ita;
+  llb_nat_xr_dchk_t *dc;
+  struct dp_ct_tact *adat;
+  uint32_t sidx;
+  int i;
+
+  if (!it || !it->uarg || !it->val) return 0;
+
+  dc = it->uarg;
+  adat = it->val;
+
+  if (adat->ca.act_type != DP_SET_SNAT && adat->ca.act_type != DP_SET_DNAT) {
+    return 0;
+  }
+
+  sidx = adat->nat_act.sidx;
+  for (i = 0; i < dc->n; i++) {
+    if (sidx >= dc->base[i] && sidx < dc->base[i] + dc->sz[i]) {
+      dc->busy[i] = 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * llb_nat_xr_drain - Free drain ranges past the grace period which no CT
+ * entry counts under anymore. Packets which saw the old rule have set up
+ * their CT entries by the end of the grace period, so one walk of ct_map
+ * is enough. Run by the CT ager after a full cycle, with neither NAT nor
+ * CT map lock held.
+ */
+static void
+llb_nat_xr_drain(void)
+{
+  llb_nat_xr_dchk_t *dc;
+  llb_nat_xr_gc_t *g;
+  struct dp_ct_key next_key;
+  struct dp_ct_tact *adat;
+  dp_map_ita_t it;
+  uint64_t ts = get_os_nsecs();
+  int i, j, d;
+
+  dc = calloc(1, sizeof(*dc));
+  if (!dc) return;
+
+  llb_map_lock(LL_DP_NAT_MAP);
+  for (i = 0; i < xh->nat_xgc_n && dc->n < LLB_NAT_XR_DCHK_MAX; i++) {
+    g = &xh->nat_xgc[i];
+    if (g->drain && ts - g->ts >= LLB_NAT_XR_GRACE_NS) {
+      dc->base[dc->n] = g->base;
+      dc->sz[dc->n++] = g->sz;
+    }
+  }
+  llb_map_unlock(LL_DP_NAT_MAP);
+
+  if (dc->n == 0) {
+    free(dc);
+    return;
+  }
+
+  adat = calloc(1, sizeof(*adat));
+  if (!adat) {
+    free(dc);
+    return;
+  }
+
+  memset(&it, 0, sizeof(it));
+  it.next_key = &next_key;
+  it.key_sz = sizeof(next_key);
+  it.val = adat;
+  it.val_sz = sizeof(*adat);
+  it.uarg = dc;
+
+  llb_map_lock(LL_DP_CT_MAP);
+  llb_map_loop_and_delete_batch(LL_DP_CT_MAP, ll_ct_map_ent_in_dchk, &it);
+  llb_map_unlock(LL_DP_CT_MAP);
+
+  llb_map_lock(LL_DP_NAT_MAP);
+  for (d = 0; d < dc->n; d++) {
+    if (dc->busy[d]) continue;
+    for (i = 0, j = 0; i < xh->nat_xgc_n; i++) {
+      g = &xh->nat_xgc[i];
+      if (g->drain && g->base == dc->base[d] && g->bm == xh->nat_sbm) {
+        log_info("nat: stats ids %u/%u drained", g->base, g->sz);
+        llb_nat_xr_free(g->bm, g->base, g->sz);
+      } else {
+        xh->nat_xgc[j++] = *g;
+      }
+    }
+    xh->nat_xgc_n = j;
+  }
+  llb_map_unlock(LL_DP_NAT_MAP);
+
+  free(adat);
+  free(dc);
+}
+
+static void
+ll_age_ctmap_cycle_done(uint64_t ns, uint32_t aged)
+{
+  struct dp_ct_age_stats *st = &xh->ct_age_st;
+
+  /* The in-kernel sweeper doesn't refresh index entries of live CT
+   * entries, stale ones are dropped when found missing from ct_map
+   */
+  if (!xh->ctsw_rb) llb_ctidx_purge(0);
+  xh->ctidx_ok = xh->have_mtrace && !xh->ctidx_lost;
+  xh->ctidx_lost = 0;
+  xh->nat_sdr_chk = 1;
+
+  st->cycles++;
+  st->last_cycle_ns = ns - xh->ct_cycle_sts;
+  st->last_aged = aged;
+  st->visited = 0;
+  st->aged = 0;
+  xh->ct_cycle_sts = ns;
+}
+
+/*
+ * ll_age_ctmap_slice - Incremental CT aging. Each call resumes the sweep
+ * from a persistent cursor and processes at most xh->ct_slice_ents entries
+ * or xh->ct_slice_us microseconds before giving up the locks. A CT_DIR_OUT
+ * sweep is scheduled after a CT_DIR_IN sweep every 120s as in full mode.
+ */
+static void
+ll_age_ctmap_slice(dp_map_ita_t *it, ct_arg_struct_t *as)
+{
+  llb_map_cursor_t *cur = &xh->ct_cur;
+  struct dp_ct_age_stats *st = &xh->ct_age_st;
+  uint32_t ovisit = cur->nvisit;
+
+  as->dir = xh->ct_age_dir;
+  llb_map_walk_slice(LL_DP_CT_MAP, ll_ct_map_ent_has_aged, it, cur,
+                     xh->ct_slice_ents, xh->ct_slice_us,
+                     xh->ctap ? ll_ct_age_chunk_eval_par : NULL);
+
+  st->visited += cur->nvisit - ovisit;
+  st->aged += as->n_aged;
+  st->dir = xh->ct_age_dir;
+  st->slices++;
+
+  if (!cur->done) {
+    return;
+  }
+
+  memset(cur, 0, sizeof(*cur));
+  if (xh->ct_age_dir == CT_DIR_IN &&
+      as->curr_ns - xh->lctts > 120000000000) {
+    xh->ct_age_dir = CT_DIR_OUT;
+    return;
   }
 
-  if (adat->ctd.xi.nat_flags) {
-    has_nat = true;
+  if (xh->ct_age_dir == CT_DIR_OUT) {
+    xh->lctts = as->curr_ns;
   }
+  xh->ct_age_dir = CT_DIR_IN;
+  ll_age_ctmap_cycle_done(as->curr_ns, st->aged);
+}
 
-  ctm_proto_xfk_init(key, adat, &xkey, &okey);
+/*
+ * In-kernel CT sweeper - llb_kern_ctsweep.o walks ct_map with
+ * bpf_for_each_map_elem() applying the same rules as
+ * ll_ct_map_ent_has_aged(), deletes aged pairs and their FC entries and
+ * queues what is left to do here (resets, stats, NAT sessions) on a ring
+ * buffer. A sweep costs one program run instead of a syscall per entry.
+ */
+#define LLB_CT_SWEEP_MAX_RUNS (64)
 
-  t = &xh->maps[LL_DP_CT_MAP];
+static int
+ll_ct_sweep_ev(void *ctx, void *data, size_t size)
+{
+  struct dp_ct_sweep_ev *ev = data;
 
-  if (adat->ctd.pi.frag) {
-    memset(&axdat, 0, sizeof(axdat));
-  } else if (bpf_map_lookup_elem(t->map_fd, &xkey, &axdat) != 0) {
-    if (key->v6 == 0) {
-      inet_ntop(AF_INET, xkey.saddr, sstr, INET_ADDRSTRLEN);
-      inet_ntop(AF_INET, xkey.daddr, dstr, INET_ADDRSTRLEN);
-    } else {
-      inet_ntop(AF_INET6, xkey.saddr, sstr, INET6_ADDRSTRLEN);
-      inet_ntop(AF_INET6, xkey.daddr, dstr, INET6_ADDRSTRLEN);
-    }
+  if (size < sizeof(*ev)) return 0;
 
-    ll_ct_get_state(&xkey, &axdat, &est, &to, &bidir);
+  if (ev->flags & LLB_CT_SWEEP_EV_RST) {
+    ll_send_ctep_rst(&ev->key, ev->seq);
+  }
+  if (ev->flags & LLB_CT_SWEEP_EV_NAT) {
+    llb_nat_dec_act_sessions(ev->rid, ev->aid);
+  }
+  if (ev->flags & LLB_CT_SWEEP_EV_LCP) {
+    llb_nat_lcp_dec(ev->sidx);
+  }
+  llb_clear_map_stats(LL_DP_CT_STATS_MAP, ev->cidx);
+  llb_maptrace_uhook(LL_DP_CT_MAP, 0, &ev->key, sizeof(ev->key), NULL, 0);
+  llb_ctidx_del(&ev->key);
 
-    if (est && curr_ns - adat->lts < CT_MISMATCH_FN_CPTO) {
-      return 0;
+  if (ev->flags & LLB_CT_SWEEP_EV_X) {
+    if (ev->flags & LLB_CT_SWEEP_EV_XRST) {
+      ll_send_ctep_rst(&ev->xkey, ev->xseq);
     }
+    llb_clear_map_stats(LL_DP_CT_STATS_MAP, ev->xcidx);
+    llb_maptrace_uhook(LL_DP_CT_MAP, 0, &ev->xkey, sizeof(ev->xkey), NULL, 0);
+    llb_ctidx_del(&ev->xkey);
+  }
 
-    dp_ct_related_fc_rm(key);
+  return 0;
+}
 
-    log_trace("ct: rdir not found #%s:%d -> %s:%d (%d)#",
-         sstr, ntohs(xkey.sport),
-         dstr, ntohs(xkey.dport),
-         xkey.l4proto);
-    llb_clear_map_stats(LL_DP_CT_STATS_MAP, adat->ca.cidx);
-    return 1;
-  }
+static int
+llb_setup_ct_sweep(void)
+{
+  static const struct { const char *name; int tid; } rmaps[] = {
+    { "ct_map", LL_DP_CT_MAP },
+    { "ct_stats_map", LL_DP_CT_STATS_MAP },
+    { "fc_v4_map", LL_DP_FCV4_MAP },
+    { "fc_v6_map", LL_DP_FCV6_MAP },
+  };
+  struct bpf_object *obj;
+  struct bpf_program *prog;
+  struct bpf_map *map;
+  struct ring_buffer *rb;
+  int i;
 
-  if (adat->lts > axdat.lts) {
-    latest_ns = adat->lts;
-  } else {
-    latest_ns = axdat.lts;
+  obj = bpf_object__open_file(LLB_CT_SWEEP_IMG_BPF, NULL);
+  if (libbpf_get_error(obj)) {
+    log_error("ct-sweep: failed to open BPF object");
+    return -1;
   }
 
-  llb_fetch_map_stats_cached(LL_DP_CT_STATS_MAP, adat->ca.cidx, 1, &bytes, &pkts);
-  llb_fetch_map_stats_cached(LL_DP_CT_STATS_MAP, axdat.ca.cidx, 1, &bytes, &pkts);
+  for (i = 0; i < sizeof(rmaps)/sizeof(rmaps[0]); i++) {
+    map = bpf_object__find_map_by_name(obj, rmaps[i].name);
+    if (!map || bpf_map__reuse_fd(map, xh->maps[rmaps[i].tid].map_fd)) {
+      log_error("ct-sweep: failed to reuse %s", rmaps[i].name);
+      goto err;
+    }
+  }
 
-  ll_ct_get_state(key, adat, &est, &to, &bidir);
+  if (bpf_object__load(obj)) {
+    log_error("ct-sweep: failed to load BPF object");
+    goto err;
+  }
 
-  if (curr_ns < latest_ns) return 0;
+  prog = bpf_object__find_program_by_name(obj, "llb_ct_sweep");
+  map = bpf_object__find_map_by_name(obj, "ct_sweep_ev_map");
+  if (!prog || !map) {
+    log_error("ct-sweep: program or event map not found");
+    goto err;
+  }
 
-  if (est && adat->ito != 0) {
-    to = adat->ito;
+  rb = ring_buffer__new(bpf_map__fd(map), ll_ct_sweep_ev, NULL, NULL);
+  if (libbpf_get_error(rb)) {
+    log_error("ct-sweep: failed to setup ring buffer");
+    goto err;
   }
 
-  /* CT is allocated both for current and reverse direction */
-  llb_fetch_map_stats_used(LL_DP_CT_STATS_MAP, adat->ca.cidx, 1, &used1);
-  llb_fetch_map_stats_used(LL_DP_CT_STATS_MAP, axdat.ca.cidx, 1, &used2);
+  xh->ctsw_obj = obj;
+  xh->ctsw_fd = bpf_program__fd(prog);
+  xh->ctsw_rb = rb;
 
-  if (bidir) {
-    any_used = used1 && used2;
-  } else {
-    any_used = used1 || used2;
-  }
+  log_info("ct-sweep: in-kernel CT sweeper loaded");
+  return 0;
 
-  if (curr_ns - latest_ns > to && (!est || !any_used)) {
-    log_trace("ct: #%s:%d -> %s:%d (%d)# rid:%u est:%d nat:%d (Aged:%lluns:%d:%d)",
-         sstr, ntohs(key->sport),
-         dstr, ntohs(key->dport),  
-         key->l4proto, dat->rid,
-         est, has_nat, curr_ns - latest_ns,
-         used1, used2);
-    ll_send_ctep_reset(key, adat);
-    llb_clear_map_stats(LL_DP_CT_STATS_MAP, adat->ca.cidx);
-    if (adat->ctd.xi.nat_flags) {
-      llb_nat_dec_act_sessions(adat->ctd.rid, adat->ctd.aid);
-    }
+err:
+  bpf_object__close(obj);
+  return -1;
+}
 
-    if (!adat->ctd.pi.frag) {
-      ll_send_ctep_reset(&xkey, &axdat);
-      llb_maptrace_uhook(LL_DP_CT_MAP, 0, &xkey, sizeof(xkey), NULL, 0);
-      bpf_map_delete_elem(t->map_fd, &xkey);
-      dp_ct_related_fc_rm(&xkey);
-      llb_clear_map_stats(LL_DP_CT_STATS_MAP, axdat.ca.cidx);
+/*
+ * ll_age_ctmap_ksweep - One in-kernel sweep of dir. A run walks all of
+ * ct_map but stops early if the ring buffer fills up, so it is run again
+ * once events are drained. Runs of a sweep share its timestamp, so flows
+ * looked at again get the same used flag. Called with CT map lock held.
+ */
+static uint32_t
+ll_age_ctmap_ksweep(uint64_t ns, int dir)
+{
+  struct dp_ct_sweep_arg a;
+  uint32_t aged = 0;
+  int n;
+
+  for (n = 0; n < LLB_CT_SWEEP_MAX_RUNS; n++) {
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+      .ctx_in = &a,
+      .ctx_size_in = sizeof(a),
+    );
+
+    memset(&a, 0, sizeof(a));
+    a.now = ns;
+    a.nr_cpus = bpf_num_possible_cpus();
+    a.dir = dir;
+
+    if (bpf_prog_test_run_opts(xh->ctsw_fd, &opts) != 0) {
+      log_error("ct-sweep: run failed (%d)", errno);
+      break;
     }
-    dp_ct_related_fc_rm(key);
-    return 1;
+
+    ring_buffer__consume(xh->ctsw_rb);
+
+    xh->ct_age_st.visited += a.visited;
+    xh->ct_age_st.aged += a.aged;
+    aged += a.aged;
+
+    if (!a.ev_full) break;
   }
 
-#ifdef LLB_DP_CT_DEBUG
-  log_trace("ct f(%d) alive: #%s:%d -> %s:%d (%d)# "
-         "rid:%u est:%d nat:%d (Diff:%llus:TO:%llus,%d:%d)",
-         adat->ctd.pi.frag,
-         sstr, ntohs(key->sport),
-         dstr, ntohs(key->dport),
-         key->l4proto, dat->rid,
-         est, has_nat, (curr_ns - latest_ns)/1000000000,
-         to/1000000000,
-         used1, used2);
-#endif
+  return aged;
+}
 
-  return 0;
+/*
+ * ll_age_ctmap_drain - Check NAT stats id ranges being drained once per
+ * full CT aging cycle
+ */
+static void
+ll_age_ctmap_drain(void)
+{
+  if (!xh->nat_sdr_chk) return;
+  xh->nat_sdr_chk = 0;
+  llb_nat_xr_drain();
 }
 
 static void
@@ -2993,23 +7057,106 @@ ll_age_ctmap(void)
   it.next_key = &next_key;
   it.key_sz = sizeof(next_key);
   it.val = adat;
+  it.val_sz = sizeof(*adat);
   it.uarg = as;
 
-  XH_LOCK();
   if (lost > 0) {
-    log_error("PerfBuf Lost count %lu", lost);
-    lost = 0;
+    log_error("PerfBuf Lost count %lu", __sync_fetch_and_and(&lost, 0));
+  }
+
+  XH_RD_LOCK();
+  llb_map_lock(LL_DP_CT_MAP);
+  if (xh->ctsw_rb) {
+    xh->ct_cycle_sts = ns;
+    as->n_aged = ll_age_ctmap_ksweep(ns, CT_DIR_IN);
+    if (ns - xh->lctts > 120000000000) {
+      as->n_aged += ll_age_ctmap_ksweep(ns, CT_DIR_OUT);
+      xh->lctts = ns;
+    }
+    xh->ct_age_st.slices++;
+    ll_age_ctmap_cycle_done(get_os_nsecs(), as->n_aged);
+    llb_map_unlock(LL_DP_CT_MAP);
+    XH_UNLOCK();
+    free(adat);
+    free(as);
+    ll_age_ctmap_drain();
+    return;
+  }
+
+  if (xh->ct_slice_ents || xh->ct_slice_us) {
+    ll_age_ctmap_slice(&it, as);
+    llb_map_unlock(LL_DP_CT_MAP);
+    XH_UNLOCK();
+    free(adat);
+    free(as);
+    ll_age_ctmap_drain();
+    return;
   }
 
-  llb_map_loop_and_delete(LL_DP_CT_MAP, ll_ct_map_ent_has_aged, &it);
+  xh->ct_cycle_sts = ns;
+  ll_age_ctmap_sweep(&it);
   if (ns - xh->lctts > 120000000000) {
     as->dir = CT_DIR_OUT;
-    llb_map_loop_and_delete(LL_DP_CT_MAP, ll_ct_map_ent_has_aged, &it);
+    ll_age_ctmap_sweep(&it);
     xh->lctts = ns;
   }
+  xh->ct_age_st.slices++;
+  ll_age_ctmap_cycle_done(get_os_nsecs(), as->n_aged);
+  llb_map_unlock(LL_DP_CT_MAP);
   XH_UNLOCK();
   if (adat) free(adat);
   if (as) free(as);
+  ll_age_ctmap_drain();
+}
+
+int
+llb_get_ct_age_stats(struct dp_ct_age_stats *st)
+{
+  if (!st) return -EINVAL;
+
+  XH_RD_LOCK();
+  llb_map_lock(LL_DP_CT_MAP);
+  memcpy(st, &xh->ct_age_st, sizeof(*st));
+  if (xh->ct_cur.started) {
+    st->cur_cycle_ns = get_os_nsecs() - xh->ct_cycle_sts;
+  }
+  llb_map_unlock(LL_DP_CT_MAP);
+  XH_UNLOCK();
+
+  return 0;
+}
+
+int
+llb_set_fw_engine(int engine)
+{
+  int ret = 0;
+
+  if (engine != LLB_FW_ENGINE_LINEAR && engine != LLB_FW_ENGINE_TSS) {
+    return -EINVAL;
+  }
+
+  XH_LOCK();
+  if (xh->fw_engine != engine) {
+    xh->fw_engine = engine;
+    if (!xh->have_noebpf) {
+      ret = llb_fw_commit(LL_DP_FW4_MAP);
+    }
+  }
+  XH_UNLOCK();
+
+  return ret;
+}
+
+void
+llb_set_ct_age_slice(uint32_t max_ents, uint32_t max_us)
+{
+  XH_LOCK();
+  xh->ct_slice_ents = max_ents;
+  xh->ct_slice_us = max_us;
+  memset(&xh->ct_cur, 0, sizeof(xh->ct_cur));
+  xh->ct_age_dir = CT_DIR_IN;
+  xh->ct_cycle_sts = get_os_nsecs();
+  XH_UNLOCK();
 }
 
 void
@@ -3030,6 +7177,7 @@ llb_age_map_entries(int tbl)
   XH_MPLOCK();
   switch (tbl) {
   case LL_DP_FCV4_MAP:
+  case LL_DP_FCV6_MAP:
     ll_age_fcmap();
     break;
   case LL_DP_CT_MAP:
@@ -3060,6 +7208,21 @@ llb_trigger_get_proxy_entries(void)
   proxy_dump_entry(llb_dump_proxy_entry_single);
 }
 
+/*
+ * ll_ct_related_fc_rm_cidx - Remove FC entries related to a CT entry. The
+ * cidx index is used when it can be trusted, else cidx is queued in cs
+ * for a single walk of the fc maps once the CT walk is over.
+ */
+static void
+ll_ct_related_fc_rm_cidx(struct dp_ct_key *key, uint32_t cidx,
+                         ll_cidx_set_t *cs)
+{
+  dp_ct_related_fc_rm(key);
+  if (llb_fcidx_del_cidx(cidx) != 0) {
+    ll_cidx_set_add(cs, cidx);
+  }
+}
+
 static int
 ll_ct_map_ent_rm_related(int tid, void *k, void *ita)
 {
@@ -3095,10 +7258,10 @@ ll_ct_map_ent_rm_related(int tid, void *k, void *ita)
          dstr, ntohs(key->dport),
          key->l4proto);
 
-      if (!key->v6) {
-        llb_del_map_elem_with_cidx(LL_DP_FCV4_MAP, adat->ca.cidx);
-      }
+      ll_ct_related_fc_rm_cidx(key, adat->ca.cidx, &as->fcs);
       llb_clear_map_stats(LL_DP_CT_STATS_MAP, adat->ca.cidx);
+      llb_ctidx_del(key);
+      as->n_rm++;
 
       return 1;
     }
@@ -3107,22 +7270,69 @@ ll_ct_map_ent_rm_related(int tid, void *k, void *ita)
   return 0;
 }
 
+/*
+ * ll_map_ct_rm_related_idx - Remove CT entries of (as->rid, as->aid[])
+ * using the (rid, aid) index. Each indexed key is re-validated against
+ * ct_map before removal. Returns -1 if the index can't be used.
+ */
 static int
-ll_ct_map_ent_rm_any(int tid, void *k, void *ita)
+ll_map_ct_rm_related_idx(dp_map_ita_t *it)
 {
-  struct dp_ct_key *key = k;
-  dp_map_ita_t *it = ita;
-  struct dp_ct_tact *adat;
-
-  if (!it|| !it->uarg || !it->val) return 0;
+  ct_arg_struct_t *as = it->uarg;
+  llb_dp_map_t *t = &xh->maps[LL_DP_CT_MAP];
+  struct dp_ct_key *keys;
+  uint32_t visited = 0;
+  int n;
+  int i, j;
+
+  if (!xh->ctidx_ok || xh->have_noebpf) {
+    return -1;
+  }
 
-  adat = it->val;
+  for (i = 0; i < as->n_aids; i++) {
+    n = llb_ctidx_get_keys(as->rid, as->aid[i], &keys);
+    if (n < 0) {
+      return -1;
+    }
 
-  if (!key->v6) {
-    llb_del_map_elem_with_cidx(LL_DP_FCV4_MAP, adat->ca.cidx);
+    for (j = 0; j < n; j++) {
+      visited++;
+      memcpy(it->next_key, &keys[j], sizeof(keys[j]));
+      if (bpf_map_lookup_elem(t->map_fd, &keys[j], it->val) != 0) {
+        llb_ctidx_del(&keys[j]);
+        continue;
+      }
+      if (ll_ct_map_ent_rm_related(LL_DP_CT_MAP, it->next_key, it)) {
+        llb_maptrace_uhook(LL_DP_CT_MAP, 0, &keys[j], sizeof(keys[j]),
+                           NULL, 0);
+        bpf_map_delete_elem(t->map_fd, &keys[j]);
+      }
+    }
+    if (keys) free(keys);
   }
-  llb_clear_map_stats(LL_DP_CT_STATS_MAP, adat->ca.cidx);
-  return 1;
+
+  pthread_mutex_lock(&xh->ctidx_lock);
+  xh->ctidx_st.idx_rm++;
+  xh->ctidx_st.visited += visited;
+  xh->ctidx_st.removed += as->n_rm;
+  pthread_mutex_unlock(&xh->ctidx_lock);
+
+  return 0;
+}
+
+int
+llb_get_ct_ridx_stats(struct dp_ct_ridx_stats *st)
+{
+  if (!st) return -EINVAL;
+
+  pthread_mutex_lock(&xh->ctidx_lock);
+  memcpy(st, &xh->ctidx_st, sizeof(*st));
+  st->entries = HASH_COUNT(xh->ctidx);
+  st->sets = HASH_COUNT(xh->ctidx_sets);
+  st->active = xh->ctidx_ok;
+  pthread_mutex_unlock(&xh->ctidx_lock);
+
+  return 0;
 }
 
 static void
@@ -3150,6 +7360,7 @@ ll_map_ct_rm_related(uint32_t rid, uint32_t *aids, int naid)
   it.next_key = &next_key;
   it.key_sz = sizeof(next_key);
   it.val = adat;
+  it.val_sz = sizeof(*adat);
   it.uarg = as;
 
   as->rid = rid;
@@ -3158,19 +7369,124 @@ ll_map_ct_rm_related(uint32_t rid, uint32_t *aids, int naid)
   }
   as->n_aids = naid;
 
-  llb_map_loop_and_delete(LL_DP_CT_MAP, ll_ct_map_ent_rm_related, &it);
+  llb_map_lock(LL_DP_CT_MAP);
+  if (ll_map_ct_rm_related_idx(&it) != 0) {
+    llb_map_loop_and_delete_batch(LL_DP_CT_MAP, ll_ct_map_ent_rm_related, &it);
+    pthread_mutex_lock(&xh->ctidx_lock);
+    xh->ctidx_st.scan_rm++;
+    xh->ctidx_st.removed += as->n_rm;
+    pthread_mutex_unlock(&xh->ctidx_lock);
+  }
+  llb_map_unlock(LL_DP_CT_MAP);
+  llb_del_map_elem_with_cidx_set(LL_DP_FCV4_MAP, &as->fcs);
+  llb_del_map_elem_with_cidx_set(LL_DP_FCV6_MAP, &as->fcs);
+  if (as->fcs.cidx) free(as->fcs.cidx);
   if (adat) free(adat);
   if (as) free(as);
 }
 
+/*
+ * ll_ct_key_fw_match - Check if a CT entry's flow could be matched by the
+ * firewall rule key fk. Fields which are not part of the CT key (inport,
+ * bd) are treated as wildcards so the result errs on the side of a match.
+ */
+static int
+ll_ct_key_fw_match(struct dp_ct_key *key, pdi_key_t *fk, int v6)
+{
+  if (key->v6 != v6) {
+    return 0;
+  }
+
+  if (!v6) {
+    struct pdi_key k;
+
+    memset(&k, 0, sizeof(k));
+    PDI_VAL_INIT(&k.dest, ntohl(key->daddr[0]));
+    PDI_VAL_INIT(&k.source, ntohl(key->saddr[0]));
+    PDI_RVAL_INIT(&k.dport, ntohs(key->dport));
+    PDI_RVAL_INIT(&k.sport, ntohs(key->sport));
+    PDI_VAL_INIT(&k.protocol, key->l4proto);
+    PDI_VAL_INIT(&k.zone, key->zone);
+
+    return PDI_MATCH(&k.dest, &fk->k4.dest) &&
+           PDI_MATCH(&k.source, &fk->k4.source) &&
+           PDI_RMATCH(&k.dport, &fk->k4.dport) &&
+           PDI_RMATCH(&k.sport, &fk->k4.sport) &&
+           PDI_MATCH(&k.protocol, &fk->k4.protocol) &&
+           PDI_MATCH(&k.zone, &fk->k4.zone);
+  } else {
+    struct pdi6_key k;
+
+    memset(&k, 0, sizeof(k));
+    PDI_VAL6_INIT(&k.dest, key->daddr);
+    PDI_VAL6_INIT(&k.source, key->saddr);
+    PDI_RVAL_INIT(&k.dport, ntohs(key->dport));
+    PDI_RVAL_INIT(&k.sport, ntohs(key->sport));
+    PDI_VAL_INIT(&k.protocol, key->l4proto);
+    PDI_VAL_INIT(&k.zone, key->zone);
+
+    return PDI_MATCH6(&k.dest, &fk->k6.dest) &&
+           PDI_MATCH6(&k.source, &fk->k6.source) &&
+           PDI_RMATCH(&k.dport, &fk->k6.dport) &&
+           PDI_RMATCH(&k.sport, &fk->k6.sport) &&
+           PDI_MATCH(&k.protocol, &fk->k6.protocol) &&
+           PDI_MATCH(&k.zone, &fk->k6.zone);
+  }
+}
+
+static int
+ll_ct_map_ent_rm_fw_related(int tid, void *k, void *ita)
+{
+  struct dp_ct_key *key = k;
+  dp_map_ita_t *it = ita;
+  struct dp_ct_tact *adat;
+  struct dp_ct_tact axdat;
+  struct dp_ct_key xkey;
+  struct dp_ct_key okey;
+  ct_arg_struct_t *as;
+  llb_dp_map_t *t;
+
+  if (!it|| !it->uarg || !it->val) return 0;
+
+  as = it->uarg;
+  adat = it->val;
+
+  if (!ll_ct_key_fw_match(key, &as->fwk, as->fwv6)) {
+    return 0;
+  }
+
+  /* Both directions need to go as the verdict might change either way */
+  t = &xh->maps[LL_DP_CT_MAP];
+  ctm_proto_xfk_init(key, adat, &xkey, &okey);
+  if (!adat->ctd.pi.frag &&
+      bpf_map_lookup_elem(t->map_fd, &xkey, &axdat) == 0) {
+    llb_maptrace_uhook(LL_DP_CT_MAP, 0, &xkey, sizeof(xkey), NULL, 0);
+    bpf_map_delete_elem(t->map_fd, &xkey);
+    ll_ct_related_fc_rm_cidx(&xkey, axdat.ca.cidx, &as->fcs);
+    llb_clear_map_stats(LL_DP_CT_STATS_MAP, axdat.ca.cidx);
+    llb_ctidx_del(&xkey);
+  }
+
+  ll_ct_related_fc_rm_cidx(key, adat->ca.cidx, &as->fcs);
+  llb_clear_map_stats(LL_DP_CT_STATS_MAP, adat->ca.cidx);
+  llb_ctidx_del(key);
+  as->n_rm++;
+
+  return 1;
+}
+
+/*
+ * ll_map_ct_rm_fw_related - Invalidate only the CT entries whose flows
+ * could be matched by a changed firewall rule, so that they are evaluated
+ * again by the firewall on next packet. Other flows stay untouched.
+ */
 static void
-ll_map_ct_rm_any(void)
+ll_map_ct_rm_fw_related(pdi_key_t *fk, int v6)
 {
   dp_map_ita_t it;
   struct dp_ct_key next_key;
   struct dp_ct_tact *adat;
   ct_arg_struct_t *as;
-  uint64_t ns = get_os_nsecs();
 
   adat = calloc(1, sizeof(*adat));
   if (!adat) return;
@@ -3181,17 +7497,26 @@ ll_map_ct_rm_any(void)
     return;
   }
 
-  as->curr_ns = ns;
+  as->curr_ns = get_os_nsecs();
+  as->fwv6 = v6;
+  memcpy(&as->fwk, fk, sizeof(*fk));
 
   memset(&it, 0, sizeof(it));
   it.next_key = &next_key;
   it.key_sz = sizeof(next_key);
   it.val = adat;
+  it.val_sz = sizeof(*adat);
   it.uarg = as;
 
-  llb_map_loop_and_delete(LL_DP_CT_MAP, ll_ct_map_ent_rm_any, &it);
-  if (adat) free(adat);
-  if (as) free(as);
+  llb_map_lock(LL_DP_CT_MAP);
+  llb_map_loop_and_delete_batch(LL_DP_CT_MAP, ll_ct_map_ent_rm_fw_related, &it);
+  llb_map_unlock(LL_DP_CT_MAP);
+  llb_del_map_elem_with_cidx_set(LL_DP_FCV4_MAP, &as->fcs);
+  llb_del_map_elem_with_cidx_set(LL_DP_FCV6_MAP, &as->fcs);
+  log_debug("fw change: ct invalidated %d", as->n_rm);
+  if (as->fcs.cidx) free(as->fcs.cidx);
+  free(adat);
+  free(as);
 }
 
 
@@ -3547,6 +7872,7 @@ int
 loxilb_main(struct ebpfcfg *cfg)
 {
   FILE *fp;
+  int i;
   libbpf_set_print(libbpf_print_fn);
 
   if (!cfg->have_noebpf) {
@@ -3555,6 +7881,15 @@ loxilb_main(struct ebpfcfg *cfg)
 
   xh = calloc(1, sizeof(*xh));
   assert(xh);
+  pthread_mutex_init(&xh->fcidx_lock, NULL);
+  pthread_mutex_init(&xh->nat_ep_lock, NULL);
+  pthread_mutex_init(&xh->ctidx_lock, NULL);
+  pthread_mutex_init(&xh->txn_lock, NULL);
+  pthread_mutex_init(&xh->lcp_lock, NULL);
+  pthread_mutex_init(&xh->nat_sr_lock, NULL);
+  for (i = 0; i < LL_DP_MAX_MAP; i++) {
+    pthread_rwlock_init(&xh->maps[i].lock, NULL);
+  }
 
   sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
 
@@ -3589,6 +7924,14 @@ loxilb_main(struct ebpfcfg *cfg)
     xh->lctts = get_os_nsecs();
     xh->lfcts = get_os_nsecs();
 
+    xh->batch_sz = cfg->map_batch_sz > 0 ? cfg->map_batch_sz : LLB_MAP_BATCH_SZ;
+    xh->ct_slice_ents = cfg->ct_age_slice_ents;
+    xh->ct_slice_us = cfg->ct_age_slice_us;
+    xh->ct_cycle_sts = get_os_nsecs();
+    xh->ct_age_workers = cfg->ct_age_workers;
+    xh->ct_ksweep = cfg->ct_age_kern;
+    xh->fw_engine = cfg->fw_engine;
+
     if (xh->have_noebpf) {
       xh->have_loader = 0;
       xh->have_mtrace = 0;
@@ -3601,6 +7944,18 @@ loxilb_main(struct ebpfcfg *cfg)
 
   llb_xh_init(xh);
 
+  if (xh->ct_age_workers > 1 && !xh->have_noebpf) {
+    ll_ct_ager_init(xh->ct_age_workers);
+  }
+
+  if (xh->ct_ksweep && !xh->have_noebpf && llb_setup_ct_sweep() != 0) {
+    log_warn("ct-sweep: falling back to userspace CT aging");
+  }
+
+  if (llb_mupd_init() != 0) {
+    log_error("map-upd: async updates not available");
+  }
+
   return 0;
 }
 
@@ -63,6 +63,12 @@ struct ebpfcfg {
   int have_sockrwr;
   int have_sockmap;
   int have_noebpf;
+  int map_batch_sz;
+  int ct_age_slice_ents;
+  int ct_age_slice_us;
+  int ct_age_workers;
+  int ct_age_kern;
+  int fw_engine;
 };
 
 void loxilb_set_loglevel(struct ebpfcfg *cfg);
@@ -0,0 +1,322 @@
+/*
+ * llb_fw_bench.c: Per-packet cost of the v4 firewall lookup engines
+ * Copyright (c) 2022-2025 LoxiLB Authors
+ *
+ * SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+ *
+ * Loads its own datapath (loxilb must not be running), installs 100, 1K
+ * and 8K wildcard rules and times the TC pipeline via BPF_PROG_TEST_RUN
+ * for a packet which misses every rule and one which hits only the last
+ * rule, once with the linear engine and once with TSS. The firewall is
+ * looked up only for packets without a CT entry, so every run uses a new
+ * source port. The cost of the rest of the pipeline is the same for both
+ * engines, so the "0 rules" row is the baseline to subtract. A time
+ * marked with '*' is of a run where some packets did not get the verdict
+ * of the rules (e.g. the linear walk of 8K rules runs out of tail calls).
+ *
+ * Built along with libloxilbdp (make -C kernel). Run as root:
+ *   ./llb_fw_bench [-r runs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/pkt_cls.h>
+#include "bpf.h"
+
+#include "../kernel/loxilb_libdp.h"
+
+#define FWB_MAX_RULES (8*1024)
+#define FWB_MAX_RUNS  (60000)
+#define FWB_SRC       0x0a010100 /* 10.1.1.0/24 */
+#define FWB_MSRC      0x0a030000 /* 10.3.0.0/16 */
+#define FWB_DST       0x0a020202 /* 10.2.2.2 */
+#define FWB_DPORT     8080
+#define FWB_ZONE      1
+#define FWB_MAC_DST   0x02
+#define FWB_MAC_SRC   0x04
+
+struct fwb_pkt {
+  struct ethhdr eth;
+  struct iphdr ip;
+  struct tcphdr tcp;
+} __attribute__((packed));
+
+static struct dp_fwv4_ent fwb_rules[FWB_MAX_RULES];
+static int fwb_status[FWB_MAX_RULES];
+
+static void
+fwb_mk_pkt(struct fwb_pkt *p, uint32_t saddr, uint32_t daddr, uint16_t dport)
+{
+  memset(p, 0, sizeof(*p));
+  memset(p->eth.h_dest, FWB_MAC_DST, ETH_ALEN);
+  memset(p->eth.h_source, FWB_MAC_SRC, ETH_ALEN);
+  p->eth.h_proto = htons(ETH_P_IP);
+
+  p->ip.version = 4;
+  p->ip.ihl = 5;
+  p->ip.ttl = 64;
+  p->ip.protocol = IPPROTO_TCP;
+  p->ip.tot_len = htons(sizeof(p->ip) + sizeof(p->tcp));
+  p->ip.saddr = htonl(saddr);
+  p->ip.daddr = htonl(daddr);
+
+  p->tcp.dest = htons(dport);
+  p->tcp.doff = 5;
+  p->tcp.syn = 1;
+}
+
+/*
+ * fwb_mk_rules - Rule i uses one of four mask patterns so that TSS gets
+ * several groups. None of them matches FWB_SRC/FWB_DST except the last
+ * rule, which has the lowest priority. Rules leave out ports as the rule
+ * list can not find single port rules again for delete.
+ */
+static void
+fwb_mk_rules(int n)
+{
+  struct dp_fwv4_ent *e;
+  int i;
+
+  memset(fwb_rules, 0, sizeof(fwb_rules));
+
+  for (i = 0; i < n; i++) {
+    e = &fwb_rules[i];
+    switch (i % 4) {
+    case 0:
+      e->k.source.val = 0xac000000 | (i << 8);
+      e->k.source.valid = 0xffffff00;
+      break;
+    case 1:
+      e->k.dest.val = 0xac110000 | i;
+      e->k.dest.valid = 0xffffffff;
+      break;
+    case 2:
+      e->k.source.val = 0xac120000;
+      e->k.source.valid = 0xffff0000;
+      e->k.dest.val = 0xac130000 | i;
+      e->k.dest.valid = 0xffffffff;
+      break;
+    default:
+      e->k.dest.val = 0xac000000 | (i << 8);
+      e->k.dest.valid = 0xffffff00;
+      break;
+    }
+    e->k.protocol.val = IPPROTO_TCP;
+    e->k.protocol.valid = 0xff;
+    e->k.zone.val = FWB_ZONE;
+    e->k.zone.valid = 0xffff;
+
+    e->fwa.ca.act_type = DP_SET_DROP;
+    e->fwa.ca.cidx = i;
+    e->fwa.ca.oaux = n - i + 1;
+  }
+
+  if (n > 0) {
+    e = &fwb_rules[n - 1];
+    memset(&e->k, 0, sizeof(e->k));
+    e->k.source.val = FWB_SRC;
+    e->k.source.valid = 0xffffff00;
+    e->k.protocol.val = IPPROTO_TCP;
+    e->k.protocol.valid = 0xff;
+    e->k.zone.val = FWB_ZONE;
+    e->k.zone.valid = 0xffff;
+    e->fwa.ca.oaux = 1;
+  }
+}
+
+/*
+ * fwb_run - Average cost of runs packets of p, each of a new flow. The
+ * duration reported by the kernel covers only the program run. nbad gets
+ * the number of packets whose verdict was not the expected one.
+ */
+static int
+fwb_run(int pfd, int ifindex, struct fwb_pkt *p, int runs, int drop,
+        uint32_t *ns, int *nbad)
+{
+  struct __sk_buff skb;
+  uint8_t out[256];
+  uint64_t tot = 0;
+  int k;
+  LIBBPF_OPTS(bpf_test_run_opts, opts,
+    .data_in = p,
+    .data_size_in = sizeof(*p),
+    .ctx_in = &skb,
+    .ctx_size_in = sizeof(skb),
+    .repeat = 1,
+  );
+
+  for (k = 0; k < runs; k++) {
+    p->tcp.source = htons(1024 + k);
+    memset(&skb, 0, sizeof(skb));
+    skb.ifindex = ifindex;
+    opts.data_out = out;
+    opts.data_size_out = sizeof(out);
+    opts.ctx_out = NULL;
+
+    if (bpf_prog_test_run_opts(pfd, &opts) != 0) {
+      return -1;
+    }
+    tot += opts.duration;
+    if ((opts.retval == TC_ACT_SHOT) != drop) {
+      (*nbad)++;
+    }
+  }
+
+  *ns = runs ? tot / runs : 0;
+  return 0;
+}
+
+/*
+ * fwb_setup_l2 - Let packets from FWB_MAC_SRC to FWB_MAC_DST on ifindex
+ * reach L3 and so CT and firewall
+ */
+static int
+fwb_setup_l2(int ifindex)
+{
+  struct intf_key key;
+  struct dp_intf_tact act;
+  struct dp_smac_key skey;
+  struct dp_smac_tact sact;
+  struct dp_tmac_key tkey;
+  struct dp_tmac_tact tact;
+
+  memset(&key, 0, sizeof(key));
+  memset(&act, 0, sizeof(act));
+  key.ifindex = ifindex;
+  act.ca.act_type = DP_SET_IFI;
+  act.set_ifi.xdp_ifidx = ifindex;
+  act.set_ifi.pten = DP_PTEN_DIS;
+  act.set_ifi.zone = FWB_ZONE;
+  if (llb_add_map_elem(LL_DP_INTF_MAP, &key, &act) != 0) {
+    return -1;
+  }
+
+  memset(&skey, 0, sizeof(skey));
+  memset(&sact, 0, sizeof(sact));
+  memset(skey.smac, FWB_MAC_SRC, sizeof(skey.smac));
+  sact.ca.act_type = DP_SET_NOP;
+  if (llb_add_map_elem(LL_DP_SMAC_MAP, &skey, &sact) != 0) {
+    return -1;
+  }
+
+  memset(&tkey, 0, sizeof(tkey));
+  memset(&tact, 0, sizeof(tact));
+  memset(tkey.mac, FWB_MAC_DST, sizeof(tkey.mac));
+  tact.ca.act_type = DP_SET_L3_EN;
+
+  return llb_add_map_elem(LL_DP_TMAC_MAP, &tkey, &tact);
+}
+
+static int
+fwb_prog_fd(void)
+{
+  uint32_t key = 0;
+  uint32_t id = 0;
+
+  /* Lookup from userspace gives the prog id of tc_packet_hook0 */
+  if (bpf_map_lookup_elem(llb_map2fd(LL_DP_PGM_MAP), &key, &id) != 0) {
+    return -1;
+  }
+
+  return bpf_prog_get_fd_by_id(id);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const int nrules[] = { 0, 100, 1000, 8000 };
+  struct ebpfcfg cfg;
+  struct fwb_pkt miss, hit;
+  uint32_t ns[2][2];
+  int nbad[2][2];
+  int runs = 10000;
+  int ifindex;
+  int engine;
+  int pfd;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "r:h")) != -1) {
+    switch (opt) {
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    default:
+      printf("Usage: %s [-r runs]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (runs <= 0 || runs > FWB_MAX_RUNS) {
+    fprintf(stderr, "runs must be 1..%d\n", FWB_MAX_RUNS);
+    return 1;
+  }
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.loglevel = LOG_WARN;
+  if (loxilb_main(&cfg) != 0) {
+    fprintf(stderr, "datapath load failed\n");
+    return 1;
+  }
+
+  ifindex = if_nametoindex("lo");
+  pfd = fwb_prog_fd();
+  if (!ifindex || pfd < 0 || fwb_setup_l2(ifindex) != 0) {
+    fprintf(stderr, "bench setup failed\n");
+    llb_unload_kern_all();
+    return 1;
+  }
+
+  printf("%8s %15s %15s %15s %15s\n", "rules",
+         "linear-miss", "linear-hit", "tss-miss", "tss-hit");
+
+  for (i = 0; i < (int)(sizeof(nrules)/sizeof(nrules[0])); i++) {
+    fwb_mk_rules(nrules[i]);
+    if (nrules[i] &&
+        llb_add_map_elems(LL_DP_FW4_MAP, fwb_rules, sizeof(fwb_rules[0]),
+                          fwb_rules, sizeof(fwb_rules[0]), nrules[i],
+                          fwb_status) != 0) {
+      fprintf(stderr, "%d rules: add failed\n", nrules[i]);
+      break;
+    }
+
+    memset(nbad, 0, sizeof(nbad));
+    for (engine = LLB_FW_ENGINE_LINEAR; engine <= LLB_FW_ENGINE_TSS; engine++) {
+      /* New source address per pass so that no flow is seen twice */
+      fwb_mk_pkt(&miss, FWB_MSRC | (i << 8) | (engine + 1), FWB_DST, FWB_DPORT);
+      fwb_mk_pkt(&hit, FWB_SRC | (i*2 + engine + 1), FWB_DST, FWB_DPORT);
+
+      if (llb_set_fw_engine(engine) != 0 ||
+          fwb_run(pfd, ifindex, &miss, runs, 0,
+                  &ns[engine][0], &nbad[engine][0]) != 0 ||
+          fwb_run(pfd, ifindex, &hit, runs, nrules[i] > 0,
+                  &ns[engine][1], &nbad[engine][1]) != 0) {
+        fprintf(stderr, "%d rules: test run failed\n", nrules[i]);
+        goto out;
+      }
+    }
+
+    printf("%8d %12uns%c %12uns%c %12uns%c %12uns%c\n", nrules[i],
+           ns[0][0], nbad[0][0] ? '*' : ' ', ns[0][1], nbad[0][1] ? '*' : ' ',
+           ns[1][0], nbad[1][0] ? '*' : ' ', ns[1][1], nbad[1][1] ? '*' : ' ');
+
+    if (nrules[i] &&
+        llb_del_map_elems(LL_DP_FW4_MAP, fwb_rules, sizeof(fwb_rules[0]),
+                          NULL, 0, nrules[i], fwb_status) != 0) {
+      fprintf(stderr, "%d rules: delete failed\n", nrules[i]);
+      break;
+    }
+  }
+
+out:
+  close(pfd);
+  llb_unload_kern_all();
+  return 0;
+}
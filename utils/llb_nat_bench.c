@@ -0,0 +1,630 @@
+/*
+ * llb_nat_bench.c: New connection rate of NAT round-robin selection
+ * Copyright (c) 2022-2025 LoxiLB Authors
+ *
+ * SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+ *
+ * Loads its own datapath (loxilb must not be running), installs a DNAT
+ * round-robin rule and sends TCP SYNs of new flows through the TC pipeline
+ * via BPF_PROG_TEST_RUN from 1..N threads, each pinned to its own cpu.
+ * Every packet sets up a new connection, i.e. selects an end-point and
+ * creates CT entries. Each thread count is run once with the per-cpu RR
+ * cursor and once with the spin-locked hint in the shared nat_map value.
+ * The locked path is only taken for rule ids past the per-cpu array, so
+ * the bench moves the installed rule's id there for that run.
+ *
+ * Reported per run are connection setups per second over all threads
+ * (wall clock, syscall included), the in-kernel time per setup and the
+ * spread of setups over end-points (most used over least used).
+ *
+ * With -m maglev it instead reports, from one thread, the in-kernel time
+ * per setup of RR, hash and Maglev selection, and the share of Maglev
+ * table slots which move to another end-point when one end-point is added
+ * or removed, next to the ideal share of 1/n.
+ *
+ * Built along with libloxilbdp (make -C kernel). Run as root:
+ *   ./llb_nat_bench [-m rr|maglev] [-t threads] [-r runs per thread]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include "bpf.h"
+
+#include "../kernel/loxilb_libdp.h"
+
+#define NRB_MAX_THREADS 64
+#define NRB_MAX_RUNS    (60000)
+#define NRB_RID         1
+#define NRB_RR_EPS      4
+#define NRB_SEL_EPS     16
+#define NRB_SRC         0x0a010000 /* 10.1.<thread>.1 */
+#define NRB_VIP         0x14000001 /* 20.0.0.1 */
+#define NRB_VPORT       80
+#define NRB_EP          0x1e000001 /* 30.0.0.1.. */
+#define NRB_EPORT       8080
+#define NRB_MAC_DST     0x02
+#define NRB_MAC_SRC     0x04
+
+struct nrb_pkt {
+  struct ethhdr eth;
+  struct iphdr ip;
+  struct tcphdr tcp;
+} __attribute__((packed));
+
+struct nrb_thr {
+  pthread_t t;
+  int cpu;
+  int runs;
+  int pfd;
+  int ifindex;
+  uint64_t dur;
+  int err;
+};
+
+static pthread_barrier_t nrb_bar;
+static uint32_t nrb_eps[LLB_MAX_NXFRMS];
+static uint64_t nrb_ep_cnt[LLB_MAX_NXFRMS];
+static int nrb_neps;
+
+static void
+nrb_mk_pkt(struct nrb_pkt *p, uint32_t saddr)
+{
+  memset(p, 0, sizeof(*p));
+  memset(p->eth.h_dest, NRB_MAC_DST, ETH_ALEN);
+  memset(p->eth.h_source, NRB_MAC_SRC, ETH_ALEN);
+  p->eth.h_proto = htons(ETH_P_IP);
+
+  p->ip.version = 4;
+  p->ip.ihl = 5;
+  p->ip.ttl = 64;
+  p->ip.protocol = IPPROTO_TCP;
+  p->ip.tot_len = htons(sizeof(p->ip) + sizeof(p->tcp));
+  p->ip.saddr = htonl(saddr);
+  p->ip.daddr = htonl(NRB_VIP);
+
+  p->tcp.dest = htons(NRB_VPORT);
+  p->tcp.doff = 5;
+  p->tcp.syn = 1;
+}
+
+/*
+ * nrb_thr_run - Pins itself to its cpu and, once all threads are ready,
+ * sends runs SYNs, each of a new flow
+ */
+static void *
+nrb_thr_run(void *arg)
+{
+  struct nrb_thr *th = arg;
+  struct __sk_buff skb;
+  struct nrb_pkt p;
+  uint8_t out[256];
+  cpu_set_t cs;
+  int k;
+  LIBBPF_OPTS(bpf_test_run_opts, opts,
+    .data_in = &p,
+    .data_size_in = sizeof(p),
+    .ctx_in = &skb,
+    .ctx_size_in = sizeof(skb),
+    .repeat = 1,
+  );
+
+  CPU_ZERO(&cs);
+  CPU_SET(th->cpu, &cs);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs) != 0) {
+    th->err = 1;
+  }
+
+  nrb_mk_pkt(&p, NRB_SRC | (th->cpu << 8) | 1);
+  th->dur = 0;
+
+  pthread_barrier_wait(&nrb_bar);
+
+  for (k = 0; k < th->runs && !th->err; k++) {
+    p.tcp.source = htons(1024 + k);
+    memset(&skb, 0, sizeof(skb));
+    skb.ifindex = th->ifindex;
+    opts.data_out = out;
+    opts.data_size_out = sizeof(out);
+
+    if (bpf_prog_test_run_opts(th->pfd, &opts) != 0) {
+      th->err = 1;
+      break;
+    }
+    th->dur += opts.duration;
+  }
+
+  return NULL;
+}
+
+/*
+ * nrb_setup_l2 - Let packets from NRB_MAC_SRC to NRB_MAC_DST on ifindex
+ * reach L3 and so NAT and CT
+ */
+static int
+nrb_setup_l2(int ifindex)
+{
+  struct intf_key key;
+  struct dp_intf_tact act;
+  struct dp_smac_key skey;
+  struct dp_smac_tact sact;
+  struct dp_tmac_key tkey;
+  struct dp_tmac_tact tact;
+
+  memset(&key, 0, sizeof(key));
+  memset(&act, 0, sizeof(act));
+  key.ifindex = ifindex;
+  act.ca.act_type = DP_SET_IFI;
+  act.set_ifi.xdp_ifidx = ifindex;
+  act.set_ifi.pten = DP_PTEN_DIS;
+  if (llb_add_map_elem(LL_DP_INTF_MAP, &key, &act) != 0) {
+    return -1;
+  }
+
+  memset(&skey, 0, sizeof(skey));
+  memset(&sact, 0, sizeof(sact));
+  memset(skey.smac, NRB_MAC_SRC, sizeof(skey.smac));
+  sact.ca.act_type = DP_SET_NOP;
+  if (llb_add_map_elem(LL_DP_SMAC_MAP, &skey, &sact) != 0) {
+    return -1;
+  }
+
+  memset(&tkey, 0, sizeof(tkey));
+  memset(&tact, 0, sizeof(tact));
+  memset(tkey.mac, NRB_MAC_DST, sizeof(tkey.mac));
+  tact.ca.act_type = DP_SET_L3_EN;
+
+  return llb_add_map_elem(LL_DP_TMAC_MAP, &tkey, &tact);
+}
+
+static void
+nrb_mk_nat_key(struct dp_nat_key *key)
+{
+  memset(key, 0, sizeof(*key));
+  key->daddr[0] = htonl(NRB_VIP);
+  key->dport = htons(NRB_VPORT);
+  key->l4proto = IPPROTO_TCP;
+}
+
+/*
+ * nrb_setup_nat - Install (or update) the rule with selection sel and the
+ * first n end-points of nrb_eps, end-point e being NRB_EP + e
+ */
+static int
+nrb_setup_nat(int sel, int n)
+{
+  struct dp_nat_key key;
+  struct dp_proxy_tacts *act;
+  int ret;
+  int i;
+
+  act = calloc(1, sizeof(*act));
+  if (!act) {
+    return -1;
+  }
+
+  nrb_mk_nat_key(&key);
+  act->ca.act_type = DP_SET_DNAT;
+  act->ca.cidx = NRB_RID;
+  act->sel_type = sel;
+  act->nxfrm = n;
+  for (i = 0; i < n; i++) {
+    act->nxfrms[i].nat_xip[0] = htonl(NRB_EP + nrb_eps[i]);
+    act->nxfrms[i].nat_xport = htons(NRB_EPORT);
+  }
+  nrb_neps = n;
+
+  ret = llb_add_map_elem(LL_DP_NAT_MAP, &key, act);
+  free(act);
+  return ret;
+}
+
+/*
+ * nrb_set_cidx - Change the rule id in the installed rule, which decides
+ * between the per-cpu cursor and the locked hint
+ */
+static int
+nrb_set_cidx(uint32_t cidx)
+{
+  struct dp_nat_key key;
+  struct dp_nat_tacts act;
+  int fd = llb_map2fd(LL_DP_NAT_MAP);
+
+  nrb_mk_nat_key(&key);
+  if (bpf_map_lookup_elem(fd, &key, &act) != 0) {
+    return -1;
+  }
+  act.ca.cidx = cidx;
+
+  return bpf_map_update_elem(fd, &key, &act, BPF_EXIST);
+}
+
+/*
+ * nrb_ct_ent_all - Deletes every CT entry and counts the forward ones per
+ * selected end-point
+ */
+static int
+nrb_ct_ent_all(int tid, void *k, void *ita)
+{
+  dp_map_ita_t *it = ita;
+  struct dp_ct_key *key = k;
+  struct dp_ct_tact *adat = it->val;
+
+  if (key->daddr[0] == htonl(NRB_VIP) && key->dport == htons(NRB_VPORT) &&
+      adat->ctd.aid < nrb_neps) {
+    nrb_ep_cnt[adat->ctd.aid]++;
+  }
+
+  return 1;
+}
+
+/*
+ * nrb_ct_flush - Remove all CT entries so that flows of the next run are
+ * new again and the CT map never fills up
+ */
+static void
+nrb_ct_flush(void)
+{
+  struct dp_ct_key next_key;
+  struct dp_ct_tact *adat;
+  dp_map_ita_t it;
+
+  adat = calloc(1, sizeof(*adat));
+  if (!adat) {
+    return;
+  }
+
+  memset(&it, 0, sizeof(it));
+  it.next_key = &next_key;
+  it.key_sz = sizeof(next_key);
+  it.val = adat;
+  it.val_sz = sizeof(*adat);
+
+  llb_map_loop_and_delete(LL_DP_CT_MAP, nrb_ct_ent_all, &it);
+  free(adat);
+}
+
+/*
+ * nrb_ep_spread - Setups of the most used end-point over those of the
+ * least used one, as counted by the last nrb_ct_flush()
+ */
+static double
+nrb_ep_spread(void)
+{
+  uint64_t min = 0, max = 0;
+  int i;
+
+  for (i = 0; i < nrb_neps; i++) {
+    if (i == 0 || nrb_ep_cnt[i] < min) min = nrb_ep_cnt[i];
+    if (nrb_ep_cnt[i] > max) max = nrb_ep_cnt[i];
+  }
+  memset(nrb_ep_cnt, 0, sizeof(nrb_ep_cnt));
+
+  return min ? (double)max / min : 0;
+}
+
+/*
+ * nrb_run - One run with nth threads on cpus 0..nth-1. Returns setups per
+ * second and the mean in-kernel time per setup in ns.
+ */
+static int
+nrb_run(struct nrb_thr *th, int nth, int runs, int pfd, int ifindex,
+        double *rate, uint32_t *ns)
+{
+  uint64_t start, end;
+  uint64_t dur = 0;
+  int err = 0;
+  int i;
+
+  pthread_barrier_init(&nrb_bar, NULL, nth + 1);
+
+  for (i = 0; i < nth; i++) {
+    memset(&th[i], 0, sizeof(th[i]));
+    th[i].cpu = i;
+    th[i].runs = runs;
+    th[i].pfd = pfd;
+    th[i].ifindex = ifindex;
+    if (pthread_create(&th[i].t, NULL, nrb_thr_run, &th[i]) != 0) {
+      /* Not reached by the missing threads, so can't be waited on */
+      fprintf(stderr, "thread create failed\n");
+      exit(1);
+    }
+  }
+
+  pthread_barrier_wait(&nrb_bar);
+  start = get_os_nsecs();
+
+  for (i = 0; i < nth; i++) {
+    pthread_join(th[i].t, NULL);
+    dur += th[i].dur;
+    err |= th[i].err;
+  }
+  end = get_os_nsecs();
+
+  pthread_barrier_destroy(&nrb_bar);
+
+  if (err) {
+    return -1;
+  }
+
+  *rate = (double)nth * runs * 1000000000ULL / (end - start);
+  *ns = dur / ((uint64_t)nth * runs);
+  return 0;
+}
+
+static int
+nrb_prog_fd(void)
+{
+  uint32_t key = 0;
+  uint32_t id = 0;
+
+  /* Lookup from userspace gives the prog id of tc_packet_hook0 */
+  if (bpf_map_lookup_elem(llb_map2fd(LL_DP_PGM_MAP), &key, &id) != 0) {
+    return -1;
+  }
+
+  return bpf_prog_get_fd_by_id(id);
+}
+
+/*
+ * nrb_maglev_eps - Read the rule's Maglev table into tbl as end-points
+ * (not arms, whose index shifts when an end-point is removed)
+ */
+static int
+nrb_maglev_eps(struct dp_maglev_tbl *tbl)
+{
+  uint32_t key = NRB_RID;
+  int i;
+
+  if (bpf_map_lookup_elem(llb_map2fd(LL_DP_NAT_MAGLEV_MAP), &key, tbl) != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < LLB_MAGLEV_TBL_SZ; i++) {
+    if (tbl->ep[i] >= nrb_neps) return -1;
+    tbl->ep[i] = nrb_eps[tbl->ep[i]];
+  }
+
+  return 0;
+}
+
+static double
+nrb_maglev_moved(struct dp_maglev_tbl *a, struct dp_maglev_tbl *b)
+{
+  uint32_t moved = 0;
+  int i;
+
+  for (i = 0; i < LLB_MAGLEV_TBL_SZ; i++) {
+    if (a->ep[i] != b->ep[i]) moved++;
+  }
+
+  return 100.0 * moved / LLB_MAGLEV_TBL_SZ;
+}
+
+/*
+ * nrb_maglev_remap - Share of slots moved by adding end-point n to n
+ * end-points and by removing end-point n/2 from them. Also gives the
+ * table build time of the last update.
+ */
+static int
+nrb_maglev_remap(int n, double *add, double *del, uint64_t *build_ns)
+{
+  struct dp_maglev_tbl *base, *tbl;
+  struct dp_maglev_stats st;
+  int ret = -1;
+  int i;
+
+  base = calloc(1, sizeof(*base));
+  tbl = calloc(1, sizeof(*tbl));
+  if (!base || !tbl) {
+    goto out;
+  }
+
+  for (i = 0; i <= n; i++) nrb_eps[i] = i;
+  if (nrb_setup_nat(NAT_LB_SEL_MAGLEV, n) != 0 || nrb_maglev_eps(base) != 0) {
+    goto out;
+  }
+
+  if (nrb_setup_nat(NAT_LB_SEL_MAGLEV, n + 1) != 0 ||
+      nrb_maglev_eps(tbl) != 0) {
+    goto out;
+  }
+  *add = nrb_maglev_moved(base, tbl);
+
+  for (i = n/2; i < n - 1; i++) nrb_eps[i] = i + 1;
+  if (nrb_setup_nat(NAT_LB_SEL_MAGLEV, n - 1) != 0 ||
+      nrb_maglev_eps(tbl) != 0) {
+    goto out;
+  }
+  *del = nrb_maglev_moved(base, tbl);
+
+  if (llb_get_maglev_stats(NRB_RID, &st) != 0) {
+    goto out;
+  }
+  *build_ns = st.build_ns;
+  ret = 0;
+out:
+  if (base) free(base);
+  if (tbl) free(tbl);
+  return ret;
+}
+
+static int
+nrb_maglev_bench(struct nrb_thr *th, int runs, int pfd, int ifindex)
+{
+  static const int sels[] = { NAT_LB_SEL_RR, NAT_LB_SEL_HASH,
+                              NAT_LB_SEL_MAGLEV };
+  static const char *sel_names[] = { "rr", "hash", "maglev" };
+  static const int neps[] = { 4, 16, 64, 256 };
+  double rate, spread;
+  double add, del;
+  uint64_t build_ns;
+  uint32_t ns;
+  int i;
+
+  printf("%8s %10s %8s   (%d end-points)\n", "sel", "conn-ns", "spread",
+         NRB_SEL_EPS);
+
+  for (i = 0; i < NRB_SEL_EPS; i++) nrb_eps[i] = i;
+  for (i = 0; i < (int)(sizeof(sels)/sizeof(sels[0])); i++) {
+    if (nrb_setup_nat(sels[i], NRB_SEL_EPS) != 0 ||
+        nrb_run(th, 1, runs, pfd, ifindex, &rate, &ns) != 0) {
+      fprintf(stderr, "%s: run failed\n", sel_names[i]);
+      return -1;
+    }
+    nrb_ct_flush();
+    spread = nrb_ep_spread();
+    printf("%8s %8uns %8.2f\n", sel_names[i], ns, spread);
+  }
+
+  printf("\n%8s %10s %10s %10s %10s %10s\n", "eps", "add-moved", "ideal",
+         "del-moved", "ideal", "build-us");
+
+  for (i = 0; i < (int)(sizeof(neps)/sizeof(neps[0])); i++) {
+    if (nrb_maglev_remap(neps[i], &add, &del, &build_ns) != 0) {
+      fprintf(stderr, "%d eps: maglev update failed\n", neps[i]);
+      return -1;
+    }
+    printf("%8d %9.2f%% %9.2f%% %9.2f%% %9.2f%% %10llu\n", neps[i],
+           add, 100.0 / (neps[i] + 1), del, 100.0 / neps[i],
+           (unsigned long long)build_ns / 1000);
+  }
+
+  return 0;
+}
+
+static int
+nrb_rr_bench(struct nrb_thr *th, int nth, int runs, int pfd, int ifindex)
+{
+  static const uint32_t cidx[2] = {
+    NRB_RID, LLB_NAT_EP_MAP_ENTRIES + NRB_RID
+  };
+  double rate[2], spread[2];
+  uint32_t ns[2];
+  int ret = 0;
+  int n, m;
+
+  for (n = 0; n < NRB_RR_EPS; n++) nrb_eps[n] = n;
+  if (nrb_setup_nat(NAT_LB_SEL_RR, NRB_RR_EPS) != 0) {
+    fprintf(stderr, "rule setup failed\n");
+    return -1;
+  }
+
+  printf("%8s %14s %10s %8s %14s %10s %8s\n", "threads",
+         "pcpu-conn/s", "pcpu-ns", "spread", "lock-conn/s", "lock-ns",
+         "spread");
+
+  for (n = 1; n <= nth; n++) {
+    for (m = 0; m < 2; m++) {
+      if (nrb_set_cidx(cidx[m]) != 0 ||
+          nrb_run(th, n, runs, pfd, ifindex, &rate[m], &ns[m]) != 0) {
+        fprintf(stderr, "%d threads: run failed\n", n);
+        ret = -1;
+        goto out;
+      }
+      nrb_ct_flush();
+      spread[m] = nrb_ep_spread();
+    }
+
+    printf("%8d %14.0f %8uns %8.2f %14.0f %8uns %8.2f\n", n,
+           rate[0], ns[0], spread[0], rate[1], ns[1], spread[1]);
+  }
+
+out:
+  nrb_set_cidx(NRB_RID);
+  return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static struct nrb_thr th[NRB_MAX_THREADS];
+  struct ebpfcfg cfg;
+  double rate;
+  uint32_t ns;
+  int nth = sysconf(_SC_NPROCESSORS_ONLN);
+  int runs = 10000;
+  int maglev = 0;
+  int ifindex;
+  int pfd;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:t:r:h")) != -1) {
+    switch (opt) {
+    case 'm':
+      maglev = strcmp(optarg, "maglev") == 0;
+      if (!maglev && strcmp(optarg, "rr") != 0) {
+        fprintf(stderr, "mode must be rr or maglev\n");
+        return 1;
+      }
+      break;
+    case 't':
+      nth = atoi(optarg);
+      break;
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    default:
+      printf("Usage: %s [-m rr|maglev] [-t threads] [-r runs per thread]\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  if (nth <= 0 || nth > NRB_MAX_THREADS) {
+    fprintf(stderr, "threads must be 1..%d\n", NRB_MAX_THREADS);
+    return 1;
+  }
+
+  /* Each flow takes two CT entries */
+  if (runs <= 0 || runs > NRB_MAX_RUNS ||
+      (uint64_t)nth * runs * 2 > LLB_CT_MAP_ENTRIES) {
+    fprintf(stderr, "runs must be 1..%d and fit the CT map\n", NRB_MAX_RUNS);
+    return 1;
+  }
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.loglevel = LOG_WARN;
+  if (loxilb_main(&cfg) != 0) {
+    fprintf(stderr, "datapath load failed\n");
+    return 1;
+  }
+
+  ifindex = if_nametoindex("lo");
+  pfd = nrb_prog_fd();
+  nrb_eps[0] = 0;
+  if (!ifindex || pfd < 0 || nrb_setup_l2(ifindex) != 0 ||
+      nrb_setup_nat(NAT_LB_SEL_RR, 1) != 0) {
+    fprintf(stderr, "bench setup failed\n");
+    llb_unload_kern_all();
+    return 1;
+  }
+
+  /* First run of a process is slower, so one is thrown away */
+  if (nrb_run(th, 1, runs, pfd, ifindex, &rate, &ns) != 0) {
+    fprintf(stderr, "warm-up run failed\n");
+    goto out;
+  }
+  nrb_ct_flush();
+  nrb_ep_spread();
+
+  if (maglev) {
+    nrb_maglev_bench(th, runs, pfd, ifindex);
+  } else {
+    nrb_rr_bench(th, nth, runs, pfd, ifindex);
+  }
+
+out:
+  close(pfd);
+  llb_unload_kern_all();
+  return 0;
+}